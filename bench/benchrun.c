@@ -0,0 +1,285 @@
+/*
+ * benchrun
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * benchrun runs a command with a file as standard input and prints one JSON object per line:
+ * throughput in MB/s of input, lines/s, peak RSS and allocations per MB of input.
+ * lines/s counts lines of input or output, whichever has more, i.e. lines of flat text.
+ * The fastest of the runs is reported. Output of the command is counted and discarded.
+ * If the input is '-', standard input of benchrun is passed through to the command once and counted,
+ * so a stream larger than the disk can be measured. -m fails if the peak RSS exceeds the limit.
+ */
+
+typedef struct result {
+    double seconds;
+    unsigned long long input_bytes;
+    unsigned long long input_lines;
+    unsigned long long output_bytes;
+    unsigned long long output_lines;
+    long peak_rss_kb;
+    int status;
+} result;
+
+double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(char *input, char *argv[], char *preload, char *count_file, result *r) {
+    static char buf[65536], inbuf[65536];
+    struct rusage usage;
+    struct pollfd fds[2];
+    int pipefd[2], inputfd[2] = { -1, -1 }, streaming = strcmp(input, "-") == 0, status, fd, nfds;
+    size_t pending = 0, offset = 0;
+    ssize_t length, i;
+    double start;
+    pid_t pid;
+
+    if(pipe(pipefd) != 0 || (streaming && pipe(inputfd) != 0)) {
+        perror("pipe");
+        exit(1);
+    }
+    start = now();
+    if((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    } else if(pid == 0) {
+        if(streaming) {
+            fd = inputfd[0];
+            close(inputfd[1]);
+            signal(SIGPIPE, SIG_DFL);
+        } else if((fd = open(input, O_RDONLY)) < 0) {
+            perror(input);
+            _exit(127);
+        }
+        dup2(fd, 0);
+        dup2(pipefd[1], 1);
+        close(fd);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if(preload != NULL) {
+            setenv("LD_PRELOAD", preload, 1);
+            setenv("MALLOCOUNT_FILE", count_file, 1);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+    if(streaming) {
+        close(inputfd[0]);
+        fcntl(inputfd[1], F_SETFL, O_NONBLOCK);
+    }
+    r->input_bytes = r->input_lines = 0;
+    r->output_bytes = r->output_lines = 0;
+    while(1) {
+        fds[0].fd = pipefd[0];
+        fds[0].events = POLLIN;
+        nfds = 1;
+        if(inputfd[1] >= 0) {
+            fds[1].fd = pending > 0 ? inputfd[1] : 0;
+            fds[1].events = pending > 0 ? POLLOUT : POLLIN;
+            nfds = 2;
+        }
+        if(poll(fds, nfds, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+        if(nfds == 2 && fds[1].revents != 0) {
+            if(pending == 0) {
+                if((length = read(0, inbuf, sizeof(inbuf))) <= 0) {
+                    close(inputfd[1]);
+                    inputfd[1] = -1;
+                } else {
+                    r->input_bytes += length;
+                    for(i = 0; i < length; i++) {
+                        r->input_lines += inbuf[i] == '\n';
+                    }
+                    pending = length;
+                    offset = 0;
+                }
+            } else if((length = write(inputfd[1], inbuf + offset, pending)) >= 0) {
+                offset += length;
+                pending -= length;
+            } else if(errno != EAGAIN && errno != EINTR) {
+                /* the command does not read any more */
+                close(inputfd[1]);
+                inputfd[1] = -1;
+            }
+        }
+        if(fds[0].revents != 0) {
+            if((length = read(pipefd[0], buf, sizeof(buf))) <= 0) {
+                break;
+            }
+            r->output_bytes += length;
+            for(i = 0; i < length; i++) {
+                r->output_lines += buf[i] == '\n';
+            }
+        }
+    }
+    close(pipefd[0]);
+    if(inputfd[1] >= 0) {
+        close(inputfd[1]);
+    }
+    if(wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        exit(1);
+    }
+    r->seconds = now() - start;
+    r->peak_rss_kb = usage.ru_maxrss;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void print_json_string(const char *str) {
+    putchar('\"');
+    for(; *str != '\0'; str++) {
+        if(*str == '\"' || *str == '\\') {
+            putchar('\\');
+        }
+        putchar(*str);
+    }
+    putchar('\"');
+}
+
+void usage() {
+    fprintf(stderr, "usage: benchrun [-r runs] [-p mallocount.so] [-m max-rss-kb] name input|- command [argument...]\n");
+    exit(2);
+}
+
+unsigned long long count_lines(char *filename) {
+    static char buf[65536];
+    unsigned long long lines = 0;
+    size_t length, i;
+    FILE *fp;
+
+    if((fp = fopen(filename, "r")) == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    while((length = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for(i = 0; i < length; i++) {
+            lines += buf[i] == '\n';
+        }
+    }
+    fclose(fp);
+    return lines;
+}
+
+int main(int argc, char *argv[]) {
+    char *preload = NULL, count_file[] = "/tmp/benchrun.XXXXXX";
+    int argindex = 1, runs = 3, streaming, i, fd;
+    long max_rss_kb = 0;
+    unsigned long allocations = 0;
+    unsigned long long allocated_bytes = 0, input_lines, lines;
+    double megabytes;
+    result best, r;
+    struct stat st;
+    FILE *fp;
+
+    while(argindex + 1 < argc && argv[argindex][0] == '-') {
+        if(strcmp(argv[argindex], "-r") == 0 && (runs = atoi(argv[argindex + 1])) > 0) {
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "-m") == 0 && (max_rss_kb = atol(argv[argindex + 1])) > 0) {
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "-p") == 0) {
+            preload = argv[argindex + 1];
+            argindex += 2;
+        } else {
+            usage();
+        }
+    }
+    if(argc - argindex < 3) {
+        usage();
+    }
+    if((streaming = strcmp(argv[argindex + 1], "-") == 0)) {
+        /* standard input can be read only once */
+        runs = 1;
+        signal(SIGPIPE, SIG_IGN);
+    } else if(stat(argv[argindex + 1], &st) != 0) {
+        perror(argv[argindex + 1]);
+        return 1;
+    }
+    if(preload != NULL) {
+        if((fd = mkstemp(count_file)) < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        close(fd);
+    }
+
+    run(argv[argindex + 1], argv + argindex + 2, preload, count_file, &best);
+    if(streaming) {
+        st.st_size = best.input_bytes;
+        input_lines = best.input_lines;
+    } else {
+        input_lines = count_lines(argv[argindex + 1]);
+    }
+    megabytes = st.st_size / (1024.0 * 1024.0);
+    for(i = 1; i < runs; i++) {
+        run(argv[argindex + 1], argv + argindex + 2, preload, count_file, &r);
+        if(r.peak_rss_kb < best.peak_rss_kb) {
+            r.peak_rss_kb = best.peak_rss_kb;
+        }
+        if(r.seconds < best.seconds) {
+            best = r;
+        } else {
+            best.peak_rss_kb = r.peak_rss_kb;
+        }
+    }
+    if(preload != NULL) {
+        if((fp = fopen(count_file, "r")) != NULL) {
+            if(fscanf(fp, "%lu %llu", &allocations, &allocated_bytes) != 2) {
+                allocations = allocated_bytes = 0;
+            }
+            fclose(fp);
+        }
+        unlink(count_file);
+    }
+
+    lines = input_lines > best.output_lines ? input_lines : best.output_lines;
+    printf("{\"name\":");
+    print_json_string(argv[argindex]);
+    printf(",\"input\":");
+    print_json_string(argv[argindex + 1]);
+    printf(",\"time\":%ld", (long)time(NULL));
+    printf(",\"runs\":%d,\"status\":%d", runs, best.status);
+    printf(",\"input_bytes\":%lld,\"input_lines\":%llu", (long long)st.st_size, input_lines);
+    printf(",\"output_bytes\":%llu,\"output_lines\":%llu", best.output_bytes, best.output_lines);
+    printf(",\"seconds\":%.6f,\"mb_per_s\":%.3f,\"lines_per_s\":%.0f", best.seconds, megabytes / best.seconds, lines / best.seconds);
+    printf(",\"peak_rss_kb\":%ld", best.peak_rss_kb);
+    if(preload != NULL) {
+        printf(",\"allocations\":%lu,\"allocated_bytes\":%llu,\"allocations_per_mb\":%.1f", allocations, allocated_bytes, allocations / megabytes);
+    }
+    printf("}\n");
+    if(max_rss_kb > 0 && best.peak_rss_kb > max_rss_kb) {
+        fprintf(stderr, "benchrun: peak RSS %ld kB exceeds %ld kB\n", best.peak_rss_kb, max_rss_kb);
+        return 1;
+    }
+    return best.status;
+}
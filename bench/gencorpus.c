@@ -0,0 +1,277 @@
+/*
+ * gencorpus
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+/*
+ * gencorpus writes a JSON document of the given kind and size to standard output.
+ * The document is a top-level array of records and is the same for the same seed.
+ */
+
+static unsigned long long random_state;
+static long written = 0;
+
+/* xorshift64* */
+unsigned long random_next() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (unsigned long)((random_state * 2685821657736338717ULL) >> 32);
+}
+
+unsigned long random_below(unsigned long bound) {
+    return random_next() % bound;
+}
+
+void emit_char(int ch) {
+    putchar(ch);
+    written++;
+}
+
+void emit_string(const char *str) {
+    fputs(str, stdout);
+    written += strlen(str);
+}
+
+void emit_format(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    written += vprintf(format, args);
+    va_end(args);
+}
+
+static const char *words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa"
+};
+
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *utf8_words[] = { "\xe3\x81\x82", "\xc3\xa9t\xc3\xa9", "\xf0\x9f\x98\x80", "\xce\xb1\xce\xb2" };
+
+#define UTF8_WORDS (sizeof(utf8_words) / sizeof(utf8_words[0]))
+
+/* random values are drawn in separate statements, so the corpus does not depend on evaluation order of arguments */
+void print_number() {
+    unsigned long a, b;
+
+    switch(random_below(4)) {
+    case 0:
+        emit_format("%lu", random_below(1000));
+        break;
+    case 1:
+        emit_format("-%lu", random_next());
+        break;
+    case 2:
+        a = random_below(100000);
+        b = random_below(1000);
+        emit_format("%lu.%03lu", a, b);
+        break;
+    default:
+        a = random_below(10);
+        b = random_below(100000);
+        emit_format("%lu.%luE-%lu", a, b, random_below(300));
+        break;
+    }
+}
+
+void print_words(int count) {
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(i > 0) {
+            emit_char(' ');
+        }
+        emit_string(random_below(8) == 0 ? utf8_words[random_below(UTF8_WORDS)] : words[random_below(WORDS)]);
+    }
+}
+
+void print_escaped_string() {
+    static const char *escapes[] = { "\\n", "\\t", "\\\"", "\\\\", "\\/", "\\u3042", "\\u00e9", "\\ud83d\\ude00" };
+    int i, count = 4 + (int)random_below(12);
+
+    emit_char('\"');
+    for(i = 0; i < count; i++) {
+        if(random_below(2) == 0) {
+            emit_string(escapes[random_below(sizeof(escapes) / sizeof(escapes[0]))]);
+        } else {
+            emit_string(words[random_below(WORDS)]);
+        }
+    }
+    emit_char('\"');
+}
+
+/* object with many keys of all types */
+void print_wide() {
+    unsigned long a;
+    int i;
+
+    emit_char('{');
+    for(i = 0; i < 40; i++) {
+        emit_format("%s\"field%d\":", i > 0 ? "," : "", i);
+        switch(i % 5) {
+        case 0:
+            emit_format("%lu", random_below(1000000));
+            break;
+        case 1:
+            emit_char('\"');
+            print_words(1 + (int)random_below(3));
+            emit_char('\"');
+            break;
+        case 2:
+            print_number();
+            break;
+        case 3:
+            emit_string(random_below(3) == 0 ? "null" : random_below(2) ? "true" : "false");
+            break;
+        default:
+            a = random_below(100);
+            emit_format("[%lu,%lu]", a, random_below(100));
+            break;
+        }
+    }
+    emit_char('}');
+}
+
+/* objects and arrays nested 64 levels */
+void print_deep() {
+    int depth = 64, i;
+    char closing[64];
+
+    for(i = 0; i < depth; i++) {
+        if(random_below(2) == 0) {
+            emit_format("{\"%s\":", words[random_below(WORDS)]);
+            closing[i] = '}';
+        } else {
+            emit_char('[');
+            closing[i] = ']';
+        }
+    }
+    print_number();
+    for(i = depth - 1; i >= 0; i--) {
+        emit_char(closing[i]);
+    }
+}
+
+/* long strings */
+void print_strings() {
+    int i;
+
+    emit_char('{');
+    for(i = 0; i < 4; i++) {
+        emit_format("%s\"text%d\":\"", i > 0 ? "," : "", i);
+        print_words(20 + (int)random_below(60));
+        emit_char('\"');
+    }
+    emit_char('}');
+}
+
+/* numbers of various forms */
+void print_numbers() {
+    int i;
+
+    emit_char('[');
+    for(i = 0; i < 32; i++) {
+        if(i > 0) {
+            emit_char(',');
+        }
+        print_number();
+    }
+    emit_char(']');
+}
+
+/* strings with many escape sequences */
+void print_escapes() {
+    int i;
+
+    emit_char('{');
+    for(i = 0; i < 8; i++) {
+        emit_format("%s\"e%d\":", i > 0 ? "," : "", i);
+        print_escaped_string();
+    }
+    emit_char('}');
+}
+
+/* large arrays of small values */
+void print_arrays() {
+    int i;
+
+    emit_char('[');
+    for(i = 0; i < 1000; i++) {
+        emit_format(i > 0 ? ",%lu" : "%lu", random_below(100));
+    }
+    emit_char(']');
+}
+
+typedef struct corpus {
+    const char *name;
+    void (*print_record)();
+} corpus;
+
+static const corpus corpora[] = {
+    { "wide", print_wide },
+    { "deep", print_deep },
+    { "strings", print_strings },
+    { "numbers", print_numbers },
+    { "escapes", print_escapes },
+    { "arrays", print_arrays }
+};
+
+#define CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+void usage() {
+    size_t i;
+
+    fprintf(stderr, "usage: gencorpus [-s seed] kind megabytes\n");
+    fprintf(stderr, "kind:");
+    for(i = 0; i < CORPORA; i++) {
+        fprintf(stderr, " %s", corpora[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const corpus *kind = NULL;
+    int argindex = 1;
+    long size;
+    size_t i;
+
+    random_state = 88172645463325252ULL;
+    if(argc > 2 && strcmp(argv[1], "-s") == 0) {
+        random_state += strtoull(argv[2], NULL, 10);
+        argindex += 2;
+    }
+    if(argc - argindex != 2) {
+        usage();
+    }
+    for(i = 0; i < CORPORA; i++) {
+        if(strcmp(argv[argindex], corpora[i].name) == 0) {
+            kind = &corpora[i];
+        }
+    }
+    if(kind == NULL || (size = atol(argv[argindex + 1]) * 1024 * 1024) <= 0) {
+        usage();
+    }
+
+    emit_char('[');
+    while(1) {
+        emit_char('\n');
+        kind->print_record();
+        if(written >= size) {
+            break;
+        }
+        emit_char(',');
+    }
+    emit_string("\n]\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * mallocount
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * mallocount.so is loaded by LD_PRELOAD and counts calls of malloc, calloc and realloc.
+ * The count and the requested bytes are written to the file named by MALLOCOUNT_FILE at exit.
+ * The functions of glibc are called through their __libc_ names, because dlsym() itself allocates.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+static unsigned long long allocated_bytes = 0;
+
+void *malloc(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    allocated_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor))
+static void write_count() {
+    char *filename = getenv("MALLOCOUNT_FILE"), buf[64];
+    int fd, length;
+
+    if(filename == NULL || (fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        return;
+    }
+    length = snprintf(buf, sizeof(buf), "%lu %llu\n", allocations, allocated_bytes);
+    if(write(fd, buf, length) != length) {
+        /* the harness reports no count */
+    }
+    close(fd);
+}
@@ -6,89 +6,601 @@
  * This software is released under the MIT License.
  * http://opensource.org/licenses/mit-license.php
  **/
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glob.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#ifdef FLATJSON_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* linux/fs.h defines its own */
+#undef BLOCK_SIZE
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef FLATJSON_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FLATJSON_ZSTD
+#include <zstd.h>
+#endif
 #include "common.h"
 
 #define INIT_STRING_LENGTH 20
 
-void *xalloc(int size) {
-    void *result;
+/*
+ * The size of each block is kept in front of it to count bytes in use for --stats.
+ * Blocks of xalloc() and xrealloc() must be released by xfree().
+ */
+#define ALLOC_HEADER 16
+
+static unsigned long long alloc_calls = 0;
+static unsigned long long alloc_bytes = 0;
+static unsigned long long alloc_current = 0;
+static unsigned long long alloc_peak = 0;
+/* the counters are updated by atomic operations while run_file_pool() runs threads. */
+static int alloc_atomic = 0;
+
+static void *count_alloc(char *block, int size) {
+    unsigned long long current, peak;
 
-    if((result = malloc(size)) == NULL) {
+    if(block == NULL) {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_ERROR);
     }
-    return result;
+    *(size_t *)block = size;
+    if(alloc_atomic) {
+        __atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+        current = __atomic_add_fetch(&alloc_current, size, __ATOMIC_RELAXED);
+        peak = __atomic_load_n(&alloc_peak, __ATOMIC_RELAXED);
+        while(current > peak && !__atomic_compare_exchange_n(&alloc_peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return block + ALLOC_HEADER;
+    }
+    alloc_calls++;
+    alloc_bytes += size;
+    if((alloc_current += size) > alloc_peak) {
+        alloc_peak = alloc_current;
+    }
+    return block + ALLOC_HEADER;
+}
+
+static void uncount_alloc(char *block) {
+    if(alloc_atomic) {
+        __atomic_sub_fetch(&alloc_current, *(size_t *)block, __ATOMIC_RELAXED);
+    } else {
+        alloc_current -= *(size_t *)block;
+    }
+}
+
+void *xalloc(int size) {
+    return count_alloc((char *)malloc(size + ALLOC_HEADER), size);
+}
+
+void *xrealloc(void *ptr, int size) {
+    char *block = NULL;
+
+    if(ptr != NULL) {
+        block = (char *)ptr - ALLOC_HEADER;
+        uncount_alloc(block);
+    }
+    return count_alloc((char *)realloc(block, size + ALLOC_HEADER), size);
 }
 
-static int buffer_len;
-static char *buffer = NULL;
-static char *buffer_ptr;
+void xfree(void *ptr) {
+    char *block;
+
+    if(ptr != NULL) {
+        block = (char *)ptr - ALLOC_HEADER;
+        uncount_alloc(block);
+        free(block);
+    }
+}
 
-void init_buffer() {
-    if(buffer != NULL) {
-        free(buffer);
+void init_buffer(string_buffer *b) {
+    if(b->value == NULL) {
+        b->value = (char *)xalloc(INIT_STRING_LENGTH);
+        b->length = INIT_STRING_LENGTH;
     }
-    buffer = buffer_ptr = (char *)xalloc(INIT_STRING_LENGTH);
-    buffer_len = INIT_STRING_LENGTH;
+    b->ptr = b->value;
+}
+
+void free_buffer(string_buffer *b) {
+    xfree(b->value);
+    b->value = b->ptr = NULL;
+    b->length = 0;
 }
 
-void append_buffer(char ch) {
+/* makes room for size characters and a terminator after ptr. */
+static void reserve_buffer(string_buffer *b, int size) {
     char *tmp;
 
-    if(buffer_ptr - buffer >= buffer_len - 1) {
-        tmp = buffer;
-        buffer = (char *)xalloc(buffer_len * 2);
-        memcpy(buffer, tmp, (buffer_ptr - tmp) * sizeof(char));
-        buffer_ptr = buffer + buffer_len - 1;
-        buffer_len *= 2;
-        free(tmp);
+    while(b->ptr - b->value >= b->length - size) {
+        tmp = b->value;
+        b->value = (char *)xalloc(b->length * 2);
+        memcpy(b->value, tmp, (b->ptr - tmp) * sizeof(char));
+        b->ptr = b->value + (b->ptr - tmp);
+        b->length *= 2;
+        xfree(tmp);
+    }
+}
+
+void append_buffer(string_buffer *b, char ch) {
+    if(b->ptr - b->value >= b->length - 1) {
+        reserve_buffer(b, 1);
     }
-    *buffer_ptr++ = ch;
+    *b->ptr++ = ch;
 }
 
-int equals_buffer(const char *str) {
+int equals_buffer(string_buffer *b, const char *str) {
     int result;
 
-    append_buffer('\0');
-    result = strcmp(buffer, str);
-    buffer_ptr--;
+    append_buffer(b, '\0');
+    result = strcmp(b->value, str);
+    b->ptr--;
     return !result;
 }
 
-char *to_string_buffer() {
+char *to_string_buffer(string_buffer *b) {
     char *result;
 
-    append_buffer('\0');
-    result = (char *)xalloc(buffer_ptr - buffer);
-    strcpy(result, buffer);
+    append_buffer(b, '\0');
+    result = (char *)xalloc(b->ptr - b->value);
+    strcpy(result, b->value);
+    b->ptr--;
     return result;
 }
 
-int append_codepoint_buffer(int codepoint) {
-    if(codepoint < 0x80) {
-        append_buffer((char)codepoint);
-    } else if(codepoint < 0x800) {
-        append_buffer(0xd0 | (codepoint >> 6));
-        append_buffer(0x80 | (codepoint & 0x03f));
-    } else if(codepoint < 0x10000) {
-        append_buffer(0xe0 | (codepoint >> 12));
-        append_buffer(0x80 | ((codepoint >> 6) & 0x3f));
-        append_buffer(0x80 | (codepoint & 0x3f));
-    } else if(codepoint < 0x110000) {
-        append_buffer(0xf0 | (codepoint >> 18));
-        append_buffer(0x80 | ((codepoint >> 12) & 0x3f));
-        append_buffer(0x80 | ((codepoint >> 6) & 0x3f));
-        append_buffer(0x80 | (codepoint & 0x3f));
-    } else {
+#define INIT_INTERN_SIZE 256
+
+static unsigned int hash_bytes(const char *str, int length) {
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for(i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void grow_intern_table(intern_table *t) {
+    intern_entry *old_entries = t->entries;
+    int *old_ids = t->ids, old_size = t->size, i, j;
+
+    t->size = t->size == 0 ? INIT_INTERN_SIZE : t->size * 2;
+    t->entries = (intern_entry *)xalloc(t->size * sizeof(intern_entry));
+    t->ids = (int *)xalloc(t->size * sizeof(int));
+    memset(t->entries, 0, t->size * sizeof(intern_entry));
+    for(i = 0; i < old_size; i++) {
+        if(old_entries[i].string != NULL) {
+            for(j = old_entries[i].hash & (t->size - 1); t->entries[j].string != NULL; j = (j + 1) & (t->size - 1));
+            t->entries[j] = old_entries[i];
+            t->ids[j] = old_ids[i];
+        }
+    }
+    xfree(old_entries);
+    xfree(old_ids);
+
+    xfree(t->strings);
+    t->strings = (intern_entry **)xalloc(t->size / 2 * sizeof(intern_entry *));
+    for(i = 0; i < t->size; i++) {
+        if(t->entries[i].string != NULL) {
+            t->strings[t->ids[i]] = &t->entries[i];
+        }
+    }
+}
+
+/* returns the slot of str, which is empty if str is not interned */
+static int find_intern_slot(intern_table *t, const char *str, int length, unsigned int hash) {
+    int i;
+
+    for(i = hash & (t->size - 1); t->entries[i].string != NULL; i = (i + 1) & (t->size - 1)) {
+        if(t->entries[i].hash == hash && t->entries[i].length == length && memcmp(t->entries[i].string, str, length) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+int intern(intern_table *t, const char *str, int length) {
+    unsigned int hash = hash_bytes(str, length);
+    int i;
+
+    if(t->count >= t->size / 2) {
+        grow_intern_table(t);
+    }
+    if(t->entries[i = find_intern_slot(t, str, length, hash)].string != NULL) {
+        return t->ids[i];
+    }
+    t->entries[i].string = (char *)xalloc(length + 1);
+    memcpy(t->entries[i].string, str, length);
+    t->entries[i].string[length] = '\0';
+    t->entries[i].length = length;
+    t->entries[i].hash = hash;
+    t->ids[i] = t->count;
+    t->strings[t->count] = &t->entries[i];
+    return t->count++;
+}
+
+int intern_buffer(intern_table *t, string_buffer *b) {
+    return intern(t, b->value, b->ptr - b->value);
+}
+
+/* returns the id of str or -1 if str is not interned. The table is not changed. */
+int find_interned(intern_table *t, const char *str, int length) {
+    int i;
+
+    if(t->size == 0) {
+        return -1;
+    }
+    i = find_intern_slot(t, str, length, hash_bytes(str, length));
+    return t->entries[i].string != NULL ? t->ids[i] : -1;
+}
+
+void free_intern_table(intern_table *t) {
+    int i;
+
+    for(i = 0; i < t->size; i++) {
+        xfree(t->entries[i].string);
+    }
+    xfree(t->entries);
+    xfree(t->ids);
+    xfree(t->strings);
+    memset(t, 0, sizeof(intern_table));
+}
+
+/*
+ * encodes codepoint by UTF-8 into buf and returns its length, or 0 if codepoint is out of range.
+ * The length is computed by comparisons and the bytes are filled from the last one without branches.
+ */
+int encode_utf8(char *buf, int codepoint) {
+    static const unsigned char leads[] = { 0x00, 0xc0, 0xe0, 0xf0 };
+    int extra, i;
+
+    if((unsigned int)codepoint >= 0x110000) {
+        return 0;
+    }
+    extra = (codepoint >= 0x80) + (codepoint >= 0x800) + (codepoint >= 0x10000);
+    for(i = extra; i > 0; i--) {
+        buf[i] = (char)(0x80 | (codepoint & 0x3f));
+        codepoint >>= 6;
+    }
+    buf[0] = (char)(leads[extra] | codepoint);
+    return extra + 1;
+}
+
+int append_codepoint_buffer(string_buffer *b, int codepoint) {
+    int length;
+
+    reserve_buffer(b, 4);
+    if((length = encode_utf8(b->ptr, codepoint)) == 0) {
         return 0;
     }
+    b->ptr += length;
     return 1;
 }
 
+static const signed char hex_digits[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* decodes 4 hex digits of \uXXXX at once and returns the value, or -1 if any of them is not a hex digit. */
+int decode_hex4(const char *hex) {
+    int d0 = hex_digits[(unsigned char)hex[0]], d1 = hex_digits[(unsigned char)hex[1]];
+    int d2 = hex_digits[(unsigned char)hex[2]], d3 = hex_digits[(unsigned char)hex[3]];
+
+    return (d0 | d1 | d2 | d3) < 0 ? -1 : (d0 << 12) | (d1 << 8) | (d2 << 4) | d3;
+}
+
+/*
+ * escape sequences of JSON strings, shared by the parsers of flatj and libflatjson
+ * so that they accept the same strings.
+ */
+
+/* returns the character of an escape sequence \ch other than \u, or -1 if ch is not one of them. */
+int decode_escape(int ch) {
+    switch(ch) {
+    case '\"': case '\\': case '/':
+        return ch;
+    case 'b':
+        return '\b';
+    case 'f':
+        return '\f';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 't':
+        return '\t';
+    default:
+        return -1;
+    }
+}
+
+/* returns ch of the escape sequence \ch which a flat text prints for a character, or 0 if it is printed as it is. */
+int encode_escape(int ch) {
+    switch(ch) {
+    case '\\':
+        return '\\';
+    case '\b':
+        return 'b';
+    case '\f':
+        return 'f';
+    case '\n':
+        return 'n';
+    case '\r':
+        return 'r';
+    case '\t':
+        return 't';
+    default:
+        return 0;
+    }
+}
+
+int surrogate_to_codepoint(int high, int low) {
+    int h = high - 0xD800, l = low - 0xDC00;
+
+    return (h << 10) + l + 0x10000;
+}
+
+/*
+ * decodes XXXX of \uXXXX. Returns the codepoint, ESCAPE_INVALID if XXXX is not 4 hex digits
+ * or ESCAPE_SURROGATE if it is a low surrogate without a high surrogate before it.
+ * A high surrogate is returned as it is and decode_surrogate_pair() combines it with the next \uXXXX.
+ */
+int decode_unicode_escape(const char *hex) {
+    int codepoint = decode_hex4(hex);
+
+    return is_low_surrogate(codepoint) ? ESCAPE_SURROGATE : codepoint;
+}
+
+/* decodes XXXX of \uXXXX after a high surrogate and returns the codepoint of the pair or an error. */
+int decode_surrogate_pair(int high, const char *hex) {
+    int low = decode_hex4(hex);
+
+    if(low < 0) {
+        return ESCAPE_INVALID;
+    }
+    return is_low_surrogate(low) ? surrogate_to_codepoint(high, low) : ESCAPE_SURROGATE;
+}
+
+/* returns the message of an error of escape sequence. */
+const char *escape_error(int error) {
+    return error == ESCAPE_SURROGATE ? "invalid surrogate pair" : "invalid escape sequence";
+}
+
+/*
+ * UTF-8 validator
+ *
+ * Bytes are validated in blocks of 16. With SSSE3 the block is checked by lookup tables of the high and low nibbles
+ * of each byte and the high nibble of the next byte, which find every invalid pair of bytes at once;
+ * lengths of 3 and 4 bytes are checked by the bytes 2 and 3 before. Without SSSE3 a scalar state machine is used.
+ * The end of a string is padded by zeros, so an incomplete sequence is found as a lead byte followed by ASCII.
+ */
+#define UTF8_TOO_SHORT 0x01
+#define UTF8_TOO_LONG 0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE 0x08
+#define UTF8_SURROGATE 0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS 0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static size_t validate_blocks_scalar(utf8_validator *v, const unsigned char *ptr, size_t count, int string) {
+    size_t i;
+    int j, ch;
+
+    for(i = 0; i < count; i++, ptr += 16) {
+        if(string && string_run((const char *)ptr, (const char *)ptr + 16) < 16) {
+            break;
+        }
+        for(j = 0; j < 16; j++) {
+            ch = ptr[j];
+            if(v->need > 0) {
+                if(ch < v->lower || ch > v->upper) {
+                    v->error = 1;
+                    v->need = 0;
+                } else {
+                    v->need--;
+                    v->lower = 0x80;
+                    v->upper = 0xbf;
+                }
+            } else if(ch >= 0x80) {
+                v->lower = ch == 0xe0 ? 0xa0 : ch == 0xf0 ? 0x90 : 0x80;
+                v->upper = ch == 0xed ? 0x9f : ch == 0xf4 ? 0x8f : 0xbf;
+                if(ch >= 0xc2 && ch <= 0xdf) {
+                    v->need = 1;
+                } else if(ch >= 0xe0 && ch <= 0xef) {
+                    v->need = 2;
+                } else if(ch >= 0xf0 && ch <= 0xf4) {
+                    v->need = 3;
+                } else {
+                    v->error = 1;
+                }
+            }
+        }
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAVE_SSSE3_VALIDATOR
+
+__attribute__((target("ssse3")))
+static size_t validate_blocks_ssse3(utf8_validator *v, const unsigned char *ptr, size_t count, int string) {
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i input, prev = _mm_loadu_si128((const __m128i *)v->prev), error = _mm_setzero_si128();
+    __m128i prev1, special, must_be_continuation;
+    size_t i;
+
+    for(i = 0; i < count; i++, ptr += 16) {
+        input = _mm_loadu_si128((const __m128i *)ptr);
+        if(string && _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi8(input, _mm_set1_epi8('\"')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\\'))),
+                _mm_cmpeq_epi8(_mm_max_epu8(input, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)))) != 0) {
+            break;
+        }
+        prev1 = _mm_alignr_epi8(input, prev, 15);
+        special = _mm_and_si128(_mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+        must_be_continuation = _mm_or_si128(
+                _mm_subs_epu8(_mm_alignr_epi8(input, prev, 14), _mm_set1_epi8((char)(0xe0 - 0x80))),
+                _mm_subs_epu8(_mm_alignr_epi8(input, prev, 13), _mm_set1_epi8((char)(0xf0 - 0x80))));
+        error = _mm_or_si128(error, _mm_xor_si128(_mm_and_si128(must_be_continuation, _mm_set1_epi8((char)0x80)), special));
+        prev = input;
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff) {
+        v->error = 1;
+    }
+    _mm_storeu_si128((__m128i *)v->prev, prev);
+    return i;
+}
+#endif
+
+/*
+ * validates count blocks from ptr. If string is not zero, stops before the first block which contains
+ * '"', '\\' or a control character. Returns the number of validated blocks.
+ */
+static size_t (*validate_blocks)(utf8_validator *v, const unsigned char *ptr, size_t count, int string) = NULL;
+
+void init_utf8_validator(utf8_validator *v) {
+    memset(v, 0, sizeof(utf8_validator));
+    if(validate_blocks == NULL) {
+        validate_blocks = validate_blocks_scalar;
+#ifdef HAVE_SSSE3_VALIDATOR
+        if(__builtin_cpu_supports("ssse3")) {
+            validate_blocks = validate_blocks_ssse3;
+        }
+#endif
+    }
+}
+
+void feed_utf8(utf8_validator *v, const char *ptr, size_t length) {
+    size_t rest;
+
+    if(v->pending_length > 0) {
+        rest = 16 - v->pending_length;
+        if(length < rest) {
+            memcpy(v->pending + v->pending_length, ptr, length);
+            v->pending_length += length;
+            return;
+        }
+        memcpy(v->pending + v->pending_length, ptr, rest);
+        validate_blocks(v, v->pending, 1, 0);
+        v->pending_length = 0;
+        ptr += rest;
+        length -= rest;
+    }
+    if(length >= 16) {
+        validate_blocks(v, (const unsigned char *)ptr, length / 16, 0);
+    }
+    memcpy(v->pending, ptr + length / 16 * 16, length % 16);
+    v->pending_length = length % 16;
+}
+
+/* returns 0 if the bytes fed since the last call are not valid UTF-8 and starts a new string. */
+int end_utf8(utf8_validator *v) {
+    int result, open, i;
+
+    /* the padded block is needed only if the rest is not ASCII or the last sequence may be incomplete. */
+    open = v->need > 0 || v->prev[13] >= 0xf0 || v->prev[14] >= 0xe0 || v->prev[15] >= 0xc0;
+    for(i = 0; i < v->pending_length; i++) {
+        open |= v->pending[i] & 0x80;
+    }
+    if(open) {
+        memset(v->pending + v->pending_length, 0, 16 - v->pending_length);
+        validate_blocks(v, v->pending, 1, 0);
+    }
+    result = !v->error;
+    memset(v->prev, 0, sizeof(v->prev));
+    v->pending_length = v->error = v->need = 0;
+    return result;
+}
+
+int valid_utf8(utf8_validator *v, const char *ptr, size_t length) {
+    feed_utf8(v, ptr, length);
+    return end_utf8(v);
+}
+
+/* string_run() which feeds the run to the validator in the same pass. */
+size_t string_run_utf8(utf8_validator *v, const char *ptr, const char *end) {
+    size_t blocks = 0, length;
+
+    if(v->pending_length == 0) {
+        blocks = validate_blocks(v, (const unsigned char *)ptr, (end - ptr) / 16, 1);
+    }
+    length = blocks * 16 + string_run(ptr + blocks * 16, end);
+    feed_utf8(v, ptr + blocks * 16, length - blocks * 16);
+    return length;
+}
+
 char *get_delimiter_arg(int argc, char *argv[], char *arg_string, void (*usage)(), int *argindex) {
     int nowindex = *argindex;
 
@@ -145,13 +657,1741 @@ int get_ascii_optional_arg(int argc, char *argv[], char *arg_string, void (*usag
     }
 }
 
-FILE *openfile(char *filename, char *mode) {
-    FILE *result;
+/* returns the depth of --io-depth, or -1 if the argument is not --io-depth. */
+int get_io_depth_arg(int argc, char *argv[], void (*usage)(), int *argindex) {
+    char *getarg, *end;
+    long depth;
 
-    if((result = fopen(filename, mode)) == NULL) {
-        fprintf(stderr, "cannot open file %s\n", filename);
-        exit(EXIT_EXCEPTION);
+    if((getarg = get_delimiter_arg(argc, argv, "--io-depth", usage, argindex)) == NULL) {
+        return -1;
+    } else if(!isdigit((unsigned char)getarg[0]) || (depth = strtol(getarg, &end, 10)) > MAX_IO_DEPTH || *end != '\0') {
+        usage();
+        return -1;
+    }
+    return (int)depth;
+}
+
+/* returns the number of bytes of a size like 65536, 512K, 64M or 2G, or 0 if str is not a size. */
+unsigned long long parse_size(const char *str) {
+    unsigned long long result = 0;
+    const char *ptr;
+    int shift = 0;
+
+    for(ptr = str; isdigit((unsigned char)*ptr); ptr++) {
+        if(result > (~0ULL - 9) / 10) {
+            return 0;
+        }
+        result = result * 10 + (*ptr - '0');
+    }
+    if(ptr == str) {
+        return 0;
+    } else if(*ptr == 'K' || *ptr == 'k') {
+        shift = 10;
+    } else if(*ptr == 'M' || *ptr == 'm') {
+        shift = 20;
+    } else if(*ptr == 'G' || *ptr == 'g') {
+        shift = 30;
+    }
+    if(shift > 0) {
+        ptr++;
+    }
+    return *ptr == '\0' && result <= (~0ULL >> shift) ? result << shift : 0;
+}
+
+/*
+ * asynchronous I/O by io_uring
+ *
+ * openfile() reads a large plain regular file with io_depth reads of ASYNC_BLOCK_SIZE in flight
+ * and writes a regular file by io_depth asynchronous writes, in a FILE of fopencookie(),
+ * so that the device has requests queued while the caller parses.
+ * io_uring is used by its system calls without liburing and needs make URING=1.
+ * Otherwise, or if the kernel refuses io_uring, files are read and written by stdio.
+ */
+#define DEFAULT_IO_DEPTH 4
+#define ASYNC_BLOCK_SIZE (BLOCK_SIZE * 16)
+/* a smaller input is read by stdio, which needs no ring */
+#define ASYNC_MIN_INPUT (ASYNC_BLOCK_SIZE * 2)
+
+static int io_depth = DEFAULT_IO_DEPTH;
+
+/* sets the number of requests in flight of a file. 0 disables io_uring. */
+void set_io_depth(int depth) {
+    io_depth = depth;
+}
+
+#ifdef FLATJSON_URING
+typedef struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /* requests prepared but not submitted */
+    unsigned pending;
+} uring;
+
+static void free_uring(uring *u) {
+    if(u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if(u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if(u->sq_ring != MAP_FAILED) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if(u->fd >= 0) {
+        close(u->fd);
+    }
+    u->fd = -1;
+}
+
+/* returns 0 if the kernel has no io_uring or refuses it. */
+static int init_uring(uring *u, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+    u->pending = 0;
+    if((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return 0;
+    }
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_ring != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = u->sq_ring;
+    } else if(u->sq_ring != MAP_FAILED) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        free_uring(u);
+        return 0;
+    }
+    sq = (char *)u->sq_ring;
+    cq = (char *)u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+static void prepare_uring(uring *u, int opcode, int fd, char *buffer, size_t length, off_t offset, int data) {
+    unsigned tail = *u->sq_tail, index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = (unsigned char)opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(size_t)buffer;
+    sqe->len = (unsigned)length;
+    sqe->off = (unsigned long long)offset;
+    sqe->user_data = (unsigned long long)data;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+}
+
+/* submits the prepared requests and waits for a completion if wait is not 0. returns 0 on error. */
+static int enter_uring(uring *u, int wait) {
+    int result;
+
+    do {
+        result = (int)syscall(__NR_io_uring_enter, u->fd, u->pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0) {
+        return 0;
+    }
+    u->pending -= result;
+    return 1;
+}
+
+/* takes a completion. returns 0 if none is completed. */
+static int reap_uring(uring *u, int *data, int *result) {
+    unsigned head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = &u->cqes[head & *u->cq_mask];
+    *data = (int)cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* a buffer of a request. The caller reads or fills blocks[current] while the others are in flight. */
+typedef struct async_block {
+    char *data;
+    size_t length;
+    off_t offset;
+    int busy;
+    int result;
+} async_block;
+
+typedef struct async_file {
+    FILE *fp;
+    int fd;
+    uring ring;
+    int has_ring;
+    async_block *blocks;
+    int depth;
+    int current;
+    /* blocks[current] is completed and owned by the caller */
+    int ready;
+    size_t position;
+    /* offset of the next request */
+    off_t offset;
+    int eof;
+    /* requests are done by pread() and pwrite() */
+    int sync;
+} async_file;
+
+static async_file *new_async_file(FILE *fp) {
+    async_file *a = (async_file *)xalloc(sizeof(async_file));
+    int i;
+
+    memset(a, 0, sizeof(async_file));
+    a->fp = fp;
+    a->fd = fileno(fp);
+    a->ring.fd = -1;
+    a->depth = io_depth;
+    a->blocks = (async_block *)xalloc(a->depth * sizeof(async_block));
+    memset(a->blocks, 0, a->depth * sizeof(async_block));
+    for(i = 0; i < a->depth; i++) {
+        a->blocks[i].data = (char *)xalloc(ASYNC_BLOCK_SIZE);
+    }
+    return a;
+}
+
+/* waits until the request of a block is completed. returns 0 if the ring fails. */
+static int wait_async_block(async_file *a, async_block *b) {
+    int data, result;
+
+    while(b->busy) {
+        if(reap_uring(&a->ring, &data, &result)) {
+            a->blocks[data].busy = 0;
+            a->blocks[data].result = result;
+        } else if(!enter_uring(&a->ring, 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* completes a short read or write of a block synchronously. returns 0 on error. */
+static int finish_async_block(async_file *a, async_block *b, int write) {
+    ssize_t length;
+
+    if(b->result < 0) {
+        errno = -b->result;
+        return 0;
+    }
+    for(length = b->result; (size_t)b->result < b->length; b->result += (int)length) {
+        if(write) {
+            length = pwrite(a->fd, b->data + b->result, b->length - b->result, b->offset + b->result);
+        } else {
+            length = pread(a->fd, b->data + b->result, b->length - b->result, b->offset + b->result);
+        }
+        if(length < 0 && errno == EINTR) {
+            length = 0;
+        } else if(length < 0) {
+            return 0;
+        } else if(length == 0) {
+            /* end of file */
+            a->eof = 1;
+            b->length = b->result;
+            break;
+        }
+    }
+    return 1;
+}
+
+static void request_async_block(async_file *a, async_block *b, int opcode) {
+    b->offset = a->offset;
+    a->offset += b->length;
+    b->busy = 1;
+    b->result = 0;
+    prepare_uring(&a->ring, opcode, a->fd, b->data, b->length, b->offset, (int)(b - a->blocks));
+}
+
+static int free_async_file(async_file *a) {
+    int i, result = 0;
+
+    for(i = 0; i < a->depth; i++) {
+        if(a->has_ring && !wait_async_block(a, &a->blocks[i])) {
+            /* the kernel may still write to the buffers */
+            result = EOF;
+            continue;
+        }
+        xfree(a->blocks[i].data);
+    }
+    if(a->has_ring) {
+        free_uring(&a->ring);
+    }
+    if(fclose(a->fp) != 0) {
+        result = EOF;
     }
+    xfree(a->blocks);
+    xfree(a);
     return result;
 }
 
+static ssize_t read_async(void *cookie, char *buf, size_t size) {
+    async_file *a = (async_file *)cookie;
+    async_block *b = &a->blocks[a->current];
+    size_t length;
+
+    if(!a->ready) {
+        if(!wait_async_block(a, b) || !finish_async_block(a, b, 0)) {
+            return -1;
+        }
+        if(b->result == 0) {
+            a->eof = 1;
+        }
+        b->length = b->result;
+        a->position = 0;
+        a->ready = 1;
+    }
+    if((length = b->length - a->position) > size) {
+        length = size;
+    }
+    memcpy(buf, b->data + a->position, length);
+    if((a->position += length) == b->length && length > 0) {
+        /* the block is read again ahead unless the end of file is found */
+        if(!a->eof) {
+            b->length = ASYNC_BLOCK_SIZE;
+            request_async_block(a, b, IORING_OP_READ);
+            if(!enter_uring(&a->ring, 0)) {
+                return -1;
+            }
+        } else {
+            b->length = 0;
+            b->result = 0;
+        }
+        a->current = (a->current + 1) % a->depth;
+        a->ready = 0;
+    }
+    return length;
+}
+
+static int close_async_input(void *cookie) {
+    return free_async_file((async_file *)cookie);
+}
+
+/* writes the filled block by the ring, or by pwrite() if the ring is refused. */
+static int submit_async_block(async_file *a, async_block *b) {
+    if(!a->has_ring && !a->sync) {
+        a->has_ring = init_uring(&a->ring, a->depth);
+        a->sync = !a->has_ring;
+    }
+    if(a->has_ring) {
+        request_async_block(a, b, IORING_OP_WRITE);
+        return enter_uring(&a->ring, 0);
+    }
+    b->offset = a->offset;
+    a->offset += b->length;
+    b->result = 0;
+    return finish_async_block(a, b, 1);
+}
+
+static ssize_t write_async(void *cookie, const char *buf, size_t size) {
+    async_file *a = (async_file *)cookie;
+    async_block *b;
+    size_t length, rest = size;
+
+    while(rest > 0) {
+        b = &a->blocks[a->current];
+        if(!a->ready) {
+            if(a->has_ring && (!wait_async_block(a, b) || !finish_async_block(a, b, 1))) {
+                return -1;
+            }
+            b->length = 0;
+            a->ready = 1;
+        }
+        if((length = ASYNC_BLOCK_SIZE - b->length) > rest) {
+            length = rest;
+        }
+        memcpy(b->data + b->length, buf, length);
+        b->length += length;
+        buf += length;
+        rest -= length;
+        if(b->length == ASYNC_BLOCK_SIZE) {
+            if(!submit_async_block(a, b)) {
+                return -1;
+            }
+            a->current = (a->current + 1) % a->depth;
+            a->ready = 0;
+        }
+    }
+    return size;
+}
+
+static int close_async_output(void *cookie) {
+    async_file *a = (async_file *)cookie;
+    async_block *b = &a->blocks[a->current];
+    int result = 0, i;
+
+    /* a small output is written at once without a ring */
+    if(a->ready && b->length > 0) {
+        a->sync = !a->has_ring;
+        if(!submit_async_block(a, b)) {
+            result = EOF;
+        }
+    }
+    for(i = 0; i < a->depth && a->has_ring; i++) {
+        if(!wait_async_block(a, &a->blocks[i]) || !finish_async_block(a, &a->blocks[i], 1)) {
+            result = EOF;
+        }
+    }
+    return free_async_file(a) != 0 ? EOF : result;
+}
+
+/* returns a stream which reads fp ahead by io_uring, or fp if it is small, not a regular file or io_uring is refused. */
+static FILE *open_async_input(FILE *fp) {
+    cookie_io_functions_t functions = { read_async, NULL, NULL, close_async_input };
+    struct stat st;
+    async_file *a;
+    FILE *result;
+    int i;
+
+    if(io_depth <= 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < ASYNC_MIN_INPUT) {
+        return fp;
+    }
+    a = new_async_file(fp);
+    if(!(a->has_ring = init_uring(&a->ring, a->depth))) {
+        free_async_file(a);
+        return fp;
+    }
+    for(i = 0; i < a->depth; i++) {
+        a->blocks[i].length = ASYNC_BLOCK_SIZE;
+        request_async_block(a, &a->blocks[i], IORING_OP_READ);
+    }
+    if(!enter_uring(&a->ring, 0) || (result = fopencookie(a, "r", functions)) == NULL) {
+        fprintf(stderr, "cannot start asynchronous input\n");
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+}
+
+/* returns a stream which writes fp by io_uring, or fp if it is not a regular file. The ring is made by the first full block. */
+static FILE *open_async_output(FILE *fp) {
+    cookie_io_functions_t functions = { NULL, write_async, NULL, close_async_output };
+    struct stat st;
+    FILE *result;
+
+    if(io_depth <= 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return fp;
+    }
+    if((result = fopencookie(new_async_file(fp), "w", functions)) == NULL) {
+        fprintf(stderr, "cannot start asynchronous output\n");
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+}
+#else
+static FILE *open_async_input(FILE *fp) {
+    return fp;
+}
+
+static FILE *open_async_output(FILE *fp) {
+    return fp;
+}
+#endif
+
+/*
+ * compressed streams
+ *
+ * openfile() detects gzip and zstd input by magic bytes and decompresses it in a FILE of fopencookie().
+ * Output to a file named *.gz or *.zst is compressed by a worker thread while the caller fills the next buffer.
+ * gzip needs make ZLIB=1 and zstd needs make ZSTD=1.
+ */
+enum compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+};
+
+#define COMPRESSED_BLOCK_SIZE (BLOCK_SIZE * 4)
+
+typedef struct compressed_input {
+    FILE *fp;
+    enum compression method;
+    unsigned char *buffer;
+    unsigned char *next;
+    size_t avail;
+    int eof;
+    int finished;
+    int corrupt;
+#ifdef FLATJSON_ZLIB
+    z_stream z;
+#endif
+#ifdef FLATJSON_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+} compressed_input;
+
+static enum compression detect_compression(unsigned char *magic, size_t length) {
+    if(length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    } else if(length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+static ssize_t corrupt_input(compressed_input *c) {
+    if(!c->corrupt) {
+        fprintf(stderr, "corrupt compressed input\n");
+        c->corrupt = 1;
+    }
+    return -1;
+}
+
+static ssize_t read_compressed(void *cookie, char *buf, size_t size) {
+    compressed_input *c = (compressed_input *)cookie;
+    size_t length = 0;
+#ifdef FLATJSON_ZLIB
+    int ret;
+#endif
+#ifdef FLATJSON_ZSTD
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t remaining;
+#endif
+
+    if(c->method == COMPRESSION_NONE && c->avail == 0) {
+        length = fread(buf, 1, size, c->fp);
+        return ferror(c->fp) ? -1 : (ssize_t)length;
+    }
+    while(length == 0) {
+        if(c->avail == 0 && !c->eof) {
+            c->next = c->buffer;
+            if((c->avail = fread(c->buffer, 1, COMPRESSED_BLOCK_SIZE, c->fp)) == 0) {
+                if(ferror(c->fp)) {
+                    return -1;
+                }
+                c->eof = 1;
+            }
+        }
+        if(c->avail == 0) {
+            return c->finished ? 0 : corrupt_input(c);
+        }
+
+        switch(c->method) {
+        case COMPRESSION_NONE:
+            length = c->avail < size ? c->avail : size;
+            memcpy(buf, c->next, length);
+            c->next += length;
+            c->avail -= length;
+            break;
+#ifdef FLATJSON_ZLIB
+        case COMPRESSION_GZIP:
+            c->z.next_in = c->next;
+            c->z.avail_in = c->avail;
+            c->z.next_out = (unsigned char *)buf;
+            c->z.avail_out = size;
+            c->finished = 0;
+            ret = inflate(&c->z, Z_NO_FLUSH);
+            length = size - c->z.avail_out;
+            c->next = c->z.next_in;
+            c->avail = c->z.avail_in;
+            if(ret == Z_STREAM_END) {
+                /* a concatenated member may follow */
+                c->finished = 1;
+                inflateReset(&c->z);
+            } else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+                return corrupt_input(c);
+            }
+            break;
+#endif
+#ifdef FLATJSON_ZSTD
+        case COMPRESSION_ZSTD:
+            in.src = c->next;
+            in.size = c->avail;
+            in.pos = 0;
+            out.dst = buf;
+            out.size = size;
+            out.pos = 0;
+            if(ZSTD_isError(remaining = ZSTD_decompressStream(c->zstd, &out, &in))) {
+                return corrupt_input(c);
+            }
+            length = out.pos;
+            c->next += in.pos;
+            c->avail -= in.pos;
+            c->finished = remaining == 0;
+            break;
+#endif
+        default:
+            return corrupt_input(c);
+        }
+    }
+    return length;
+}
+
+static int close_compressed(void *cookie) {
+    compressed_input *c = (compressed_input *)cookie;
+    int result = c->fp == stdin ? 0 : fclose(c->fp);
+
+#ifdef FLATJSON_ZLIB
+    if(c->method == COMPRESSION_GZIP) {
+        inflateEnd(&c->z);
+    }
+#endif
+#ifdef FLATJSON_ZSTD
+    if(c->method == COMPRESSION_ZSTD) {
+        ZSTD_freeDCtx(c->zstd);
+    }
+#endif
+    xfree(c->buffer);
+    xfree(c);
+    return result;
+}
+
+/* returns a stream which decompresses fp by method after the length bytes of magic, which have been read from fp. */
+static FILE *open_compressed_input(FILE *fp, char *filename, enum compression method, unsigned char *magic, size_t length) {
+    cookie_io_functions_t functions = { read_compressed, NULL, NULL, close_compressed };
+    compressed_input *c;
+    FILE *result;
+
+#ifndef FLATJSON_ZLIB
+    if(method == COMPRESSION_GZIP) {
+        fprintf(stderr, "cannot read gzip file %s (build with make ZLIB=1)\n", filename);
+        exit(EXIT_EXCEPTION);
+    }
+#endif
+#ifndef FLATJSON_ZSTD
+    if(method == COMPRESSION_ZSTD) {
+        fprintf(stderr, "cannot read zstd file %s (build with make ZSTD=1)\n", filename);
+        exit(EXIT_EXCEPTION);
+    }
+#endif
+
+    c = (compressed_input *)xalloc(sizeof(compressed_input));
+    memset(c, 0, sizeof(compressed_input));
+    c->fp = fp;
+    c->method = method;
+    c->buffer = c->next = (unsigned char *)xalloc(COMPRESSED_BLOCK_SIZE);
+    memcpy(c->buffer, magic, length);
+    c->avail = length;
+    c->finished = 1;
+#ifdef FLATJSON_ZLIB
+    if(method == COMPRESSION_GZIP && inflateInit2(&c->z, 15 + 16) != Z_OK) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+#endif
+#ifdef FLATJSON_ZSTD
+    if(method == COMPRESSION_ZSTD && (c->zstd = ZSTD_createDCtx()) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+#endif
+    if((result = fopencookie(c, "r", functions)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+}
+
+/* returns fp if it is seekable plain input, otherwise a stream which decompresses it or replays the magic bytes. */
+static FILE *open_input(FILE *fp, char *filename) {
+    unsigned char magic[4];
+    enum compression method;
+    size_t length;
+
+    length = fread(magic, 1, sizeof(magic), fp);
+    method = detect_compression(magic, length);
+    if(fseek(fp, 0, SEEK_SET) == 0) {
+        if(method == COMPRESSION_NONE) {
+            return open_async_input(fp);
+        }
+        return open_compressed_input(open_async_input(fp), filename, method, magic, 0);
+    }
+    return open_compressed_input(fp, filename, method, magic, length);
+}
+
+/*
+ * returns stdin, or a stream which decompresses it if it is gzip or zstd.
+ * The magic bytes are pushed back by ungetc(), which glibc allows while they are in the buffer of stdin,
+ * so plain input is read from stdin directly even if it is a pipe.
+ */
+FILE *open_stdin(void) {
+    unsigned char magic[4];
+    enum compression method;
+    size_t length;
+    int ch;
+
+    for(length = 0; length < sizeof(magic) && (ch = getc(stdin)) != EOF; length++) {
+        magic[length] = (unsigned char)ch;
+    }
+    method = detect_compression(magic, length);
+    while(length > 0) {
+        ungetc(magic[--length], stdin);
+    }
+    if(method == COMPRESSION_NONE) {
+        return stdin;
+    }
+    return open_compressed_input(stdin, "(stdin)", method, magic, 0);
+}
+
+#if defined(FLATJSON_ZLIB) || defined(FLATJSON_ZSTD)
+typedef struct compressed_output {
+    FILE *fp;
+    enum compression method;
+    /* the caller fills buffers[filling] while the worker compresses buffers[pending] */
+    char *buffers[2];
+    size_t lengths[2];
+    int filling;
+    int pending;
+    int finish;
+    int error;
+    unsigned char *out;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#ifdef FLATJSON_ZLIB
+    z_stream z;
+#endif
+#ifdef FLATJSON_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} compressed_output;
+
+static int compress_block(compressed_output *c, char *data, size_t length, int end) {
+#ifdef FLATJSON_ZLIB
+    size_t written;
+#endif
+#ifdef FLATJSON_ZSTD
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t remaining;
+#endif
+
+    switch(c->method) {
+#ifdef FLATJSON_ZLIB
+    case COMPRESSION_GZIP:
+        c->z.next_in = (unsigned char *)data;
+        c->z.avail_in = length;
+        do {
+            c->z.next_out = c->out;
+            c->z.avail_out = COMPRESSED_BLOCK_SIZE;
+            if(deflate(&c->z, end ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                return 0;
+            }
+            written = COMPRESSED_BLOCK_SIZE - c->z.avail_out;
+            if(fwrite(c->out, 1, written, c->fp) != written) {
+                return 0;
+            }
+        } while(c->z.avail_out == 0);
+        return 1;
+#endif
+#ifdef FLATJSON_ZSTD
+    case COMPRESSION_ZSTD:
+        in.src = data;
+        in.size = length;
+        in.pos = 0;
+        do {
+            out.dst = c->out;
+            out.size = COMPRESSED_BLOCK_SIZE;
+            out.pos = 0;
+            if(ZSTD_isError(remaining = ZSTD_compressStream2(c->zstd, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue))) {
+                return 0;
+            }
+            if(fwrite(c->out, 1, out.pos, c->fp) != out.pos) {
+                return 0;
+            }
+        } while(end ? remaining != 0 : in.pos < in.size);
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void *compress_worker(void *cookie) {
+    compressed_output *c = (compressed_output *)cookie;
+    int index, ok;
+
+    while(1) {
+        pthread_mutex_lock(&c->mutex);
+        while(c->pending < 0 && !c->finish) {
+            pthread_cond_wait(&c->cond, &c->mutex);
+        }
+        if(c->pending < 0) {
+            pthread_mutex_unlock(&c->mutex);
+            break;
+        }
+        index = c->pending;
+        pthread_mutex_unlock(&c->mutex);
+
+        ok = compress_block(c, c->buffers[index], c->lengths[index], 0);
+        pthread_mutex_lock(&c->mutex);
+        if(!ok) {
+            c->error = 1;
+        }
+        c->lengths[index] = 0;
+        c->pending = -1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+    }
+    if(!compress_block(c, NULL, 0, 1)) {
+        c->error = 1;
+    }
+    return NULL;
+}
+
+/* passes the filled buffer to the worker and switches to the other one. returns non-zero if the worker failed. */
+static int submit_buffer(compressed_output *c) {
+    int error;
+
+    pthread_mutex_lock(&c->mutex);
+    while(c->pending >= 0) {
+        pthread_cond_wait(&c->cond, &c->mutex);
+    }
+    c->pending = c->filling;
+    c->filling ^= 1;
+    error = c->error;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    return error;
+}
+
+static ssize_t write_compressed(void *cookie, const char *buf, size_t size) {
+    compressed_output *c = (compressed_output *)cookie;
+    size_t length, rest = size;
+
+    while(rest > 0) {
+        length = COMPRESSED_BLOCK_SIZE - c->lengths[c->filling];
+        if(length > rest) {
+            length = rest;
+        }
+        memcpy(c->buffers[c->filling] + c->lengths[c->filling], buf, length);
+        c->lengths[c->filling] += length;
+        buf += length;
+        rest -= length;
+        if(c->lengths[c->filling] == COMPRESSED_BLOCK_SIZE && submit_buffer(c)) {
+            return -1;
+        }
+    }
+    return size;
+}
+
+static int close_compressed_output(void *cookie) {
+    compressed_output *c = (compressed_output *)cookie;
+    int result;
+
+    if(c->lengths[c->filling] > 0) {
+        submit_buffer(c);
+    }
+    pthread_mutex_lock(&c->mutex);
+    c->finish = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, NULL);
+
+    result = fclose(c->fp) != 0 || c->error ? EOF : 0;
+#ifdef FLATJSON_ZLIB
+    if(c->method == COMPRESSION_GZIP) {
+        deflateEnd(&c->z);
+    }
+#endif
+#ifdef FLATJSON_ZSTD
+    if(c->method == COMPRESSION_ZSTD) {
+        ZSTD_freeCCtx(c->zstd);
+    }
+#endif
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+    xfree(c->buffers[0]);
+    xfree(c->buffers[1]);
+    xfree(c->out);
+    xfree(c);
+    return result;
+}
+#endif
+
+static enum compression output_compression(char *filename) {
+    size_t length = strlen(filename);
+
+    if(length > 3 && strcmp(filename + length - 3, ".gz") == 0) {
+        return COMPRESSION_GZIP;
+    } else if(length > 4 && strcmp(filename + length - 4, ".zst") == 0) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+static FILE *open_output(FILE *fp, char *filename) {
+    enum compression method = output_compression(filename);
+#if defined(FLATJSON_ZLIB) || defined(FLATJSON_ZSTD)
+    cookie_io_functions_t functions = { NULL, write_compressed, NULL, close_compressed_output };
+    compressed_output *c;
+    FILE *result;
+#endif
+
+    if(method == COMPRESSION_NONE) {
+        return open_async_output(fp);
+    }
+#ifndef FLATJSON_ZLIB
+    if(method == COMPRESSION_GZIP) {
+        fprintf(stderr, "cannot write gzip file %s (build with make ZLIB=1)\n", filename);
+        exit(EXIT_EXCEPTION);
+    }
+#endif
+#ifndef FLATJSON_ZSTD
+    if(method == COMPRESSION_ZSTD) {
+        fprintf(stderr, "cannot write zstd file %s (build with make ZSTD=1)\n", filename);
+        exit(EXIT_EXCEPTION);
+    }
+#endif
+#if defined(FLATJSON_ZLIB) || defined(FLATJSON_ZSTD)
+    c = (compressed_output *)xalloc(sizeof(compressed_output));
+    memset(c, 0, sizeof(compressed_output));
+    c->fp = open_async_output(fp);
+    c->method = method;
+    c->buffers[0] = (char *)xalloc(COMPRESSED_BLOCK_SIZE);
+    c->buffers[1] = (char *)xalloc(COMPRESSED_BLOCK_SIZE);
+    c->out = (unsigned char *)xalloc(COMPRESSED_BLOCK_SIZE);
+    c->pending = -1;
+#ifdef FLATJSON_ZLIB
+    if(method == COMPRESSION_GZIP && deflateInit2(&c->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+#endif
+#ifdef FLATJSON_ZSTD
+    if(method == COMPRESSION_ZSTD && (c->zstd = ZSTD_createCCtx()) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+#endif
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    /* the worker makes stdio lock each call. the standard streams are used only by the caller. */
+    __fsetlocking(stdin, FSETLOCKING_BYCALLER);
+    __fsetlocking(stdout, FSETLOCKING_BYCALLER);
+    if(pthread_create(&c->thread, NULL, compress_worker, c) != 0 || (result = fopencookie(c, "w", functions)) == NULL) {
+        fprintf(stderr, "cannot start compression of %s\n", filename);
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+#else
+    return fp;
+#endif
+}
+
+/* opens a file like openfile(), but returns NULL instead of exiting. */
+FILE *open_file(char *filename, char *mode) {
+    FILE *result;
+
+    if((result = fopen(filename, mode)) == NULL) {
+        fprintf(stderr, "cannot open file %s\n", filename);
+        return NULL;
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    if(strcmp(mode, "r") == 0) {
+        return open_input(result, filename);
+    } else if(strcmp(mode, "w") == 0) {
+        return open_output(result, filename);
+    }
+    return result;
+}
+
+/*
+ * opens a file. input is decompressed and output to *.gz or *.zst is compressed.
+ * The file must be used by one thread.
+ */
+FILE *openfile(char *filename, char *mode) {
+    FILE *result;
+
+    if((result = open_file(filename, mode)) == NULL) {
+        exit(EXIT_EXCEPTION);
+    }
+    return result;
+}
+
+/*
+ * stream of --follow
+ *
+ * follow_file() reads a growing file of JSON Lines like tail -F. The stream ends each line by EOF,
+ * so a parser takes a record as a document, and next_follow_record() clears EOF for the next record.
+ * At the end of the file, a read waits for inotify events of the file and its directory,
+ * or FOLLOW_INTERVAL milliseconds without them. When the name is given to a new file, which is rotation,
+ * the rest of the old file is read first and the new file is read from the beginning.
+ * When the file gets shorter, which is truncation, it is read again from the beginning.
+ * A line cut by rotation or truncation ends there.
+ */
+#define FOLLOW_INTERVAL 1000
+
+typedef struct follow_input {
+    char *filename;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    int inotify;
+    int watch;
+    char *buffer;
+    char *ptr;
+    char *end;
+    /* bytes of the current line have been read, and the next read ends the record */
+    int in_line;
+    int end_record;
+} follow_input;
+
+/* opens the file of the name, which may be new. returns 0 if it does not exist. */
+static int open_follow(follow_input *f) {
+    struct stat st;
+    int fd;
+
+    if((fd = open(f->filename, O_RDONLY)) < 0) {
+        return 0;
+    } else if(fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    if(f->fd >= 0) {
+        close(f->fd);
+    }
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = 0;
+    if(f->inotify >= 0) {
+        if(f->watch >= 0) {
+            inotify_rm_watch(f->inotify, f->watch);
+        }
+        f->watch = inotify_add_watch(f->inotify, f->filename, IN_MODIFY | IN_ATTRIB);
+    }
+    return 1;
+}
+
+static void wait_follow(follow_input *f) {
+    char events[4096];
+    struct pollfd p;
+
+    p.fd = f->inotify;
+    p.events = POLLIN;
+    if(poll(&p, 1, FOLLOW_INTERVAL) > 0) {
+        while(read(f->inotify, events, sizeof(events)) > 0);
+    }
+}
+
+/* reads the next block. returns 0 if a cut line ends, or -1 on errors. */
+static int fill_follow(follow_input *f) {
+    struct stat st;
+    ssize_t length;
+
+    while(1) {
+        if(f->fd >= 0) {
+            if((length = read(f->fd, f->buffer, BLOCK_SIZE)) > 0) {
+                f->ptr = f->buffer;
+                f->end = f->buffer + length;
+                f->offset += length;
+                return 1;
+            } else if(length < 0 && errno == EINTR) {
+                continue;
+            } else if(length < 0) {
+                return -1;
+            } else if(fstat(f->fd, &st) == 0 && st.st_size < f->offset) {
+                lseek(f->fd, 0, SEEK_SET);
+                f->offset = 0;
+                if(f->in_line) {
+                    return 0;
+                }
+                continue;
+            }
+        }
+        if(stat(f->filename, &st) == 0 && (f->fd < 0 || st.st_dev != f->dev || st.st_ino != f->ino) && open_follow(f)) {
+            if(f->in_line) {
+                return 0;
+            }
+            continue;
+        }
+        wait_follow(f);
+    }
+}
+
+static ssize_t read_follow(void *cookie, char *buf, size_t size) {
+    follow_input *f = (follow_input *)cookie;
+    char *newline;
+    int result;
+
+    if(f->end_record) {
+        f->end_record = f->in_line = 0;
+        return 0;
+    } else if(f->ptr == f->end && (result = fill_follow(f)) <= 0) {
+        f->in_line = 0;
+        return result;
+    }
+    if(size > (size_t)(f->end - f->ptr)) {
+        size = f->end - f->ptr;
+    }
+    if((newline = (char *)memchr(f->ptr, '\n', size)) != NULL) {
+        size = newline - f->ptr + 1;
+        f->end_record = 1;
+    }
+    memcpy(buf, f->ptr, size);
+    f->ptr += size;
+    f->in_line = 1;
+    return size;
+}
+
+static int close_follow(void *cookie) {
+    follow_input *f = (follow_input *)cookie;
+
+    if(f->fd >= 0) {
+        close(f->fd);
+    }
+    if(f->inotify >= 0) {
+        close(f->inotify);
+    }
+    xfree(f->filename);
+    xfree(f->buffer);
+    xfree(f);
+    return 0;
+}
+
+/* returns a stream of the lines of a file, which waits for the file if it does not exist yet. */
+FILE *follow_file(char *filename) {
+    cookie_io_functions_t functions = { read_follow, NULL, NULL, close_follow };
+    follow_input *f = (follow_input *)xalloc(sizeof(follow_input));
+    char *slash = strrchr(filename, '/'), *dir;
+    FILE *result;
+
+    memset(f, 0, sizeof(follow_input));
+    f->filename = (char *)xalloc(strlen(filename) + 1);
+    strcpy(f->filename, filename);
+    f->buffer = f->ptr = f->end = (char *)xalloc(BLOCK_SIZE);
+    f->fd = f->watch = -1;
+    /* the stream starts with an empty record, which next_follow_record() skips */
+    f->end_record = 1;
+    if((f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0) {
+        /* the directory tells that the name is given to a new file */
+        dir = (char *)xalloc(strlen(filename) + 2);
+        strcpy(dir, slash == NULL ? "." : slash == filename ? "/" : filename);
+        if(slash != NULL && slash != filename) {
+            dir[slash - filename] = '\0';
+        }
+        inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+        xfree(dir);
+    }
+    open_follow(f);
+    if((result = fopencookie(f, "r", functions)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+}
+
+/* skips the rest of the record of follow_file() and waits for the next line which is not blank. returns 0 on errors. */
+int next_follow_record(FILE *fp) {
+    int ch;
+
+    if(!feof(fp)) {
+        while(getc(fp) != EOF);
+    }
+    while(!ferror(fp)) {
+        clearerr(fp);
+        while((ch = getc(fp)) == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+        if(ch != EOF) {
+            ungetc(ch, fp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void init_reader(reader *r, FILE *fp) {
+    r->fp = fp;
+    if(r->buffer == NULL) {
+        r->buffer = (char *)xalloc(BLOCK_SIZE);
+    }
+    r->ptr = r->end = r->buffer;
+    r->offset = ftello(fp);
+}
+
+/* reads next block. returns the number of bytes available. */
+int fill_reader(reader *r) {
+    size_t rest = r->end - r->ptr, length;
+
+    if(rest > 0 && r->ptr != r->buffer) {
+        memmove(r->buffer, r->ptr, rest);
+    }
+    if(r->offset >= 0) {
+        r->offset += r->ptr - r->buffer;
+    }
+    r->ptr = r->buffer;
+    r->end = r->buffer + rest;
+    if((length = fread(r->end, 1, BLOCK_SIZE - rest, r->fp)) > 0) {
+        r->end += length;
+    }
+    return r->end - r->ptr;
+}
+
+int fill_read_char(reader *r) {
+    if(fill_reader(r) == 0) {
+        return EOF;
+    }
+    return (unsigned char)*r->ptr++;
+}
+
+void init_writer(writer *w, FILE *fp) {
+    w->fp = fp;
+    if(w->buffer == NULL) {
+        w->buffer = (char *)xalloc(BLOCK_SIZE);
+    }
+    w->ptr = w->buffer;
+    w->end = w->buffer + BLOCK_SIZE;
+    w->discarded = 0;
+}
+
+void flush_writer(writer *w) {
+    if(w->fp == NULL) {
+        w->discarded += w->ptr - w->buffer;
+    } else if(w->ptr > w->buffer) {
+        fwrite(w->buffer, 1, w->ptr - w->buffer, w->fp);
+    }
+    w->ptr = w->buffer;
+}
+
+void write_bytes(writer *w, const char *bytes, size_t length) {
+    if(length > (size_t)(w->end - w->ptr)) {
+        flush_writer(w);
+        if(length > BLOCK_SIZE) {
+            if(w->fp == NULL) {
+                w->discarded += length;
+            } else {
+                fwrite(bytes, 1, length, w->fp);
+            }
+            return;
+        }
+    }
+    memcpy(w->ptr, bytes, length);
+    w->ptr += length;
+}
+
+void flush_write_char(writer *w, int ch) {
+    flush_writer(w);
+    *w->ptr++ = (char)ch;
+}
+
+/*
+ * verbatim spans
+ *
+ * A span of the input which goes to the output unchanged need not pass through user space.
+ * If it is long and the output is a file or a pipe, the kernel copies it by copy_file_range()
+ * or splice(). Otherwise, it is written from the buffer of the reader or read again by pread().
+ */
+#define SPAN_COPY_LENGTH BLOCK_SIZE
+
+/* copies length bytes of in from offset to output in the kernel. returns the number of bytes copied. */
+static size_t copy_file_span(int in, long long offset, FILE *output, size_t length) {
+    struct stat st;
+    loff_t off = offset;
+    ssize_t result;
+    size_t copied = 0;
+    int out = fileno(output);
+
+    if(out < 0 || fflush(output) != 0 || fstat(out, &st) != 0) {
+        return 0;
+    }
+    while(copied < length) {
+        if(S_ISREG(st.st_mode)) {
+            result = copy_file_range(in, &off, out, NULL, length - copied, 0);
+        } else if(S_ISFIFO(st.st_mode)) {
+            result = splice(in, &off, out, NULL, length - copied, SPLICE_F_MORE);
+        } else {
+            break;
+        }
+        if(result < 0 && errno == EINTR) {
+            continue;
+        } else if(result <= 0) {
+            break;
+        }
+        copied += result;
+    }
+    return copied;
+}
+
+/*
+ * writes the input of a seekable reader from offset start to end to w.
+ * end is at most the end of the buffer. returns 0 if the input cannot be read again.
+ */
+int write_span(reader *r, long long start, long long end, writer *w) {
+    ssize_t length;
+    long long limit = end < r->offset ? end : r->offset;
+
+    if(end - start >= SPAN_COPY_LENGTH && w->fp != NULL) {
+        flush_writer(w);
+        start += copy_file_span(fileno(r->fp), start, w->fp, end - start);
+    }
+    while(start < limit) {
+        if(w->ptr == w->end) {
+            flush_writer(w);
+        }
+        length = w->end - w->ptr < limit - start ? w->end - w->ptr : limit - start;
+        if((length = pread(fileno(r->fp), w->ptr, length, start)) < 0 && errno == EINTR) {
+            continue;
+        } else if(length <= 0) {
+            return 0;
+        }
+        w->ptr += length;
+        start += length;
+    }
+    if(start < end) {
+        write_bytes(w, r->buffer + (start - r->offset), end - start);
+    }
+    return 1;
+}
+
+/* returns the length of spaces, tabs, CRs and LFs at the beginning of ptr. */
+size_t whitespace_run(const char *ptr, const char *end) {
+    const char *start = ptr;
+#ifdef __SSE2__
+    __m128i chunk, mask;
+    unsigned int bits;
+
+    for(; end - ptr >= 16; ptr += 16) {
+        chunk = _mm_loadu_si128((const __m128i *)ptr);
+        mask = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+        if((bits = ~_mm_movemask_epi8(mask) & 0xffff) != 0) {
+            return ptr - start + __builtin_ctz(bits);
+        }
+    }
+#endif
+    while(ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r')) {
+        ptr++;
+    }
+    return ptr - start;
+}
+
+/* returns the length of characters in a string at the beginning of ptr except '"', '\\' and control characters. */
+size_t string_run(const char *ptr, const char *end) {
+    const char *start = ptr;
+#ifdef __SSE2__
+    __m128i chunk, mask;
+    unsigned int bits;
+
+    for(; end - ptr >= 16; ptr += 16) {
+        chunk = _mm_loadu_si128((const __m128i *)ptr);
+        mask = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\"')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))),
+                _mm_cmpeq_epi8(_mm_max_epu8(chunk, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)));
+        if((bits = _mm_movemask_epi8(mask)) != 0) {
+            return ptr - start + __builtin_ctz(bits);
+        }
+    }
+#endif
+    while(ptr < end && *ptr != '\"' && *ptr != '\\' && (unsigned char)*ptr >= 0x20) {
+        ptr++;
+    }
+    return ptr - start;
+}
+
+void write_varint(FILE *fp, unsigned long value) {
+    while(value >= 0x80) {
+        putc((int)(value & 0x7f) | 0x80, fp);
+        value >>= 7;
+    }
+    putc((int)value, fp);
+}
+
+int read_varint(FILE *fp, unsigned long *value) {
+    int ch, shift = 0;
+
+    *value = 0;
+    while((ch = getc(fp)) != EOF) {
+        if(shift >= (int)sizeof(unsigned long) * 8) {
+            return 0;
+        }
+        *value |= (unsigned long)(ch & 0x7f) << shift;
+        if((ch & 0x80) == 0) {
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+typedef struct stats_cookie {
+    FILE *fp;
+    stats *stats;
+} stats_cookie;
+
+static ssize_t stats_read(void *cookie, char *buf, size_t size) {
+    stats_cookie *c = (stats_cookie *)cookie;
+    size_t length;
+
+    stats_enter(c->stats, STATS_INPUT);
+    length = fread(buf, 1, size, c->fp);
+    stats_leave(c->stats, STATS_INPUT);
+    c->stats->bytes_in += length;
+    return ferror(c->fp) ? -1 : (ssize_t)length;
+}
+
+static ssize_t stats_write(void *cookie, const char *buf, size_t size) {
+    stats_cookie *c = (stats_cookie *)cookie;
+    size_t length;
+
+    length = fwrite(buf, 1, size, c->fp);
+    c->stats->bytes_out += length;
+    return length < size ? -1 : (ssize_t)length;
+}
+
+static int stats_close(void *cookie) {
+    stats_cookie *c = (stats_cookie *)cookie;
+    int result = fflush(c->fp);
+
+    free(c);
+    return result;
+}
+
+/*
+ * returns a stream which counts bytes passing through fp for --stats.
+ * Closing the stream flushes fp but does not close it.
+ * Streams of fopencookie() are used by one thread, so they are not locked on each call.
+ */
+FILE *stats_file(FILE *fp, int output, stats *s) {
+    cookie_io_functions_t functions = { NULL, NULL, NULL, stats_close };
+    stats_cookie *cookie = (stats_cookie *)malloc(sizeof(stats_cookie));
+    FILE *result;
+
+    if(output) {
+        functions.write = stats_write;
+    } else {
+        functions.read = stats_read;
+    }
+    if(cookie == NULL || (result = fopencookie(cookie, output ? "w" : "r", functions)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+    cookie->fp = fp;
+    cookie->stats = s;
+    __fsetlocking(result, FSETLOCKING_BYCALLER);
+    return result;
+}
+
+#if defined(FLATJSON_STATS) && !defined(__x86_64__) && !defined(__i386__)
+unsigned long long stats_cycles() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+void print_stats(const char *name, stats *s) {
+    static const char *token_names[STATS_TOKEN_TYPES] = { "objects", "arrays", "keys", "strings", "numbers", "literals" };
+    int i;
+#ifdef FLATJSON_STATS
+    static const char *phase_names[STATS_PHASES] = { "total", "input", "escape", "output" };
+    unsigned long long parse;
+#endif
+
+    fprintf(stderr, "%s: bytes in        %llu\n", name, s->bytes_in);
+    fprintf(stderr, "%s: bytes out       %llu\n", name, s->bytes_out);
+    fprintf(stderr, "%s: lines           %llu\n", name, s->lines);
+    for(i = 0; i < STATS_TOKEN_TYPES; i++) {
+        fprintf(stderr, "%s: %-15s %llu\n", name, token_names[i], s->tokens[i]);
+    }
+    fprintf(stderr, "%s: max depth       %d\n", name, s->max_depth);
+    fprintf(stderr, "%s: malloc calls    %llu\n", name, alloc_calls);
+    fprintf(stderr, "%s: malloc bytes    %llu\n", name, alloc_bytes);
+    fprintf(stderr, "%s: peak bytes      %llu\n", name, alloc_peak);
+#ifdef FLATJSON_STATS
+    for(i = 0; i < STATS_PHASES; i++) {
+        fprintf(stderr, "%s: cycles %-8s %llu\n", name, phase_names[i], s->cycles[i]);
+    }
+    parse = s->cycles[STATS_TOTAL] - s->cycles[STATS_INPUT] - s->cycles[STATS_ESCAPE] - s->cycles[STATS_OUTPUT];
+    fprintf(stderr, "%s: cycles parse    %llu\n", name, s->cycles[STATS_INPUT] + s->cycles[STATS_ESCAPE] + s->cycles[STATS_OUTPUT] > s->cycles[STATS_TOTAL] ? 0 : parse);
+#else
+    fprintf(stderr, "%s: cycles          not measured (build with make STATS=1)\n", name);
+#endif
+}
+
+void add_stats(stats *to, stats *from) {
+    int i;
+
+    to->bytes_in += from->bytes_in;
+    to->bytes_out += from->bytes_out;
+    to->lines += from->lines;
+    for(i = 0; i < STATS_TOKEN_TYPES; i++) {
+        to->tokens[i] += from->tokens[i];
+    }
+    count_depth(to, from->max_depth);
+    for(i = 0; i < STATS_PHASES; i++) {
+        to->cycles[i] += from->cycles[i];
+    }
+}
+
+/*
+ * input files of a command
+ *
+ * run_file_pool() processes each file by process() of the pool on jobs threads, each with its own context.
+ * Outputs are written to the output of the pool in order of the files, or to a file in output_dir for each input.
+ * With more than one thread, the output of a file is kept in memory until the outputs before it are written,
+ * and threads do not start a file more than FILE_POOL_AHEAD * jobs files ahead of the output.
+ */
+#define FILE_POOL_AHEAD 4
+
+typedef struct file_result {
+    char *data;
+    size_t size;
+    int errcode;
+    int done;
+} file_result;
+
+typedef struct file_pool_run {
+    file_pool *pool;
+    file_result *results;
+    int next;
+    int written;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} file_pool_run;
+
+typedef struct file_pool_worker {
+    file_pool_run *run;
+    void *context;
+    pthread_t thread;
+} file_pool_worker;
+
+static void add_file(file_pool *pool, char *filename) {
+    if(pool->count % 64 == 0) {
+        pool->files = (char **)xrealloc(pool->files, (pool->count + 64) * sizeof(char *));
+    }
+    pool->files[pool->count] = (char *)xalloc(strlen(filename) + 1);
+    strcpy(pool->files[pool->count++], filename);
+}
+
+/* expands wildcards of the arguments which are not files. "-" or no argument is the standard input. */
+void init_file_pool(file_pool *pool, char **args, int count) {
+    struct stat st;
+    glob_t matched;
+    size_t j;
+    int i;
+
+    memset(pool, 0, sizeof(file_pool));
+    pool->jobs = 1;
+    for(i = 0; i < count; i++) {
+        if(stat(args[i], &st) != 0 && strpbrk(args[i], "*?[") != NULL && glob(args[i], 0, NULL, &matched) == 0) {
+            for(j = 0; j < matched.gl_pathc; j++) {
+                add_file(pool, matched.gl_pathv[j]);
+            }
+            globfree(&matched);
+        } else {
+            add_file(pool, args[i]);
+        }
+    }
+    if(pool->count == 0) {
+        add_file(pool, "-");
+    }
+}
+
+void free_file_pool(file_pool *pool) {
+    int i;
+
+    for(i = 0; i < pool->count; i++) {
+        xfree(pool->files[i]);
+    }
+    xfree(pool->files);
+    pool->files = NULL;
+    pool->count = 0;
+}
+
+int is_directory(char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* output_dir, the base name of filename without the extensions and the extension of the pool */
+static char *output_path(file_pool *pool, char *filename) {
+    char *base = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename, *name, *dot;
+    char *path = (char *)xalloc(strlen(pool->output_dir) + strlen(base) + strlen(pool->extension) + 2);
+
+    sprintf(path, "%s/", pool->output_dir);
+    name = path + strlen(path);
+    strcat(path, base);
+    if((dot = strrchr(name, '.')) != NULL && (strcmp(dot, ".gz") == 0 || strcmp(dot, ".zst") == 0)) {
+        *dot = '\0';
+    }
+    if((dot = strrchr(name, '.')) != NULL && dot != name) {
+        *dot = '\0';
+    }
+    strcat(path, pool->extension);
+    return path;
+}
+
+static int same_file(char *path1, char *path2) {
+    struct stat st1, st2;
+
+    return stat(path1, &st1) == 0 && stat(path2, &st2) == 0 && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/* processes a file into output, or into its file in output_dir if output is NULL. */
+static int process_file(file_pool *pool, void *context, char *filename, FILE *output) {
+    FILE *input, *fp = output;
+    char *path = NULL;
+    int errcode = EXIT_EXCEPTION;
+
+    if(strcmp(filename, "-") == 0) {
+        input = open_stdin();
+    } else if((input = open_file(filename, "r")) == NULL) {
+        return EXIT_EXCEPTION;
+    }
+    if(output == NULL) {
+        path = output_path(pool, filename);
+        if(same_file(path, filename)) {
+            fprintf(stderr, "output file %s is the input\n", path);
+            fp = NULL;
+        } else {
+            fp = open_file(path, "w");
+        }
+    }
+    if(fp != NULL) {
+        errcode = pool->process(context, filename, input, fp);
+    }
+    if(output == NULL && fp != NULL) {
+        fclose(fp);
+    }
+    if(input != stdin) {
+        fclose(input);
+    }
+    if(errcode != 0 && pool->count > 1) {
+        fprintf(stderr, "error in file %s\n", filename);
+    }
+    xfree(path);
+    return errcode;
+}
+
+static void *file_pool_thread(void *arg) {
+    file_pool_worker *worker = (file_pool_worker *)arg;
+    file_pool_run *run = worker->run;
+    file_pool *pool = run->pool;
+    file_result *result;
+    FILE *memory;
+    int index;
+
+    while(1) {
+        pthread_mutex_lock(&run->mutex);
+        while(pool->output_dir == NULL && run->next < pool->count && run->next >= run->written + FILE_POOL_AHEAD * pool->jobs) {
+            pthread_cond_wait(&run->cond, &run->mutex);
+        }
+        index = run->next++;
+        pthread_mutex_unlock(&run->mutex);
+        if(index >= pool->count) {
+            return NULL;
+        }
+
+        result = &run->results[index];
+        if(pool->output_dir != NULL) {
+            result->errcode = process_file(pool, worker->context, pool->files[index], NULL);
+        } else if((memory = open_memstream(&result->data, &result->size)) == NULL) {
+            fprintf(stderr, "cannot buffer output of %s\n", pool->files[index]);
+            result->errcode = EXIT_ERROR;
+        } else {
+            __fsetlocking(memory, FSETLOCKING_BYCALLER);
+            result->errcode = process_file(pool, worker->context, pool->files[index], memory);
+            fclose(memory);
+        }
+
+        pthread_mutex_lock(&run->mutex);
+        result->done = 1;
+        pthread_cond_broadcast(&run->cond);
+        pthread_mutex_unlock(&run->mutex);
+    }
+}
+
+/* returns the largest exit code of the files. */
+int run_file_pool(file_pool *pool) {
+    file_pool_run run;
+    file_pool_worker *workers;
+    int jobs = pool->jobs < pool->count ? pool->jobs : pool->count, errcode = 0, result, i;
+
+    if(jobs <= 1) {
+        for(i = 0; i < pool->count; i++) {
+            if((result = process_file(pool, pool->contexts[0], pool->files[i], pool->output_dir == NULL ? pool->output : NULL)) > errcode) {
+                errcode = result;
+            }
+        }
+        return errcode;
+    }
+
+    run.pool = pool;
+    run.results = (file_result *)xalloc(pool->count * sizeof(file_result));
+    memset(run.results, 0, pool->count * sizeof(file_result));
+    run.next = run.written = 0;
+    pthread_mutex_init(&run.mutex, NULL);
+    pthread_cond_init(&run.cond, NULL);
+    alloc_atomic = 1;
+    workers = (file_pool_worker *)xalloc(jobs * sizeof(file_pool_worker));
+    for(i = 0; i < jobs; i++) {
+        workers[i].run = &run;
+        workers[i].context = pool->contexts[i];
+        if(pthread_create(&workers[i].thread, NULL, file_pool_thread, &workers[i]) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            exit(EXIT_ERROR);
+        }
+    }
+
+    for(i = 0; i < pool->count; i++) {
+        pthread_mutex_lock(&run.mutex);
+        while(!run.results[i].done) {
+            pthread_cond_wait(&run.cond, &run.mutex);
+        }
+        pthread_mutex_unlock(&run.mutex);
+        if(run.results[i].data != NULL) {
+            fwrite(run.results[i].data, 1, run.results[i].size, pool->output);
+            free(run.results[i].data);
+        }
+        if(run.results[i].errcode > errcode) {
+            errcode = run.results[i].errcode;
+        }
+        pthread_mutex_lock(&run.mutex);
+        run.written = i + 1;
+        pthread_cond_broadcast(&run.cond);
+        pthread_mutex_unlock(&run.mutex);
+    }
+
+    for(i = 0; i < jobs; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    alloc_atomic = 0;
+    pthread_mutex_destroy(&run.mutex);
+    pthread_cond_destroy(&run.cond);
+    xfree(workers);
+    xfree(run.results);
+    return errcode;
+}
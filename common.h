@@ -10,14 +10,239 @@
 #define EXIT_EXCEPTION 4
 #define EXIT_USAGE 2
 
+/*
+ * binary flat format
+ *
+ * stream  := magic record*
+ * record  := varint(pop) varint(push) segment{push} leaf
+ * segment := BINARY_KEY varint(length) bytes | BINARY_KEY_ID varint(id)
+ *          | BINARY_INDEX varint(index)
+ * leaf    := (BINARY_STRING | BINARY_NUMBER) varint(length) bytes
+ *          | BINARY_NULL | BINARY_TRUE | BINARY_FALSE
+ *          | BINARY_EMPTY_OBJECT | BINARY_EMPTY_ARRAY
+ *
+ * pop is the number of segments removed from the end of the path of the previous record
+ * and push is the number of segments appended after that.
+ * Each BINARY_KEY defines the next key id from 0 and BINARY_KEY_ID refers to the defined key.
+ * After BINARY_MAX_KEYS keys are defined, BINARY_KEY is a key written inline which defines no id,
+ * so the key tables of the writer and the reader stop growing on data with unbounded keys.
+ */
+#define BINARY_MAX_KEYS 65536
+#define BINARY_MAGIC "FLJB\001"
+#define BINARY_MAGIC_LENGTH 5
+#define BINARY_KEY 0x01
+#define BINARY_INDEX 0x02
+#define BINARY_KEY_ID 0x03
+#define BINARY_STRING 0x10
+#define BINARY_NUMBER 0x11
+#define BINARY_NULL 0x12
+#define BINARY_TRUE 0x13
+#define BINARY_FALSE 0x14
+#define BINARY_EMPTY_OBJECT 0x15
+#define BINARY_EMPTY_ARRAY 0x16
+
+#define BLOCK_SIZE 65536
+/* maximum number of requests in flight of a file by --io-depth */
+#define MAX_IO_DEPTH 256
+
+/*
+ * block reader and writer
+ *
+ * offset is the offset in the input of the beginning of the buffer, or -1 if the input is not seekable.
+ * A writer without fp discards its output and counts the bytes discarded.
+ */
+typedef struct reader {
+    FILE *fp;
+    char *buffer;
+    char *ptr;
+    char *end;
+    long long offset;
+} reader;
+
+typedef struct writer {
+    FILE *fp;
+    char *buffer;
+    char *ptr;
+    char *end;
+    unsigned long long discarded;
+} writer;
+
+#define read_char(r) ((r)->ptr < (r)->end ? (unsigned char)*(r)->ptr++ : fill_read_char(r))
+#define reader_offset(r) ((r)->offset + ((r)->ptr - (r)->buffer))
+#define seekable_reader(r) ((r)->offset >= 0 && fileno((r)->fp) >= 0)
+#define unread_char(r, ch) ((ch) != EOF ? (void)(r)->ptr-- : (void)0)
+#define write_char(w, ch) ((w)->ptr < (w)->end ? (void)(*(w)->ptr++ = (char)(ch)) : flush_write_char((w), (ch)))
+
+/*
+ * growable string buffer
+ */
+typedef struct string_buffer {
+    char *value;
+    char *ptr;
+    int length;
+} string_buffer;
+
+/*
+ * table of interned strings. ids are given from 0 in order of interning.
+ */
+typedef struct intern_entry {
+    char *string;
+    int length;
+    unsigned int hash;
+} intern_entry;
+
+typedef struct intern_table {
+    intern_entry *entries;
+    int *ids;
+    intern_entry **strings;
+    int size;
+    int count;
+} intern_table;
+
+#define interned_string(t, id) ((t)->strings[id]->string)
+#define interned_length(t, id) ((t)->strings[id]->length)
+#define interned_count(t) ((t)->count)
+
+/*
+ * counters of --stats
+ *
+ * Cycles of phases are measured only if FLATJSON_STATS is defined (make STATS=1).
+ * Otherwise stats_enter() and stats_leave() are compiled out.
+ */
+enum stats_token {
+    STATS_OBJECT,
+    STATS_ARRAY,
+    STATS_KEY,
+    STATS_STRING,
+    STATS_NUMBER,
+    STATS_LITERAL,
+    STATS_TOKEN_TYPES
+};
+
+enum stats_phase {
+    STATS_TOTAL,
+    STATS_INPUT,
+    STATS_ESCAPE,
+    STATS_OUTPUT,
+    STATS_PHASES
+};
+
+typedef struct stats {
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long lines;
+    unsigned long long tokens[STATS_TOKEN_TYPES];
+    int max_depth;
+    unsigned long long cycles[STATS_PHASES];
+    unsigned long long cycles_start[STATS_PHASES];
+} stats;
+
+#define count_token(s, type) ((s)->tokens[type]++)
+#define count_depth(s, depth) ((depth) > (s)->max_depth ? (void)((s)->max_depth = (depth)) : (void)0)
+
+#ifdef FLATJSON_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stats_cycles() __rdtsc()
+#else
+extern unsigned long long stats_cycles();
+#endif
+#define stats_enter(s, phase) ((s)->cycles_start[phase] = stats_cycles())
+#define stats_leave(s, phase) ((s)->cycles[phase] += stats_cycles() - (s)->cycles_start[phase])
+#else
+#define stats_enter(s, phase) ((void)0)
+#define stats_leave(s, phase) ((void)0)
+#endif
+
+/* errors of decode_unicode_escape() and decode_surrogate_pair() */
+#define ESCAPE_INVALID -1
+#define ESCAPE_SURROGATE -2
+
+#define is_high_surrogate(c) ((c) >= 0xD800 && (c) <= 0xDBFF)
+#define is_low_surrogate(c) ((c) >= 0xDC00 && (c) <= 0xDFFF)
+
+/*
+ * UTF-8 validator. A string is fed in pieces by feed_utf8() and checked by end_utf8().
+ */
+typedef struct utf8_validator {
+    unsigned char prev[16];
+    unsigned char pending[16];
+    int pending_length;
+    int error;
+    int need;
+    int lower;
+    int upper;
+} utf8_validator;
+
+/*
+ * input files of a command. process() is called for each file with one of contexts, which has jobs entries.
+ * If output_dir is not NULL, the output of a file is written to a file in it, named by the input and extension.
+ */
+typedef struct file_pool {
+    char **files;
+    int count;
+    int jobs;
+    void **contexts;
+    int (*process)(void *context, char *filename, FILE *input, FILE *output);
+    FILE *output;
+    char *output_dir;
+    char *extension;
+} file_pool;
+
 extern void *xalloc(int size);
-extern void init_buffer();
-extern void append_buffer(char ch);
-extern int equals_buffer(const char *str);
-extern char *to_string_buffer();
-extern int append_codepoint_buffer(int codepoint);
+extern void *xrealloc(void *ptr, int size);
+extern void xfree(void *ptr);
+extern void init_buffer(string_buffer *b);
+extern void free_buffer(string_buffer *b);
+extern void append_buffer(string_buffer *b, char ch);
+extern int equals_buffer(string_buffer *b, const char *str);
+extern char *to_string_buffer(string_buffer *b);
+extern int encode_utf8(char *buf, int codepoint);
+extern int append_codepoint_buffer(string_buffer *b, int codepoint);
+extern int decode_hex4(const char *hex);
+extern int decode_escape(int ch);
+extern int encode_escape(int ch);
+extern int surrogate_to_codepoint(int high, int low);
+extern int decode_unicode_escape(const char *hex);
+extern int decode_surrogate_pair(int high, const char *hex);
+extern const char *escape_error(int error);
+extern void init_utf8_validator(utf8_validator *v);
+extern void feed_utf8(utf8_validator *v, const char *ptr, size_t length);
+extern int end_utf8(utf8_validator *v);
+extern int valid_utf8(utf8_validator *v, const char *ptr, size_t length);
+extern size_t string_run_utf8(utf8_validator *v, const char *ptr, const char *end);
+extern int intern(intern_table *t, const char *str, int length);
+extern int intern_buffer(intern_table *t, string_buffer *b);
+extern int find_interned(intern_table *t, const char *str, int length);
+extern void free_intern_table(intern_table *t);
 extern char *get_delimiter_arg(int argc, char *argv[], char *arg_string, void (*usage)(), int *argindex);
 extern int get_ascii_arg(int argc, char *argv[], char *arg_string, int escape, void (*usage)(), int *argindex);
 extern int get_ascii_optional_arg(int argc, char *argv[], char *arg_string, void (*usage)(), int *argindex);
+extern int get_io_depth_arg(int argc, char *argv[], void (*usage)(), int *argindex);
+extern unsigned long long parse_size(const char *str);
+extern void set_io_depth(int depth);
+extern FILE *open_stdin(void);
+extern FILE *open_file(char *filename, char *mode);
 extern FILE *openfile(char *filename, char *mode);
+extern FILE *follow_file(char *filename);
+extern int next_follow_record(FILE *fp);
+extern void init_reader(reader *r, FILE *fp);
+extern int fill_reader(reader *r);
+extern int fill_read_char(reader *r);
+extern void init_writer(writer *w, FILE *fp);
+extern void write_bytes(writer *w, const char *bytes, size_t length);
+extern void flush_write_char(writer *w, int ch);
+extern void flush_writer(writer *w);
+extern int write_span(reader *r, long long start, long long end, writer *w);
+extern size_t whitespace_run(const char *ptr, const char *end);
+extern size_t string_run(const char *ptr, const char *end);
+extern void write_varint(FILE *fp, unsigned long value);
+extern int read_varint(FILE *fp, unsigned long *value);
+extern FILE *stats_file(FILE *fp, int output, stats *s);
+extern void print_stats(const char *name, stats *s);
+extern void add_stats(stats *to, stats *from);
+extern void init_file_pool(file_pool *pool, char **args, int count);
+extern void free_file_pool(file_pool *pool);
+extern int run_file_pool(file_pool *pool);
+extern int is_directory(char *path);
 
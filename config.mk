@@ -0,0 +1,41 @@
+#
+# build settings shared by the top-level Makefile and the Makefiles of the commands
+#
+# Copyright (c) 2022 Yuichiro MORIGUCHI
+#
+# This software is released under the MIT License.
+# http://opensource.org/licenses/mit-license.php
+#
+
+CC      = gcc
+AR      = gcc-ar
+CFLAGS  = -O2 -flto
+LDFLAGS =
+LIBS    = -pthread
+
+ifdef DEBUG
+CFLAGS  = -O0 -g
+endif
+CFLAGS  += -pthread
+ifdef STATS
+CFLAGS  += -DFLATJSON_STATS
+endif
+ifdef ZLIB
+CFLAGS  += -DFLATJSON_ZLIB
+LIBS    += -lz
+endif
+ifdef ZSTD
+CFLAGS  += -DFLATJSON_ZSTD
+LIBS    += -lzstd
+endif
+ifdef URING
+CFLAGS  += -DFLATJSON_URING
+endif
+
+# make pgo sets PGO=generate to build instrumented commands and PGO=use to rebuild them by the profile.
+ifeq ($(PGO),generate)
+CFLAGS  += -fprofile-generate -fprofile-update=atomic
+endif
+ifeq ($(PGO),use)
+CFLAGS  += -fprofile-use -fprofile-correction -Wno-missing-profile
+endif
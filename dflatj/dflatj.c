@@ -6,80 +6,142 @@
  * This software is released under the MIT License.
  * http://opensource.org/licenses/mit-license.php
  **/
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include "../common.h"
 
-static jmp_buf top;
+/*
+ * fields of a line of flat text. Each field is terminated by '\0' in text and begins at offsets[i].
+ * The last field is the value. Buffers of the current and the previous line are swapped and reused,
+ * so memory of flat text depends only on the longest line and the depth.
+ */
+typedef struct flat_line {
+    char *text;
+    size_t length;
+    size_t size;
+    size_t start;
+    size_t *offsets;
+    int count;
+    int offsets_size;
+} flat_line;
 
-void throw() {
-    longjmp(top, EXIT_EXCEPTION);
-}
+#define line_field(l, i) ((l)->text + (l)->offsets[i])
 
-static FILE *fpout;
+typedef struct segment {
+    int index;
+    int key;
+} path_segment;
 
-typedef struct list {
+typedef struct dflatj_context {
+    FILE *fpout;
+    jmp_buf top;
+    flat_line line;
+    flat_line prev;
+    char separator;
+    char index_prefix;
+    int string_suffix;
+    int validate_utf8;
+    utf8_validator utf8;
+    int show_stats;
+    void (*input)(struct dflatj_context *ctx, FILE *fp);
+    /* memory of lines, the path, the value and keys is kept under mem_limit unless it is 0 */
+    size_t mem_limit;
+    /* --sort */
+    int sort_jobs;
+    /* sorters of many inputs running at once, which share RLIMIT_NOFILE */
+    int sorters;
+    struct sorter *sorter;
+    path_segment *path;
+    int path_length;
+    int path_size;
     char *value;
-    struct list *next;
-    struct list *prev;
-} line_list;
-
-static line_list *list = NULL;
-static line_list *list_ptr;
-static line_list *prev_list = NULL;
-static line_list *prev_list_ptr;
-static char separator = '\t';
-static char index_prefix = '#';
-
-void push_list(char *str) {
-    line_list *element = xalloc(sizeof(line_list));
-
-    element->value = str;
-    element->next = NULL;
-    if(list == NULL) {
-        element->prev = NULL;
-        list = list_ptr = element;
-    } else {
-        list_ptr->next = element;
-        element->prev = list_ptr;
-        list_ptr = element;
-    }
+    size_t value_size;
+    intern_table keys;
+    size_t key_bytes;
+    /* --patch: the base JSON, its reader and the tree of paths of lines with a hash table of the nodes */
+    char *patch_file;
+    reader patch_reader;
+    /* offset of the verbatim span of the base not written yet, or -1 if the base is copied as it is read */
+    long long patch_span;
+    writer patch_writer;
+    struct patch_node *patch;
+    struct patch_node **patch_table;
+    int patch_table_size;
+    int patch_count;
+    stats stats;
+} dflatj_context;
+
+void throw(dflatj_context *ctx) {
+    longjmp(ctx->top, EXIT_EXCEPTION);
+}
+
+/* memory of an interned key besides its bytes, counted for --mem-limit */
+#define KEY_OVERHEAD 80
+
+size_t dflatj_memory(dflatj_context *ctx) {
+    return ctx->line.size + ctx->prev.size + (ctx->line.offsets_size + ctx->prev.offsets_size) * sizeof(size_t) +
+        ctx->path_size * sizeof(path_segment) + ctx->value_size + ctx->key_bytes;
 }
 
-void free_list(line_list *free_ptr) {
-    line_list *ptr = free_ptr, *tmp;
+/* returns a size larger than size, doubled until length fits. what is named in the error of --mem-limit */
+size_t grow_size(dflatj_context *ctx, size_t size, size_t length, const char *what) {
+    size_t result;
 
-    while(ptr != NULL) {
-        tmp = ptr;
-        ptr = ptr->next;
-        free(tmp->value);
-        tmp->next = tmp->prev = NULL;
-        free(tmp);
+    for(result = size == 0 ? 256 : size * 2; result < length; result *= 2);
+    if(ctx->mem_limit > 0 && dflatj_memory(ctx) - size + result > ctx->mem_limit) {
+        fprintf(stderr, "%s exceeds --mem-limit\n", what);
+        throw(ctx);
+    } else if(result > INT_MAX) {
+        fprintf(stderr, "%s is too long\n", what);
+        throw(ctx);
     }
+    return result;
+}
+
+void grow_line(dflatj_context *ctx, int ch) {
+    flat_line *l = &ctx->line;
+
+    l->size = grow_size(ctx, l->size, l->length + 1, "line");
+    l->text = (char *)xrealloc(l->text, (int)l->size);
+    l->text[l->length++] = (char)ch;
+}
+
+#define append_line(ctx, ch) ((ctx)->line.length < (ctx)->line.size ? (void)((ctx)->line.text[(ctx)->line.length++] = (char)(ch)) : grow_line((ctx), (ch)))
+
+void free_line(flat_line *l) {
+    xfree(l->text);
+    xfree(l->offsets);
+    memset(l, 0, sizeof(flat_line));
 }
 
-char *get_array_index(char *value) {
-    if(strlen(value) > 0 && *value == index_prefix) {
+char *get_array_index(dflatj_context *ctx, char *value) {
+    if(strlen(value) > 0 && *value == ctx->index_prefix) {
         return value + 1;
     } else {
         return NULL;
     }
 }
 
-int is_continue(char *current, char *prev) {
+int is_continue(dflatj_context *ctx, char *current, char *prev) {
     char *current_index_ptr, *prev_index_ptr;
     int current_index, prev_index;
 
-    if((current_index_ptr = get_array_index(current)) != NULL && (prev_index_ptr = get_array_index(prev)) != NULL) {
+    if((current_index_ptr = get_array_index(ctx, current)) != NULL && (prev_index_ptr = get_array_index(ctx, prev)) != NULL) {
         sscanf(current_index_ptr, "%d", &current_index);
         sscanf(prev_index_ptr, "%d", &prev_index);
         if(current_index < prev_index) {
             // first occurence of array index must be ascending.
             fprintf(stderr, "malformed flatj format\n");
-            throw();
+            throw(ctx);
         }
         return current_index == prev_index;
     } else {
@@ -87,7 +149,6 @@ int is_continue(char *current, char *prev) {
     }
 }
 
-int string_suffix = -1;
 enum state_check_number {
     CHECK_NUMBER_INIT,
     CHECK_NUMBER_NUMBER_START,
@@ -100,7 +161,7 @@ enum state_check_number {
     CHECK_NUMBER_EXPONENT_NUMBER
 };
 
-int check_number(char *str) {
+int check_number(dflatj_context *ctx, char *str) {
     enum state_check_number state = CHECK_NUMBER_INIT;
     char ch, *ptr = str;
 
@@ -199,7 +260,7 @@ int check_number(char *str) {
 
         default:
             fprintf(stderr, "internal error\n");
-            throw();
+            throw(ctx);
             return 0;
         }
     }
@@ -213,146 +274,1485 @@ int check_keyword(char *value) {
         strcmp(value, "{}") == 0;
 }
 
-void print_value(char *value) {
-    char *string_value;
+void print_value(dflatj_context *ctx, char *value) {
+    size_t length;
 
-    if(check_keyword(value) || check_number(value)) {
-        fprintf(fpout, "%s", value);
-    } else if(string_suffix < 0) {
-        fprintf(fpout, "\"%s\"", value);
-    } else if(value[strlen(value) - 1] == string_suffix) {
-        string_value = (char *)xalloc(strlen(value));
-        strncpy(string_value, value, strlen(value) - 1);
-        string_value[strlen(value) - 1] = '\0';
-        fprintf(fpout, "\"%s\"", string_value);
-        free(string_value);
+    if(check_keyword(value)) {
+        count_token(&ctx->stats, value[0] == '{' ? STATS_OBJECT : value[0] == '[' ? STATS_ARRAY : STATS_LITERAL);
+        fputs(value, ctx->fpout);
+    } else if(check_number(ctx, value)) {
+        count_token(&ctx->stats, STATS_NUMBER);
+        fputs(value, ctx->fpout);
+    } else if(ctx->string_suffix < 0) {
+        count_token(&ctx->stats, STATS_STRING);
+        putc('\"', ctx->fpout);
+        fputs(value, ctx->fpout);
+        putc('\"', ctx->fpout);
+    } else if((length = strlen(value)) > 0 && value[length - 1] == ctx->string_suffix) {
+        count_token(&ctx->stats, STATS_STRING);
+        putc('\"', ctx->fpout);
+        fwrite(value, 1, length - 1, ctx->fpout);
+        putc('\"', ctx->fpout);
     } else {
         fprintf(stderr, "malformed string format\n");
-        throw();
+        throw(ctx);
     }
 }
 
-void print_line() {
-    line_list *current_ptr = list, *prev_ptr = prev_list, *prev_tmp;
-    int bracket;
+void print_line(dflatj_context *ctx) {
+    flat_line *current = &ctx->line, *prev = &ctx->prev, swap;
+    int last = current->count - 1, prev_last = prev->count - 1, bracket, i = 0, k;
 
-    if(prev_list != NULL) {
-        while(current_ptr != list_ptr && prev_ptr != prev_list_ptr) {
-            if(!is_continue(current_ptr->value, prev_ptr->value)) {
-                break;
-            }
-            current_ptr = current_ptr->next;
-            prev_ptr = prev_ptr->next;
+    if(last < 0) {
+        fprintf(stderr, "malformed flatj format\n");
+        throw(ctx);
+    }
+    count_depth(&ctx->stats, last);
+    ctx->stats.lines++;
+
+    if(prev_last >= 0) {
+        while(i < last && i < prev_last && is_continue(ctx, line_field(current, i), line_field(prev, i))) {
+            i++;
         }
 
-        if(prev_ptr != prev_list_ptr) {
-            prev_tmp = prev_list_ptr->prev;
-            for(; prev_tmp != prev_ptr; prev_tmp = prev_tmp->prev) {
-                fprintf(fpout, "%c", get_array_index(prev_tmp->value) == NULL ? '}' : ']');
-            }
+        for(k = prev_last - 1; k > i; k--) {
+            putc(get_array_index(ctx, line_field(prev, k)) == NULL ? '}' : ']', ctx->fpout);
         }
-        fprintf(fpout, ",");
+        putc(',', ctx->fpout);
         bracket = 0;
 
         // check case of
         // key:value1
         // key:value2
-        if(((current_ptr->prev != NULL && get_array_index(current_ptr->prev->value) == NULL) ||
-                (prev_ptr->prev != NULL && get_array_index(prev_ptr->prev->value) == NULL)) &&
-                (current_ptr->next == NULL || prev_ptr->next == NULL)) {
+        if(i > 0 && (get_array_index(ctx, line_field(current, i - 1)) == NULL || get_array_index(ctx, line_field(prev, i - 1)) == NULL) &&
+                (i == last || i == prev_last)) {
             fprintf(stderr, "malformed flatj format\n");
-            throw();
+            throw(ctx);
         }
     } else {
         bracket = 1;
     }
 
-    if(current_ptr != list_ptr) {
-        for(; current_ptr != list_ptr; current_ptr = current_ptr->next) {
-            if(get_array_index(current_ptr->value) == NULL) {
+    for(; i < last; i++) {
+        if(get_array_index(ctx, line_field(current, i)) == NULL) {
+            if(bracket) {
+                count_token(&ctx->stats, STATS_OBJECT);
+                putc('{', ctx->fpout);
+            }
+            count_token(&ctx->stats, STATS_KEY);
+            putc('\"', ctx->fpout);
+            fputs(line_field(current, i), ctx->fpout);
+            fputs("\":", ctx->fpout);
+        } else if(bracket) {
+            count_token(&ctx->stats, STATS_ARRAY);
+            putc('[', ctx->fpout);
+        }
+        bracket = 1;
+    }
+
+    stats_enter(&ctx->stats, STATS_OUTPUT);
+    print_value(ctx, line_field(current, last));
+    stats_leave(&ctx->stats, STATS_OUTPUT);
+
+    swap = ctx->prev;
+    ctx->prev = ctx->line;
+    ctx->line = swap;
+    ctx->line.length = ctx->line.start = 0;
+    ctx->line.count = 0;
+}
+
+void print_eof(dflatj_context *ctx) {
+    int k;
+
+    for(k = ctx->prev.count - 2; k >= 0; k--) {
+        putc(get_array_index(ctx, line_field(&ctx->prev, k)) == NULL ? '}' : ']', ctx->fpout);
+    }
+    ctx->prev.count = 0;
+}
+
+void check_utf8(dflatj_context *ctx, const char *str, size_t length) {
+    if(ctx->validate_utf8 && !valid_utf8(&ctx->utf8, str, length)) {
+        fprintf(stderr, "invalid UTF-8\n");
+        throw(ctx);
+    }
+}
+
+/* ends the key, index or value appended to the current line */
+void push_field(dflatj_context *ctx) {
+    flat_line *l = &ctx->line;
+
+    check_utf8(ctx, l->text + l->start, l->length - l->start);
+    append_line(ctx, '\0');
+    if(l->count >= l->offsets_size) {
+        l->offsets_size = (int)(grow_size(ctx, l->offsets_size * sizeof(size_t), (l->count + 1) * sizeof(size_t), "line") / sizeof(size_t));
+        l->offsets = (size_t *)xrealloc(l->offsets, l->offsets_size * sizeof(size_t));
+    }
+    l->offsets[l->count++] = l->start;
+    l->start = l->length;
+}
+
+/*
+ * reads flat text and calls on_line for each line and on_eof at the end.
+ * dflatj_input is defined for the default separator as a constant
+ * and dflatj_input_separator for -F. main() chooses one of them once.
+ */
+#define DEFINE_DFLATJ_INPUT(name, separator, on_line, on_eof) \
+void name(dflatj_context *ctx, FILE *fp) { \
+    int ch, newline = 1; \
+ \
+    while(1) { \
+        if((ch = getc(fp)) == EOF) { \
+            if(!newline) { \
+                push_field(ctx); \
+            } \
+            if(ctx->line.count > 0) { \
+                on_line(ctx); \
+            } \
+            on_eof(ctx); \
+            return; \
+        } else if((separator) == '\n' && ch == '\n' && newline) { \
+            on_line(ctx); \
+        } else if(ch == (separator)) { \
+            push_field(ctx); \
+        } else if(ch == '\n') { \
+            push_field(ctx); \
+            on_line(ctx); \
+        } else { \
+            append_line(ctx, ch); \
+        } \
+        newline = ch == '\n'; \
+    } \
+}
+
+DEFINE_DFLATJ_INPUT(dflatj_input, '\t', print_line, print_eof)
+DEFINE_DFLATJ_INPUT(dflatj_input_separator, ctx->separator, print_line, print_eof)
+
+void malformed_binary(dflatj_context *ctx) {
+    fprintf(stderr, "malformed binary flatj format\n");
+    throw(ctx);
+}
+
+/* reads a string into the value buffer, which is reused */
+char *read_binary_string(dflatj_context *ctx, FILE *fp, unsigned long *length) {
+    if(!read_varint(fp, length)) {
+        malformed_binary(ctx);
+    }
+    if(*length >= ctx->value_size) {
+        xfree(ctx->value);
+        ctx->value = NULL;
+        ctx->value_size = grow_size(ctx, ctx->value_size, *length + 1, "value");
+        ctx->value = (char *)xalloc((int)ctx->value_size);
+    }
+    if(fread(ctx->value, 1, *length, fp) != *length) {
+        malformed_binary(ctx);
+    }
+    ctx->value[*length] = '\0';
+    check_utf8(ctx, ctx->value, *length);
+    return ctx->value;
+}
+
+void print_binary_value(dflatj_context *ctx, FILE *fp) {
+    char *value;
+    unsigned long length;
+    int tag;
+
+    switch(tag = getc(fp)) {
+    case BINARY_STRING:
+    case BINARY_NUMBER:
+        count_token(&ctx->stats, tag == BINARY_STRING ? STATS_STRING : STATS_NUMBER);
+        value = read_binary_string(ctx, fp, &length);
+        if(tag == BINARY_STRING) {
+            putc('\"', ctx->fpout);
+        }
+        fwrite(value, 1, length, ctx->fpout);
+        if(tag == BINARY_STRING) {
+            putc('\"', ctx->fpout);
+        }
+        break;
+    case BINARY_NULL:
+        count_token(&ctx->stats, STATS_LITERAL);
+        fprintf(ctx->fpout, "null");
+        break;
+    case BINARY_TRUE:
+        count_token(&ctx->stats, STATS_LITERAL);
+        fprintf(ctx->fpout, "true");
+        break;
+    case BINARY_FALSE:
+        count_token(&ctx->stats, STATS_LITERAL);
+        fprintf(ctx->fpout, "false");
+        break;
+    case BINARY_EMPTY_OBJECT:
+        count_token(&ctx->stats, STATS_OBJECT);
+        fprintf(ctx->fpout, "{}");
+        break;
+    case BINARY_EMPTY_ARRAY:
+        count_token(&ctx->stats, STATS_ARRAY);
+        fprintf(ctx->fpout, "[]");
+        break;
+    default:
+        malformed_binary(ctx);
+        break;
+    }
+}
+
+void push_binary_segment(dflatj_context *ctx, FILE *fp, int first) {
+    path_segment *segment, previous;
+    unsigned long index, length;
+    char *key;
+    int tag;
+
+    if(ctx->path_length >= ctx->path_size) {
+        segment = ctx->path;
+        ctx->path_size = (int)(grow_size(ctx, ctx->path_size * sizeof(path_segment), (ctx->path_length + 1) * sizeof(path_segment), "path") / sizeof(path_segment));
+        ctx->path = (path_segment *)xalloc(ctx->path_size * sizeof(path_segment));
+        if(segment != NULL) {
+            memcpy(ctx->path, segment, ctx->path_length * sizeof(path_segment));
+            xfree(segment);
+        }
+        memset(ctx->path + ctx->path_length, 0, (ctx->path_size - ctx->path_length) * sizeof(path_segment));
+    }
+    segment = &ctx->path[ctx->path_length];
+    previous = *segment;
+    if((tag = getc(fp)) == BINARY_KEY) {
+        key = read_binary_string(ctx, fp, &length);
+        if(ctx->mem_limit > 0 && dflatj_memory(ctx) + length + KEY_OVERHEAD > ctx->mem_limit) {
+            fprintf(stderr, "keys exceed --mem-limit\n");
+            throw(ctx);
+        }
+        ctx->key_bytes += length + KEY_OVERHEAD;
+        segment->index = -1;
+        segment->key = interned_count(&ctx->keys);
+        if(segment->key >= BINARY_MAX_KEYS) {
+            /* an inline key defines no id. It is interned by an id of dflatj, which the input never refers to. */
+            if((segment->key = intern(&ctx->keys, key, (int)length)) < interned_count(&ctx->keys) - 1) {
+                ctx->key_bytes -= length + KEY_OVERHEAD;
+            }
+        } else if(intern(&ctx->keys, key, (int)length) != segment->key) {
+            malformed_binary(ctx);
+        }
+    } else if(tag == BINARY_KEY_ID && read_varint(fp, &index) && index < (unsigned long)interned_count(&ctx->keys) && index < BINARY_MAX_KEYS) {
+        segment->index = -1;
+        segment->key = (int)index;
+    } else if(tag == BINARY_INDEX && read_varint(fp, &index)) {
+        segment->index = (int)index;
+        segment->key = -1;
+    } else {
+        malformed_binary(ctx);
+    }
+
+    // first occurence of array index must be ascending.
+    if(first && ((previous.index < 0) != (segment->index < 0) || (segment->index >= 0 && segment->index <= previous.index))) {
+        malformed_binary(ctx);
+    }
+    ctx->path_length++;
+}
+
+void dflatj_binary_input(dflatj_context *ctx, FILE *fp) {
+    char magic[BINARY_MAGIC_LENGTH];
+    unsigned long pop, push, i;
+    int ch, first = 1, bracket;
+
+    if(fread(magic, 1, BINARY_MAGIC_LENGTH, fp) != BINARY_MAGIC_LENGTH || memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_LENGTH) != 0) {
+        malformed_binary(ctx);
+    }
+    while((ch = getc(fp)) != EOF) {
+        ungetc(ch, fp);
+        if(!read_varint(fp, &pop) || !read_varint(fp, &push)) {
+            malformed_binary(ctx);
+        }
+        if(first) {
+            if(pop != 0) {
+                malformed_binary(ctx);
+            }
+            bracket = 1;
+        } else {
+            if(pop == 0 || pop > (unsigned long)ctx->path_length || push == 0) {
+                malformed_binary(ctx);
+            }
+            for(i = 1; i < pop; i++) {
+                putc(ctx->path[ctx->path_length - i].index < 0 ? '}' : ']', ctx->fpout);
+            }
+            putc(',', ctx->fpout);
+            ctx->path_length -= pop;
+            bracket = 0;
+        }
+
+        for(i = 0; i < push; i++) {
+            push_binary_segment(ctx, fp, !first && i == 0);
+            if(ctx->path[ctx->path_length - 1].index < 0) {
                 if(bracket) {
-                    fprintf(fpout, "{");
+                    count_token(&ctx->stats, STATS_OBJECT);
+                    putc('{', ctx->fpout);
                 }
-                fprintf(fpout, "\"%s\":", current_ptr->value);
+                count_token(&ctx->stats, STATS_KEY);
+                putc('\"', ctx->fpout);
+                fwrite(interned_string(&ctx->keys, ctx->path[ctx->path_length - 1].key), 1, interned_length(&ctx->keys, ctx->path[ctx->path_length - 1].key), ctx->fpout);
+                fprintf(ctx->fpout, "\":");
+            } else if(bracket) {
+                count_token(&ctx->stats, STATS_ARRAY);
+                putc('[', ctx->fpout);
+            }
+            bracket = 1;
+        }
+        count_depth(&ctx->stats, ctx->path_length);
+        ctx->stats.lines++;
+        stats_enter(&ctx->stats, STATS_OUTPUT);
+        print_binary_value(ctx, fp);
+        stats_leave(&ctx->stats, STATS_OUTPUT);
+        first = 0;
+    }
+
+    for(; ctx->path_length > 0; ctx->path_length--) {
+        putc(ctx->path[ctx->path_length - 1].index < 0 ? '}' : ']', ctx->fpout);
+    }
+}
+
+/*
+ * --sort
+ *
+ * Lines are ordered by path before they are deflatted, so lines of a subtree are adjacent and
+ * array indices ascend. Fields are compared as bytes and array indices as numbers, thus keys of objects are sorted.
+ * jobs threads read chunks of the input in turn, sort them and write them to temporary files as runs.
+ * Each thread owns one chunk, whose line pointers are kept at its end, so the threads allocate no memory.
+ * The runs are merged by a heap, at most as many at once as buffers fit in half of the memory limit.
+ * The number of open runs is limited by RLIMIT_NOFILE. When so many runs are written, runs of the same level
+ * are merged into a run of the next level while the input is read, so a line is merged about log(runs) times.
+ * If the whole input fits in one chunk, it is sorted in memory.
+ */
+#define DEFAULT_MEM_LIMIT (256 << 20)
+#define SORT_MIN_CHUNK 65536
+#define SORT_MAX_CHUNK (1 << 30)
+#define SORT_READ_SIZE 4096
+#define SORT_MERGE_BUFFER 65536
+/* file descriptors kept for the standard streams and the others of the process */
+#define SORT_RESERVED_FILES 8
+
+typedef struct sort_chunk {
+    char *data;
+    size_t length;
+    size_t count;
+    /* the chunk has the whole input */
+    int whole;
+} sort_chunk;
+
+typedef struct sort_run {
+    FILE *fp;
+    char *line;
+    size_t length;
+    size_t size;
+} sort_run;
+
+typedef struct sorter {
+    char separator;
+    char index_prefix;
+    FILE *input;
+    size_t chunk_size;
+    int jobs;
+    char **blocks;
+    pthread_mutex_t mutex;
+    char *carry;
+    size_t carry_length;
+    int chunks;
+    int eof;
+    int error;
+    /* temporary files of runs, allocated by malloc() since threads append them */
+    FILE **files;
+    int file_count;
+    /* levels of the files. a run of level n is merged from runs of level n - 1, and levels do not increase in files */
+    int *levels;
+    /* runs are merged when so many of them are open */
+    int max_runs;
+    /* the number of runs merged at once */
+    int ways;
+    /* the input sorted in memory */
+    sort_chunk memory;
+    size_t next_line;
+    /* the last merge */
+    sort_run *runs;
+    int *heap;
+    int heap_count;
+    int last_run;
+    const char *output;
+    size_t output_length;
+} sorter;
+
+typedef struct sort_worker {
+    sorter *sorter;
+    sort_chunk chunk;
+    pthread_t thread;
+} sort_worker;
+
+/* lines of a chunk from the first one. they are stored downward from the end of the chunk. */
+#define chunk_lines(s, c) ((char **)((c)->data + (s)->chunk_size) - (c)->count)
+
+/* compares lines field by field. a line ended earlier is less. */
+int compare_lines(sorter *s, const char *a, const char *b) {
+    size_t length_a, length_b;
+    int result;
+
+    while(1) {
+        if(*a == s->index_prefix && *b == s->index_prefix) {
+            for(a++; *a == '0'; a++);
+            for(b++; *b == '0'; b++);
+            for(length_a = 0; a[length_a] != s->separator && a[length_a] != '\n'; length_a++);
+            for(length_b = 0; b[length_b] != s->separator && b[length_b] != '\n'; length_b++);
+            if(length_a != length_b) {
+                return length_a < length_b ? -1 : 1;
+            } else if((result = memcmp(a, b, length_a)) != 0) {
+                return result;
+            }
+            a += length_a;
+            b += length_b;
+        } else {
+            for(; *a == *b && *a != s->separator && *a != '\n'; a++, b++);
+        }
+        if(*a != *b) {
+            if(*a == s->separator || *a == '\n') {
+                return *b == s->separator || *b == '\n' ? (*a == '\n' ? -1 : 1) : -1;
+            } else if(*b == s->separator || *b == '\n') {
+                return 1;
             } else {
-                if(bracket) {
-                    fprintf(fpout, "[");
+                return (unsigned char)*a - (unsigned char)*b;
+            }
+        } else if(*a == '\n') {
+            return 0;
+        }
+        a++;
+        b++;
+    }
+}
+
+/* sorts lines by merges of bottom-up. temp has room for count lines. */
+void sort_lines(sorter *s, char **lines, char **temp, size_t count) {
+    char **from = lines, **to = temp, **swap;
+    size_t width, start, middle, end, i, j, k;
+
+    for(width = 1; width < count; width *= 2) {
+        for(start = 0; start < count; start += 2 * width) {
+            middle = start + width < count ? start + width : count;
+            end = start + 2 * width < count ? start + 2 * width : count;
+            for(i = start, j = middle, k = start; k < end; k++) {
+                if(i < middle && (j >= end || compare_lines(s, from[i], from[j]) <= 0)) {
+                    to[k] = from[i++];
+                } else {
+                    to[k] = from[j++];
                 }
             }
-            bracket = 1;
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if(from != lines) {
+        memcpy(lines, from, count * sizeof(char *));
+    }
+}
+
+/*
+ * reads the next chunk of the input into c and returns its number, or -1 at the end of the input.
+ * The last line which does not fit is carried to the next chunk.
+ * A line and two pointers to it, for sort_lines(), are counted in the chunk size.
+ */
+int fill_chunk(sorter *s, sort_chunk *c) {
+    char *start, *newline, *end;
+    size_t room, length;
+    int number = -1;
+
+    pthread_mutex_lock(&s->mutex);
+    memcpy(c->data, s->carry, s->carry_length);
+    c->length = s->carry_length;
+    c->count = 0;
+    s->carry_length = 0;
+    start = c->data;
+    while(!s->eof && !s->error) {
+        /* every byte read may end a line. one byte is left for the newline of the last line */
+        room = (s->chunk_size - c->length - 1 - (c->count + 1) * 2 * sizeof(char *)) / (1 + 2 * sizeof(char *));
+        if(room == 0 || (room < SORT_READ_SIZE && c->count > 0)) {
+            break;
+        }
+        room = room < BLOCK_SIZE ? room : BLOCK_SIZE;
+        if((length = fread(c->data + c->length, 1, room, s->input)) < room) {
+            if(ferror(s->input)) {
+                fprintf(stderr, "cannot read input\n");
+                s->error = 1;
+            }
+            s->eof = 1;
+        }
+        end = c->data + c->length + length;
+        c->length += length;
+        while((newline = memchr(start, '\n', end - start)) != NULL) {
+            chunk_lines(s, c)[-1] = start;
+            c->count++;
+            start = newline + 1;
+        }
+    }
+    if(s->eof && start < c->data + c->length) {
+        c->data[c->length++] = '\n';
+        chunk_lines(s, c)[-1] = start;
+        c->count++;
+    } else if(!s->eof && !s->error) {
+        s->carry_length = c->data + c->length - start;
+        memcpy(s->carry, start, s->carry_length);
+        c->length = start - c->data;
+        if(c->count == 0) {
+            fprintf(stderr, "line exceeds --mem-limit\n");
+            s->error = 1;
+        }
+    }
+    if(c->count > 0 && !s->error) {
+        number = s->chunks++;
+    }
+    c->whole = number == 0 && s->eof;
+    pthread_mutex_unlock(&s->mutex);
+    return number;
+}
+
+/* returns a temporary file in $TMPDIR, which is removed at once, or NULL */
+FILE *sort_temporary_file() {
+    char *dir = getenv("TMPDIR"), path[4096];
+    FILE *fp = NULL;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/dflatjXXXXXX", dir != NULL && *dir != '\0' ? dir : "/tmp");
+    if((fd = mkstemp(path)) >= 0) {
+        unlink(path);
+        if((fp = fdopen(fd, "w+")) == NULL) {
+            close(fd);
+        } else {
+            __fsetlocking(fp, FSETLOCKING_BYCALLER);
+        }
+    }
+    if(fp == NULL) {
+        fprintf(stderr, "cannot create temporary file\n");
+    }
+    return fp;
+}
+
+int merge_files(sorter *s);
+
+/* writes sorted lines of c to a temporary file as a run */
+int write_run(sorter *s, sort_chunk *c) {
+    char **lines = chunk_lines(s, c);
+    FILE *fp, **files;
+    int *levels;
+    size_t i;
+
+    if((fp = sort_temporary_file()) == NULL) {
+        return 0;
+    }
+    for(i = 0; i < c->count; i++) {
+        fwrite(lines[i], 1, (char *)memchr(lines[i], '\n', c->data + c->length - lines[i]) - lines[i] + 1, fp);
+    }
+    if(fflush(fp) != 0 || ferror(fp)) {
+        fprintf(stderr, "cannot write temporary file\n");
+        fclose(fp);
+        return 0;
+    }
+    rewind(fp);
+    pthread_mutex_lock(&s->mutex);
+    files = (FILE **)realloc(s->files, (s->file_count + 1) * sizeof(FILE *));
+    levels = files == NULL ? NULL : (int *)realloc(s->levels, (s->file_count + 1) * sizeof(int));
+    if(levels == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+    s->files = files;
+    s->levels = levels;
+    s->levels[s->file_count] = 0;
+    s->files[s->file_count++] = fp;
+    /* the other threads wait for the mutex, so no more runs are opened while they are merged */
+    if(s->file_count >= s->max_runs && !merge_files(s)) {
+        pthread_mutex_unlock(&s->mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return 1;
+}
+
+void *sort_thread(void *arg) {
+    sort_worker *w = (sort_worker *)arg;
+    sorter *s = w->sorter;
+    int number;
+
+    while((number = fill_chunk(s, &w->chunk)) >= 0) {
+        sort_lines(s, chunk_lines(s, &w->chunk), chunk_lines(s, &w->chunk) - w->chunk.count, w->chunk.count);
+        if(w->chunk.whole) {
+            s->memory = w->chunk;
+        } else if(!write_run(s, &w->chunk)) {
+            pthread_mutex_lock(&s->mutex);
+            s->error = 1;
+            pthread_mutex_unlock(&s->mutex);
         }
     }
+    return NULL;
+}
+
+/* reads the next line of a run including the newline. returns 0 at the end of the run */
+int read_run_line(sort_run *run) {
+    int ch;
+
+    run->length = 0;
+    while((ch = getc(run->fp)) != EOF) {
+        if(run->length >= run->size) {
+            run->size = run->size == 0 ? 256 : run->size * 2;
+            run->line = (char *)xrealloc(run->line, (int)run->size);
+        }
+        run->line[run->length++] = (char)ch;
+        if(ch == '\n') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define run_less(s, i, j) (compare_lines((s), (s)->runs[(s)->heap[i]].line, (s)->runs[(s)->heap[j]].line) < 0)
+
+void sift_run(sorter *s, int i) {
+    int child, tmp;
+
+    while((child = i * 2 + 1) < s->heap_count) {
+        if(child + 1 < s->heap_count && run_less(s, child + 1, child)) {
+            child++;
+        }
+        if(!run_less(s, child, i)) {
+            break;
+        }
+        tmp = s->heap[i];
+        s->heap[i] = s->heap[child];
+        s->heap[child] = tmp;
+        i = child;
+    }
+}
+
+void free_runs(sorter *s) {
+    int i;
+
+    if(s->runs != NULL) {
+        for(i = 0; i < s->heap_count; i++) {
+            xfree(s->runs[s->heap[i]].line);
+            fclose(s->runs[s->heap[i]].fp);
+        }
+        xfree(s->runs);
+        xfree(s->heap);
+        s->runs = NULL;
+        s->heap = NULL;
+        s->heap_count = 0;
+    }
+    s->output_length = 0;
+}
 
-    print_value(current_ptr->value);
+/* starts to merge count files from first */
+void start_merge(sorter *s, int first, int count) {
+    int i;
 
-    if(prev_list != NULL) {
-        free_list(prev_list);
+    s->runs = (sort_run *)xalloc(count * sizeof(sort_run));
+    s->heap = (int *)xalloc(count * sizeof(int));
+    memset(s->runs, 0, count * sizeof(sort_run));
+    s->heap_count = 0;
+    for(i = 0; i < count; i++) {
+        s->runs[i].fp = s->files[first + i];
+        setvbuf(s->runs[i].fp, NULL, _IOFBF, SORT_MERGE_BUFFER);
+        if(read_run_line(&s->runs[i])) {
+            s->heap[s->heap_count++] = i;
+        } else {
+            xfree(s->runs[i].line);
+            fclose(s->runs[i].fp);
+        }
+    }
+    for(i = s->heap_count / 2 - 1; i >= 0; i--) {
+        sift_run(s, i);
     }
-    prev_list = list;
-    prev_list_ptr = list_ptr;
-    list = list_ptr = NULL;
+    s->file_count -= count;
+    memmove(s->files + first, s->files + first + count, (s->file_count - first) * sizeof(FILE *));
+    memmove(s->levels + first, s->levels + first + count, (s->file_count - first) * sizeof(int));
+    s->last_run = -1;
 }
 
-void print_eof() {
-    line_list *ptr;
+/* sets output to the next line of the merge. returns 0 at the end */
+int next_merged_line(sorter *s) {
+    sort_run *run;
 
-    if(prev_list != NULL) {
-        if(prev_list_ptr->prev != NULL) {
-            ptr = prev_list_ptr->prev;
-            for(; ptr != NULL; ptr = ptr->prev) {
-                fprintf(fpout, "%c", get_array_index(ptr->value) == NULL ? '}' : ']');
+    if(s->heap_count == 0) {
+        return 0;
+    } else if(s->last_run >= 0) {
+        run = &s->runs[s->heap[0]];
+        if(!read_run_line(run)) {
+            if(ferror(run->fp)) {
+                fprintf(stderr, "cannot read temporary file\n");
+                s->error = 1;
             }
+            xfree(run->line);
+            fclose(run->fp);
+            s->heap[0] = s->heap[--s->heap_count];
         }
-        free_list(prev_list);
+        sift_run(s, 0);
+    }
+    if(s->heap_count == 0) {
+        return 0;
     }
+    s->last_run = s->heap[0];
+    s->output = s->runs[s->heap[0]].line;
+    s->output_length = s->runs[s->heap[0]].length;
+    return 1;
 }
 
-void dflatj_input(FILE *fp) {
-    int ch, newline = 1;
+/*
+ * merges the oldest runs of the lowest level which has more than one run, at most ways of them,
+ * into a run of the next level in their place, so levels do not increase in files.
+ * If every level has one run, the newest runs, which are the smallest, are merged into a run of the highest
+ * level of them. returns 0 on error
+ */
+int merge_files(sorter *s) {
+    FILE *merged;
+    int first = s->file_count, last = s->file_count, count, level;
+
+    while(first > 0 && last - first < 2) {
+        last = first;
+        for(first = last - 1; first > 0 && s->levels[first - 1] == s->levels[last - 1]; first--);
+    }
+    if(last - first < 2) {
+        first = s->file_count > s->ways ? s->file_count - s->ways : 0;
+        count = s->file_count - first;
+        level = s->levels[first];
+    } else {
+        count = last - first < s->ways ? last - first : s->ways;
+        level = s->levels[first] + 1;
+    }
+    if((merged = sort_temporary_file()) == NULL) {
+        return 0;
+    }
+    start_merge(s, first, count);
+    while(next_merged_line(s)) {
+        fwrite(s->output, 1, s->output_length, merged);
+    }
+    free_runs(s);
+    if(fflush(merged) != 0 || ferror(merged)) {
+        fprintf(stderr, "cannot write temporary file\n");
+        fclose(merged);
+        return 0;
+    }
+    rewind(merged);
+    memmove(s->files + first + 1, s->files + first, (s->file_count - first) * sizeof(FILE *));
+    memmove(s->levels + first + 1, s->levels + first, (s->file_count - first) * sizeof(int));
+    s->files[first] = merged;
+    s->levels[first] = level;
+    s->file_count++;
+    return !s->error;
+}
+
+/* sets output to the next sorted line. returns 0 at the end */
+int next_sorted_line(sorter *s) {
+    char *line;
+
+    if(s->memory.data == NULL) {
+        return next_merged_line(s);
+    } else if(s->next_line < s->memory.count) {
+        line = chunk_lines(s, &s->memory)[s->next_line++];
+        s->output = line;
+        s->output_length = (char *)memchr(line, '\n', s->memory.data + s->memory.length - line) - line + 1;
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static ssize_t sorted_read(void *cookie, char *buf, size_t size) {
+    sorter *s = (sorter *)cookie;
+    size_t length, total = 0;
+
+    while(total < size && (s->output_length > 0 || next_sorted_line(s))) {
+        length = s->output_length < size - total ? s->output_length : size - total;
+        memcpy(buf + total, s->output, length);
+        s->output += length;
+        s->output_length -= length;
+        total += length;
+    }
+    return s->error ? -1 : (ssize_t)total;
+}
+
+void free_sorter(sorter *s) {
+    int i;
+
+    free_runs(s);
+    for(i = 0; i < s->file_count; i++) {
+        fclose(s->files[i]);
+    }
+    free(s->files);
+    free(s->levels);
+    for(i = 0; i < s->jobs; i++) {
+        xfree(s->blocks[i]);
+    }
+    xfree(s->blocks);
+    xfree(s->carry);
+    pthread_mutex_destroy(&s->mutex);
+    xfree(s);
+}
 
-    init_buffer();
+/* the input function of --sort, which sorts the input and reads it by the input function of flat text */
+void dflatj_sorted_input(dflatj_context *ctx, FILE *fp) {
+    cookie_io_functions_t functions = { sorted_read, NULL, NULL, NULL };
+    sort_worker *workers;
+    sorter *s;
+    FILE *sorted;
+    struct rlimit limit;
+    size_t mem_limit;
+    int ways, i;
+
+    s = ctx->sorter = (sorter *)xalloc(sizeof(sorter));
+    memset(s, 0, sizeof(sorter));
+    s->separator = ctx->separator;
+    s->index_prefix = ctx->index_prefix;
+    s->input = fp;
+    s->jobs = ctx->sort_jobs;
+    mem_limit = ctx->mem_limit > 0 ? ctx->mem_limit : DEFAULT_MEM_LIMIT;
+    s->chunk_size = mem_limit / (s->jobs + 1) & ~(size_t)(sizeof(char *) - 1);
+    s->chunk_size = s->chunk_size < SORT_MIN_CHUNK ? SORT_MIN_CHUNK : s->chunk_size > SORT_MAX_CHUNK ? SORT_MAX_CHUNK : s->chunk_size;
+    /* runs are merged by buffers in half of the memory limit */
+    ways = (int)(mem_limit / (2 * SORT_MERGE_BUFFER));
+    s->ways = ways < 2 ? 2 : ways;
+    /* the input, the output, each writer and the merged run need one more file */
+    s->max_runs = INT_MAX;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t)INT_MAX) {
+        s->max_runs = ((int)limit.rlim_cur - SORT_RESERVED_FILES) / ctx->sorters - s->jobs - 3;
+        s->max_runs = s->max_runs < 2 ? 2 : s->max_runs;
+    }
+    s->ways = s->ways < s->max_runs ? s->ways : s->max_runs;
+    pthread_mutex_init(&s->mutex, NULL);
+    s->carry = (char *)xalloc((int)s->chunk_size);
+    s->blocks = (char **)xalloc(s->jobs * sizeof(char *));
+    workers = (sort_worker *)xalloc(s->jobs * sizeof(sort_worker));
+    for(i = 0; i < s->jobs; i++) {
+        s->blocks[i] = (char *)xalloc((int)s->chunk_size);
+        workers[i].sorter = s;
+        workers[i].chunk.data = s->blocks[i];
+    }
+
+    if(s->jobs == 1) {
+        sort_thread(&workers[0]);
+    } else {
+        for(i = 0; i < s->jobs; i++) {
+            if(pthread_create(&workers[i].thread, NULL, sort_thread, &workers[i]) != 0) {
+                fprintf(stderr, "cannot create thread\n");
+                exit(EXIT_ERROR);
+            }
+        }
+        for(i = 0; i < s->jobs; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    xfree(workers);
+    if(s->error) {
+        throw(ctx);
+    }
+
+    /* merges runs until they are few enough to be merged at once */
+    while(s->file_count > s->ways) {
+        if(!merge_files(s)) {
+            throw(ctx);
+        }
+    }
+    if(s->memory.data == NULL) {
+        start_merge(s, 0, s->file_count);
+    }
+
+    if((sorted = fopencookie(s, "r", functions)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_ERROR);
+    }
+    __fsetlocking(sorted, FSETLOCKING_BYCALLER);
+    (ctx->separator == '\t' ? dflatj_input : dflatj_input_separator)(ctx, sorted);
+    fclose(sorted);
+    if(s->error) {
+        throw(ctx);
+    }
+}
+
+/*
+ * --patch base
+ *
+ * Lines of flat text are read into a tree of paths, then the base JSON is streamed to the output.
+ * Only objects and arrays on the paths of the lines are parsed. The other values are copied
+ * as bytes, following only strings and brackets to find their ends, and values of the lines replace
+ * the values at their paths. Paths which are not in the base are appended to their objects and arrays.
+ */
+#define PATCH_TABLE_SIZE 256
+
+typedef struct patch_node {
+    struct patch_node *parent;
+    /* key of an object, or NULL for index of an array */
+    char *key;
+    size_t key_length;
+    long index;
+    unsigned int hash;
+    /* value of the line whose path ends at this node, or NULL */
+    char *value;
+    struct patch_node *children;
+    struct patch_node *last_child;
+    struct patch_node *next;
+    struct patch_node *bucket_next;
+    int applied;
+} patch_node;
+
+unsigned int hash_patch(patch_node *parent, const char *key, size_t key_length, long index) {
+    unsigned int hash = (unsigned int)((size_t)parent >> 4) * 16777619u;
+    size_t i;
+
+    if(key == NULL) {
+        return hash ^ (unsigned int)index * 2654435761u;
+    }
+    for(i = 0; i < key_length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+patch_node *find_patch(dflatj_context *ctx, patch_node *parent, const char *key, size_t key_length, long index) {
+    unsigned int hash = hash_patch(parent, key, key_length, index);
+    patch_node *node;
+
+    for(node = ctx->patch_table[hash & (ctx->patch_table_size - 1)]; node != NULL; node = node->bucket_next) {
+        if(node->parent == parent && node->hash == hash && (key == NULL ? node->key == NULL && node->index == index :
+                node->key != NULL && node->key_length == key_length && memcmp(node->key, key, key_length) == 0)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+void grow_patch_table(dflatj_context *ctx) {
+    patch_node **table = ctx->patch_table, *node, *next;
+    int size = ctx->patch_table_size, i;
+
+    ctx->patch_table_size = size == 0 ? PATCH_TABLE_SIZE : size * 2;
+    ctx->patch_table = (patch_node **)xalloc(ctx->patch_table_size * sizeof(patch_node *));
+    memset(ctx->patch_table, 0, ctx->patch_table_size * sizeof(patch_node *));
+    for(i = 0; i < size; i++) {
+        for(node = table[i]; node != NULL; node = next) {
+            next = node->bucket_next;
+            node->bucket_next = ctx->patch_table[node->hash & (ctx->patch_table_size - 1)];
+            ctx->patch_table[node->hash & (ctx->patch_table_size - 1)] = node;
+        }
+    }
+    xfree(table);
+}
+
+char *copy_patch_string(const char *str) {
+    char *result = (char *)xalloc(strlen(str) + 1);
+
+    strcpy(result, str);
+    return result;
+}
+
+/* returns the child of parent at a field of a line, which is created if it is not found. */
+patch_node *get_patch_child(dflatj_context *ctx, patch_node *parent, char *field) {
+    char *index_ptr = get_array_index(ctx, field), *end;
+    long index = -1;
+    patch_node *node, *p;
+
+    if(index_ptr != NULL && (!isdigit((unsigned char)*index_ptr) || (index = strtol(index_ptr, &end, 10)) < 0 || *end != '\0')) {
+        fprintf(stderr, "malformed flatj format\n");
+        throw(ctx);
+    } else if(parent->children != NULL && (parent->children->key == NULL) != (index_ptr != NULL)) {
+        fprintf(stderr, "malformed flatj format\n");
+        throw(ctx);
+    } else if((node = find_patch(ctx, parent, index_ptr == NULL ? field : NULL, strlen(field), index)) != NULL) {
+        return node;
+    }
+
+    if(ctx->patch_count >= ctx->patch_table_size) {
+        grow_patch_table(ctx);
+    }
+    node = (patch_node *)xalloc(sizeof(patch_node));
+    memset(node, 0, sizeof(patch_node));
+    node->parent = parent;
+    node->key = index_ptr == NULL ? copy_patch_string(field) : NULL;
+    node->key_length = strlen(field);
+    node->index = index;
+    node->hash = hash_patch(parent, node->key, node->key_length, index);
+    node->bucket_next = ctx->patch_table[node->hash & (ctx->patch_table_size - 1)];
+    ctx->patch_table[node->hash & (ctx->patch_table_size - 1)] = node;
+    ctx->patch_count++;
+
+    /* indices are kept in ascending order, which is the order of lines of flat text */
+    if(parent->last_child == NULL) {
+        parent->children = parent->last_child = node;
+    } else if(node->key != NULL || parent->last_child->index < index) {
+        parent->last_child = parent->last_child->next = node;
+    } else if(parent->children->index > index) {
+        node->next = parent->children;
+        parent->children = node;
+    } else {
+        for(p = parent->children; p->next->index < index; p = p->next);
+        node->next = p->next;
+        p->next = node;
+    }
+    return node;
+}
+
+/* adds the current line to the tree of --patch */
+void add_patch_line(dflatj_context *ctx) {
+    patch_node *node = ctx->patch;
+    int last = ctx->line.count - 1, i;
+    char *value;
+    size_t length;
+
+    if(last < 0) {
+        fprintf(stderr, "malformed flatj format\n");
+        throw(ctx);
+    }
+    for(i = 0; i < last; i++) {
+        if(node->value != NULL) {
+            fprintf(stderr, "conflicting paths in patch\n");
+            throw(ctx);
+        }
+        node = get_patch_child(ctx, node, line_field(&ctx->line, i));
+    }
+    if(node->value != NULL || node->children != NULL) {
+        fprintf(stderr, "conflicting paths in patch\n");
+        throw(ctx);
+    }
+    value = line_field(&ctx->line, last);
+    if(ctx->string_suffix >= 0 && !check_keyword(value) && !check_number(ctx, value) &&
+            ((length = strlen(value)) == 0 || value[length - 1] != ctx->string_suffix)) {
+        fprintf(stderr, "malformed string format\n");
+        throw(ctx);
+    }
+    node->value = copy_patch_string(value);
+    ctx->line.length = ctx->line.start = 0;
+    ctx->line.count = 0;
+}
+
+void free_patch(dflatj_context *ctx) {
+    patch_node *node, *next;
+    int i;
+
+    for(i = 0; i < ctx->patch_table_size; i++) {
+        for(node = ctx->patch_table[i]; node != NULL; node = next) {
+            next = node->bucket_next;
+            xfree(node->key);
+            xfree(node->value);
+            xfree(node);
+        }
+    }
+    xfree(ctx->patch_table);
+    ctx->patch_table = NULL;
+    ctx->patch_table_size = ctx->patch_count = 0;
+    if(ctx->patch != NULL) {
+        xfree(ctx->patch->value);
+        xfree(ctx->patch);
+        ctx->patch = NULL;
+    }
+    if(ctx->patch_reader.fp != NULL) {
+        fclose(ctx->patch_reader.fp);
+        ctx->patch_reader.fp = NULL;
+    }
+}
+
+/*
+ * writes bytes of the base unless it is seekable. Then unchanged bytes are left in a span,
+ * which flush_base_span() writes by write_span() before the output leaves the base.
+ */
+void copy_base(dflatj_context *ctx, const char *bytes, size_t length) {
+    if(ctx->patch_span < 0) {
+        fwrite(bytes, 1, length, ctx->fpout);
+    }
+}
+
+/* writes the span up to the head of the base. The next span starts at the head. */
+void flush_base_span(dflatj_context *ctx) {
+    reader *r = &ctx->patch_reader;
+
+    if(ctx->patch_span >= 0) {
+        if(!write_span(r, ctx->patch_span, reader_offset(r), &ctx->patch_writer)) {
+            fprintf(stderr, "%s: cannot read\n", ctx->patch_file);
+            throw(ctx);
+        }
+        flush_writer(&ctx->patch_writer);
+        ctx->patch_span = reader_offset(r);
+    }
+}
+
+/* prints the lines below a node as JSON */
+void print_patch(dflatj_context *ctx, patch_node *node) {
+    patch_node *p;
+
+    node->applied = 1;
+    if(node->value != NULL) {
+        print_value(ctx, node->value);
+        return;
+    }
+    putc(node->children->key != NULL ? '{' : '[', ctx->fpout);
+    for(p = node->children; p != NULL; p = p->next) {
+        if(p != node->children) {
+            putc(',', ctx->fpout);
+        }
+        if(p->key != NULL) {
+            putc('\"', ctx->fpout);
+            fwrite(p->key, 1, p->key_length, ctx->fpout);
+            fputs("\":", ctx->fpout);
+        }
+        print_patch(ctx, p);
+    }
+    putc(node->children->key != NULL ? '}' : ']', ctx->fpout);
+}
+
+/* appends members or elements which are not in the base to the end of an object or an array */
+void print_new_patches(dflatj_context *ctx, patch_node *node, int first) {
+    patch_node *p;
+
+    flush_base_span(ctx);
+    for(p = node->children; p != NULL; p = p->next) {
+        if(!p->applied) {
+            if(!first) {
+                putc(',', ctx->fpout);
+            }
+            if(p->key != NULL) {
+                putc('\"', ctx->fpout);
+                fwrite(p->key, 1, p->key_length, ctx->fpout);
+                fputs("\":", ctx->fpout);
+            }
+            print_patch(ctx, p);
+            first = 0;
+        }
+    }
+}
+
+void invalid_base(dflatj_context *ctx, int ch) {
+    fprintf(stderr, ch == EOF ? "%s: unexpected EOF\n" : "%s: invalid JSON\n", ctx->patch_file);
+    throw(ctx);
+}
+
+int peek_base(dflatj_context *ctx) {
+    reader *r = &ctx->patch_reader;
+
+    if(r->ptr == r->end && fill_reader(r) == 0) {
+        return EOF;
+    }
+    return (unsigned char)*r->ptr;
+}
+
+void copy_base_space(dflatj_context *ctx) {
+    reader *r = &ctx->patch_reader;
+    size_t length;
+
+    while(r->ptr < r->end || fill_reader(r) > 0) {
+        length = whitespace_run(r->ptr, r->end);
+        copy_base(ctx, r->ptr, length);
+        if((r->ptr += length) < r->end) {
+            break;
+        }
+    }
+}
+
+void copy_base_char(dflatj_context *ctx, int expected) {
+    int ch = peek_base(ctx);
+
+    if(ch != expected) {
+        invalid_base(ctx, ch);
+    }
+    copy_base(ctx, ctx->patch_reader.ptr++, 1);
+}
+
+/*
+ * copies the value at the head of the base, or skips it if copy is 0.
+ * The value is not tokenized. Only strings and brackets are followed to find its end.
+ */
+void pass_base_value(dflatj_context *ctx, int copy) {
+    reader *r = &ctx->patch_reader;
+    int ch = peek_base(ctx), depth = 0, in_string = 0, escape = 0, done = 0;
+    char *start;
+
+    if(ch == EOF || ch == ',' || ch == ':' || ch == '}' || ch == ']') {
+        invalid_base(ctx, ch);
+    } else if(ch != '{' && ch != '[' && ch != '\"') {
+        /* number or literal ends at a delimiter */
+        do {
+            start = r->ptr;
+            while(r->ptr < r->end && !strchr(",:{}[]\" \t\r\n", *r->ptr)) {
+                r->ptr++;
+            }
+            if(copy) {
+                copy_base(ctx, start, r->ptr - start);
+            }
+        } while(r->ptr == r->end && fill_reader(r) > 0);
+        return;
+    }
+    while(!done) {
+        if(r->ptr == r->end && fill_reader(r) == 0) {
+            invalid_base(ctx, EOF);
+        }
+        for(start = r->ptr; r->ptr < r->end && !done;) {
+            if(escape) {
+                escape = 0;
+                r->ptr++;
+            } else if(in_string) {
+                if((r->ptr += string_run(r->ptr, r->end)) < r->end) {
+                    ch = *r->ptr++;
+                    if(ch == '\\') {
+                        escape = 1;
+                    } else if(ch == '\"') {
+                        in_string = 0;
+                        done = depth == 0;
+                    }
+                }
+            } else {
+                ch = *r->ptr++;
+                if(ch == '\"') {
+                    in_string = 1;
+                } else if(ch == '{' || ch == '[') {
+                    depth++;
+                } else if(ch == '}' || ch == ']') {
+                    done = --depth == 0;
+                }
+            }
+        }
+        if(copy) {
+            copy_base(ctx, start, r->ptr - start);
+        }
+    }
+}
+
+void patch_base_value(dflatj_context *ctx, patch_node *node);
+
+void patch_base_object(dflatj_context *ctx, patch_node *node) {
+    reader *r = &ctx->patch_reader;
+    size_t length;
+    int ch;
+
+    copy_base_char(ctx, '{');
+    copy_base_space(ctx);
+    if(peek_base(ctx) == '}') {
+        print_new_patches(ctx, node, 1);
+        copy_base_char(ctx, '}');
+        return;
+    }
     while(1) {
-        if((ch = getc(fp)) == EOF) {
-            if(!newline) {
-                push_list(to_string_buffer());
-                init_buffer();
+        /* the key is kept in the value buffer without quotes to find the node */
+        copy_base_char(ctx, '\"');
+        length = 0;
+        while((ch = peek_base(ctx)) != '\"') {
+            if(ch == EOF) {
+                invalid_base(ctx, ch);
+            } else if(length + 2 > ctx->value_size) {
+                ctx->value_size = grow_size(ctx, ctx->value_size, length + 2, "key");
+                ctx->value = (char *)xrealloc(ctx->value, (int)ctx->value_size);
             }
-            if(list != NULL) {
-                print_line();
+            ctx->value[length++] = (char)ch;
+            copy_base(ctx, r->ptr++, 1);
+            if(ch == '\\' && (ch = peek_base(ctx)) != EOF) {
+                ctx->value[length++] = (char)ch;
+                copy_base(ctx, r->ptr++, 1);
             }
-            print_eof();
+        }
+        copy_base_char(ctx, '\"');
+        copy_base_space(ctx);
+        copy_base_char(ctx, ':');
+        copy_base_space(ctx);
+        patch_base_value(ctx, find_patch(ctx, node, ctx->value, length, -1));
+        copy_base_space(ctx);
+        if(peek_base(ctx) == '}') {
+            print_new_patches(ctx, node, 0);
+            copy_base_char(ctx, '}');
             return;
-        } else if(separator == '\n' && ch == '\n' && newline) {
-            print_line();
-        } else if(ch == separator) {
-            push_list(to_string_buffer());
-            init_buffer();
-        } else if(ch == '\n') {
-            push_list(to_string_buffer());
-            init_buffer();
-            print_line();
-        } else {
-            append_buffer(ch);
         }
-        newline = ch == '\n';
+        copy_base_char(ctx, ',');
+        copy_base_space(ctx);
+    }
+}
+
+void patch_base_array(dflatj_context *ctx, patch_node *node) {
+    long index;
+
+    copy_base_char(ctx, '[');
+    copy_base_space(ctx);
+    if(peek_base(ctx) == ']') {
+        print_new_patches(ctx, node, 1);
+        copy_base_char(ctx, ']');
+        return;
+    }
+    for(index = 0; ; index++) {
+        patch_base_value(ctx, find_patch(ctx, node, NULL, 0, index));
+        copy_base_space(ctx);
+        if(peek_base(ctx) == ']') {
+            print_new_patches(ctx, node, 0);
+            copy_base_char(ctx, ']');
+            return;
+        }
+        copy_base_char(ctx, ',');
+        copy_base_space(ctx);
+    }
+}
+
+/* copies a value of the base with the lines below node, which may be NULL. */
+void patch_base_value(dflatj_context *ctx, patch_node *node) {
+    int ch = peek_base(ctx);
+
+    if(node == NULL) {
+        pass_base_value(ctx, 1);
+        return;
+    } else if(node->value == NULL && ch == '{' && node->children->key != NULL) {
+        patch_base_object(ctx, node);
+    } else if(node->value == NULL && ch == '[' && node->children->key == NULL) {
+        patch_base_array(ctx, node);
+    } else {
+        /* a value of a line, or lines of another type than the base, replace the value */
+        flush_base_span(ctx);
+        pass_base_value(ctx, 0);
+        print_patch(ctx, node);
+        if(ctx->patch_span >= 0) {
+            ctx->patch_span = reader_offset(&ctx->patch_reader);
+        }
+    }
+    node->applied = 1;
+}
+
+/* streams the base through the tree of lines when they are read. */
+void patch_base(dflatj_context *ctx) {
+    patch_node *root = ctx->patch;
+
+    init_reader(&ctx->patch_reader, openfile(ctx->patch_file, "r"));
+    init_writer(&ctx->patch_writer, ctx->fpout);
+    ctx->patch_span = seekable_reader(&ctx->patch_reader) ? reader_offset(&ctx->patch_reader) : -1;
+    copy_base_space(ctx);
+    patch_base_value(ctx, root->value != NULL || root->children != NULL ? root : NULL);
+    copy_base_space(ctx);
+    if(peek_base(ctx) != EOF) {
+        invalid_base(ctx, 0);
+    }
+    flush_base_span(ctx);
+}
+
+void start_patch(dflatj_context *ctx) {
+    ctx->patch = (patch_node *)xalloc(sizeof(patch_node));
+    memset(ctx->patch, 0, sizeof(patch_node));
+    grow_patch_table(ctx);
+}
+
+DEFINE_DFLATJ_INPUT(read_patch_lines, ctx->separator, add_patch_line, patch_base)
+
+void dflatj_patch_input(dflatj_context *ctx, FILE *fp) {
+    start_patch(ctx);
+    read_patch_lines(ctx, fp);
+}
+
+void init_dflatj_context(dflatj_context *ctx) {
+    memset(ctx, 0, sizeof(dflatj_context));
+    ctx->fpout = stdout;
+    ctx->separator = '\t';
+    ctx->index_prefix = '#';
+    ctx->string_suffix = -1;
+    init_utf8_validator(&ctx->utf8);
+}
+
+void free_dflatj_context(dflatj_context *ctx) {
+    if(ctx->sorter != NULL) {
+        free_sorter(ctx->sorter);
+    }
+    free_line(&ctx->line);
+    free_line(&ctx->prev);
+    free_patch(ctx);
+    xfree(ctx->patch_reader.buffer);
+    xfree(ctx->patch_writer.buffer);
+    xfree(ctx->path);
+    xfree(ctx->value);
+    free_intern_table(&ctx->keys);
+}
+
+/* initializes the context of another worker by the options of ctx. Nothing on the heap is shared. */
+void init_dflatj_worker(dflatj_context *worker, dflatj_context *ctx) {
+    memcpy(worker, ctx, sizeof(dflatj_context));
+    memset(&worker->line, 0, sizeof(flat_line));
+    memset(&worker->prev, 0, sizeof(flat_line));
+    memset(&worker->keys, 0, sizeof(intern_table));
+    memset(&worker->patch_reader, 0, sizeof(reader));
+    memset(&worker->patch_writer, 0, sizeof(writer));
+    memset(&worker->stats, 0, sizeof(stats));
+    worker->sorter = NULL;
+    worker->path = NULL;
+    worker->path_length = worker->path_size = 0;
+    worker->value = NULL;
+    worker->value_size = 0;
+    worker->key_bytes = 0;
+    worker->patch = NULL;
+    worker->patch_table = NULL;
+    worker->patch_table_size = worker->patch_count = 0;
+}
+
+int dflatj_file(dflatj_context *ctx, void (*input)(dflatj_context *ctx, FILE *fp), FILE *fp) {
+    int errcode;
+
+    stats_enter(&ctx->stats, STATS_TOTAL);
+    if((errcode = setjmp(ctx->top)) == 0) {
+        input(ctx, fp);
+    }
+    stats_leave(&ctx->stats, STATS_TOTAL);
+    if(ctx->patch_file == NULL) {
+        fprintf(ctx->fpout, "\n");
     }
+    return errcode;
+}
+
+/*
+ * clears the state of the last file, which may be left by an error. Buffers are kept for the next file.
+ * Interned keys are dropped since keys of binary input are defined again from id 0.
+ * Temporary files of --sort and the base of --patch are closed.
+ */
+void reset_dflatj_context(dflatj_context *ctx) {
+    ctx->line.length = ctx->line.start = 0;
+    ctx->line.count = ctx->prev.count = 0;
+    ctx->path_length = 0;
+    free_intern_table(&ctx->keys);
+    ctx->key_bytes = 0;
+    if(ctx->sorter != NULL) {
+        free_sorter(ctx->sorter);
+        ctx->sorter = NULL;
+    }
+    free_patch(ctx);
+}
+
+/* process() of the file pool */
+int dflatj_process(void *context, char *filename, FILE *input, FILE *output) {
+    dflatj_context *ctx = (dflatj_context *)context;
+    FILE *fp = ctx->show_stats ? stats_file(input, 0, &ctx->stats) : input;
+    int errcode;
+
+    (void)filename;
+    ctx->fpout = ctx->show_stats ? stats_file(output, 1, &ctx->stats) : output;
+    errcode = dflatj_file(ctx, ctx->input, fp);
+    if(ctx->show_stats) {
+        fclose(fp);
+        fclose(ctx->fpout);
+    }
+    reset_dflatj_context(ctx);
+    return errcode;
 }
 
 void usage() {
-    fprintf(stderr, "usage: dflatj [option] [-o output] [input]\n");
+    fprintf(stderr, "usage: dflatj [option] [-j jobs] [-o output|directory] [input...]\n");
     fprintf(stderr, "option:\n");
     fprintf(stderr, "-F delimiter\n");
     fprintf(stderr, "-i index-prefix\n");
     fprintf(stderr, "-s string-suffix\n");
+    fprintf(stderr, "--binary\n");
+    fprintf(stderr, "--sort\n");
+    fprintf(stderr, "--mem-limit size\n");
+    fprintf(stderr, "--patch base\n");
+    fprintf(stderr, "--validate-utf8\n");
+    fprintf(stderr, "--stats\n");
+    fprintf(stderr, "--io-depth depth\n");
     exit(EXIT_USAGE);
 }
 
 int main(int argc, char *argv[]) {
-    FILE *input = NULL;
-    int argindex = 1, errcode = 0, argch;
+    dflatj_context *contexts, *ctx;
+    file_pool pool;
+    int argindex = 1, errcode = 0, argch, show_stats = 0, sort = 0, jobs = 1, depth, i;
+    unsigned long long mem_limit = 0;
     char *outfile = NULL;
+    void (*input_function)(dflatj_context *ctx, FILE *fp) = dflatj_input;
 
-    fpout = stdout;
+    ctx = (dflatj_context *)xalloc(sizeof(dflatj_context));
+    init_dflatj_context(ctx);
     while(argindex < argc) {
         if(strcmp(argv[argindex], "-o") == 0) {
             if(argindex + 1 >= argc) {
@@ -361,11 +1761,41 @@ int main(int argc, char *argv[]) {
             outfile = argv[argindex + 1];
             argindex += 2;
         } else if((argch = get_ascii_arg(argc, argv, "-F", '\\', usage, &argindex)) >= 0) {
-            separator = (char)argch;
+            ctx->separator = (char)argch;
         } else if((argch = get_ascii_arg(argc, argv, "-i", -1, usage, &argindex)) >= 0) {
-            index_prefix = (char)argch;
+            ctx->index_prefix = (char)argch;
         } else if((argch = get_ascii_optional_arg(argc, argv, "-s", usage, &argindex)) >= -1) {
-            string_suffix = argch;
+            ctx->string_suffix = argch;
+        } else if(strcmp(argv[argindex], "--binary") == 0) {
+            input_function = dflatj_binary_input;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--sort") == 0) {
+            sort = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--patch") == 0) {
+            if(argindex + 1 >= argc) {
+                usage();
+            }
+            ctx->patch_file = argv[argindex + 1];
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--mem-limit") == 0) {
+            if(argindex + 1 >= argc || (mem_limit = parse_size(argv[argindex + 1])) == 0) {
+                usage();
+            }
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--validate-utf8") == 0) {
+            ctx->validate_utf8 = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--stats") == 0) {
+            show_stats = 1;
+            argindex++;
+        } else if((depth = get_io_depth_arg(argc, argv, usage, &argindex)) >= 0) {
+            set_io_depth(depth);
+        } else if(strcmp(argv[argindex], "-j") == 0) {
+            if(argindex + 1 >= argc || (jobs = atoi(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
         } else if(argv[argindex][0] == '-') {
             usage();
         } else {
@@ -373,26 +1803,59 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if(outfile != NULL) {
-        fpout = openfile(outfile, "w");
+    init_file_pool(&pool, argv + argindex, argc - argindex);
+    if(outfile != NULL && is_directory(outfile)) {
+        pool.output_dir = outfile;
+        pool.extension = ".json";
+    }
+    if(ctx->patch_file != NULL && (sort || input_function == dflatj_binary_input || pool.count > 1 || pool.output_dir != NULL)) {
+        fprintf(stderr, "--patch takes one input of flat text\n");
+        exit(EXIT_USAGE);
+    } else if(ctx->patch_file != NULL) {
+        input_function = dflatj_patch_input;
+    } else if(sort && (input_function == dflatj_binary_input || ctx->separator == '\n')) {
+        fprintf(stderr, "--sort takes flat text of one line for each value\n");
+        exit(EXIT_USAGE);
+    } else if(sort) {
+        /* threads sort one input, or each thread sorts one of many inputs */
+        input_function = dflatj_sorted_input;
+        ctx->sort_jobs = pool.count > 1 ? 1 : jobs;
+        ctx->sorters = pool.count > 1 ? jobs : 1;
+    } else if(input_function == dflatj_input && ctx->separator != '\t') {
+        input_function = dflatj_input_separator;
     }
+    ctx->input = input_function;
+    /* threads of many inputs share the memory limit */
+    ctx->mem_limit = (size_t)(pool.count > 1 ? mem_limit / jobs : mem_limit);
+    ctx->show_stats = show_stats;
 
-    if(argindex == argc) {
-        if((errcode = setjmp(top)) == 0) {
-            dflatj_input(stdin);
+    pool.jobs = jobs;
+    pool.process = dflatj_process;
+    pool.output = outfile != NULL && pool.output_dir == NULL ? openfile(outfile, "w") : stdout;
+    pool.contexts = (void **)xalloc(jobs * sizeof(void *));
+    contexts = (dflatj_context *)xrealloc(ctx, jobs * sizeof(dflatj_context));
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            init_dflatj_worker(&contexts[i], &contexts[0]);
         }
-    } else {
-        input = openfile(argv[argindex], "r");
-        if((errcode = setjmp(top)) == 0) {
-            dflatj_input(input);
+        pool.contexts[i] = &contexts[i];
+    }
+    errcode = run_file_pool(&pool);
+
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            add_stats(&contexts[0].stats, &contexts[i].stats);
         }
-        fclose(input);
+        free_dflatj_context(&contexts[i]);
+    }
+    if(show_stats) {
+        print_stats("dflatj", &contexts[0].stats);
     }
-    fprintf(fpout, "\n");
-    if(outfile != NULL) {
-        fclose(fpout);
+    if(pool.output != stdout) {
+        fclose(pool.output);
     }
+    xfree(pool.contexts);
+    xfree(contexts);
+    free_file_pool(&pool);
     return errcode;
 }
-
-
@@ -7,105 +7,1076 @@
  * http://opensource.org/licenses/mit-license.php
  **/
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include <setjmp.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "../common.h"
+#include "../libflatjson/flatjson.h"
+
+enum stack_type {
+    STACK_KEY,
+    STACK_INDEX,
+    STACK_STRING,
+    STACK_NUMBER,
+    STACK_LITERAL,
+    STACK_EMPTY_OBJECT,
+    STACK_EMPTY_ARRAY
+};
+
+typedef struct list {
+    char *value;
+    enum stack_type type;
+    int id;
+    char index_value[24];
+    struct list *next;
+    struct list *prev;
+} stack_list;
 
-static FILE *fpout;
+enum column_type {
+    COLUMN_INT64,
+    COLUMN_DOUBLE,
+    COLUMN_MIXED
+};
 
-int parse_json(FILE *fp);
+typedef struct column {
+    int id;
+    char *path;
+    enum column_type type;
+    long count;
+    /* values and rows are buffered in memory streams and appended to N.values and N.rows by flush_column() */
+    FILE *values;
+    FILE *rows;
+    char *values_buffer;
+    size_t values_length;
+    char *rows_buffer;
+    size_t rows_length;
+    /* whether N.values and N.rows have been created */
+    int values_written;
+    int rows_written;
+} column;
+
+/* bytes of values and rows buffered in memory by all columns before they are flushed */
+#define COLUMNAR_BUFFER_SIZE (16 << 20)
+#define PROMOTE_BLOCK 1024
+
+typedef struct sample {
+    long record;
+    int name;
+    char *value;
+    struct sample *next;
+} sample_list;
+
+enum aggregate_function {
+    AGGREGATE_SUM,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_AVG
+};
 
-static jmp_buf top;
+#define AGGREGATE_FUNCTIONS 5
+
+static const char *aggregate_names[AGGREGATE_FUNCTIONS] = { "sum", "count", "min", "max", "avg" };
+
+typedef struct aggregate_spec {
+    enum aggregate_function functions[AGGREGATE_FUNCTIONS];
+    int function_count;
+    int path;
+    char *arg;
+} aggregate_spec;
+
+typedef struct aggregate {
+    long count;
+    long number_count;
+    double sum;
+    double compensation;
+    double min;
+    double max;
+} aggregate;
+
+typedef struct pending {
+    int spec;
+    int is_number;
+    double value;
+    struct pending *next;
+} pending_list;
+
+enum frame_type {
+    FRAME_OBJECT,
+    FRAME_ARRAY
+};
 
-void throw() {
-    longjmp(top, EXIT_EXCEPTION);
+typedef struct frame {
+    enum frame_type type;
+    int index;
+} parse_frame;
+
+typedef struct flatj_context {
+    FILE *fpout;
+    jmp_buf top;
+    char separator;
+    char index_prefix;
+    int suffix_char;
+    int expand_escape;
+    int validate_utf8;
+    utf8_validator utf8;
+    int show_filename;
+    int show_stats;
+    /* input file printed as the first column of each line by --filename */
+    char *filename;
+    string_buffer buffer;
+    intern_table keys;
+    void (*print_leaf)(struct flatj_context *ctx, FILE *fpout);
+    parse_frame *frames;
+    int frames_size;
+    int max_nesting;
+    stats stats;
+
+    stack_list *stack;
+    stack_list *stack_ptr;
+    stack_list *free_stack;
+    int stack_depth;
+    /* number of segments of the current path which are same as the last binary record */
+    int synced_depth;
+    int emitted_depth;
+    int defined_keys;
+
+    char *columnar_dir;
+    column **columns;
+    int columns_size;
+    int columns_count;
+    size_t columns_buffered;
+
+    char csv_delimiter;
+    char *csv_column_arg;
+    long csv_sample_size;
+    sample_list *csv_samples;
+    sample_list *csv_samples_ptr;
+    int *csv_columns;
+    int csv_columns_size;
+    int csv_columns_count;
+    char **csv_row;
+    long csv_record;
+
+    aggregate_spec *aggregate_specs;
+    int aggregate_spec_count;
+    int group_path;
+    int *group_ids;
+    int group_ids_size;
+    int *group_names;
+    aggregate **groups;
+    int group_count;
+    int groups_size;
+    pending_list *pending;
+    pending_list *free_pending;
+    int record_group;
+    long aggregate_record;
+
+    /* path template of --diff-key and the number of lines printed by --diff */
+    char *diff_key;
+    long diff_count;
+} flatj_context;
+
+void throw(flatj_context *ctx) {
+    longjmp(ctx->top, EXIT_EXCEPTION);
 }
 
-int surrogate_to_codepoint(int high, int low) {
-    int h = high - 0xD800, l = low - 0xDC00;
+char *literal_to_string(char *literal) {
+    char *result;
 
-    return (h << 10) + l + 0x10000;
+    result = (char *)xalloc(strlen(literal) + 1);
+    strcpy(result, literal);
+    return result;
 }
 
-static char index_prefix = '#';
+/*
+ * prints the current path and value as a line of flat text.
+ * print_stack is defined for the default separator as a constant and print_stack_separator for -F.
+ * init_flatj_output() chooses one of them once.
+ */
+#define DEFINE_PRINT_STACK(name, separator) \
+void name(flatj_context *ctx, FILE *fpout) { \
+    stack_list *p; \
+ \
+    if(ctx->filename != NULL) { \
+        fputs(ctx->filename, fpout); \
+        putc(separator, fpout); \
+    } \
+    for(p = ctx->stack; p != NULL; p = p->next) { \
+        if(p != ctx->stack) { \
+            putc(separator, fpout); \
+        } \
+        fputs(p->value, fpout); \
+    } \
+    if((separator) == '\n') { \
+        putc('\n', fpout); \
+    } \
+    putc('\n', fpout); \
+}
 
-char *int_to_string(int value) {
-    char buf[50];
-    char *result;
+DEFINE_PRINT_STACK(print_stack, '\t')
+DEFINE_PRINT_STACK(print_stack_separator, ctx->separator)
 
-    sprintf(buf, "%c%d", index_prefix, value);
-    result = (char *)xalloc(strlen(buf) + 1);
-    strcpy(result, buf);
-    return result;
+void print_binary_string(FILE *fpout, int tag, char *value) {
+    size_t length = strlen(value);
+
+    putc(tag, fpout);
+    write_varint(fpout, length);
+    fwrite(value, 1, length, fpout);
 }
 
-char *literal_to_string(char *literal) {
-    char *result;
+void print_binary_leaf(flatj_context *ctx, FILE *fpout, stack_list *p) {
+    switch(p->type) {
+    case STACK_STRING:
+        print_binary_string(fpout, BINARY_STRING, p->value);
+        break;
+    case STACK_NUMBER:
+        print_binary_string(fpout, BINARY_NUMBER, p->value);
+        break;
+    case STACK_LITERAL:
+        putc(p->value[0] == 'n' ? BINARY_NULL : p->value[0] == 't' ? BINARY_TRUE : BINARY_FALSE, fpout);
+        break;
+    case STACK_EMPTY_OBJECT:
+        putc(BINARY_EMPTY_OBJECT, fpout);
+        break;
+    case STACK_EMPTY_ARRAY:
+        putc(BINARY_EMPTY_ARRAY, fpout);
+        break;
+    default:
+        fprintf(stderr, "internal error\n");
+        throw(ctx);
+        break;
+    }
+}
 
-    result = (char *)xalloc(strlen(literal) + 1);
-    strcpy(result, literal);
+void print_binary(flatj_context *ctx, FILE *fpout) {
+    stack_list *p = ctx->stack;
+    int path_depth = ctx->stack_depth - 1, common, i;
+
+    common = ctx->synced_depth < path_depth ? ctx->synced_depth : path_depth;
+    write_varint(fpout, ctx->emitted_depth - common);
+    write_varint(fpout, path_depth - common);
+    for(i = 0; i < path_depth; i++, p = p->next) {
+        if(i < common) {
+            continue;
+        } else if(p->type == STACK_INDEX) {
+            putc(BINARY_INDEX, fpout);
+            write_varint(fpout, p->id);
+        } else if(p->id >= 0 && p->id < ctx->defined_keys) {
+            putc(BINARY_KEY_ID, fpout);
+            write_varint(fpout, p->id);
+        } else {
+            print_binary_string(fpout, BINARY_KEY, p->value);
+            ctx->defined_keys += p->id >= 0;
+        }
+    }
+
+    print_binary_leaf(ctx, fpout, p);
+    ctx->synced_depth = ctx->emitted_depth = path_depth;
+}
+
+/* appends a key to a path template or a CSV column name. '.' in the key is escaped by '\\' not to be taken for nested keys. */
+void append_path_key(flatj_context *ctx, char *key) {
+    for(; *key != '\0'; key++) {
+        if(*key == '.') {
+            append_buffer(&ctx->buffer, '\\');
+        }
+        append_buffer(&ctx->buffer, *key);
+    }
+}
+
+/*
+ * path template of the current value.
+ * array indices are collapsed to index-prefix and segments are joined by '.'.
+ */
+void build_template(flatj_context *ctx) {
+    stack_list *p;
+
+    init_buffer(&ctx->buffer);
+    for(p = ctx->stack; p != ctx->stack_ptr; p = p->next) {
+        if(p != ctx->stack) {
+            append_buffer(&ctx->buffer, '.');
+        }
+        if(p->type == STACK_INDEX) {
+            append_buffer(&ctx->buffer, ctx->index_prefix);
+        } else {
+            append_path_key(ctx, p->value);
+        }
+    }
+}
+
+char *column_filename(flatj_context *ctx, int id, char *extension) {
+    char *filename = (char *)xalloc(strlen(ctx->columnar_dir) + 50);
+
+    sprintf(filename, "%s/%d.%s", ctx->columnar_dir, id, extension);
+    return filename;
+}
+
+/* opens the memory streams of a column. No file descriptor is held until the column is flushed. */
+void open_column_buffers(flatj_context *ctx, column *col) {
+    if((col->values = open_memstream(&col->values_buffer, &col->values_length)) == NULL) {
+        fprintf(stderr, "cannot buffer column %s\n", col->path);
+        throw(ctx);
+    }
+    if((col->rows = open_memstream(&col->rows_buffer, &col->rows_length)) == NULL) {
+        fclose(col->values);
+        free(col->values_buffer);
+        col->values = NULL;
+        fprintf(stderr, "cannot buffer column %s\n", col->path);
+        throw(ctx);
+    }
+    __fsetlocking(col->values, FSETLOCKING_BYCALLER);
+    __fsetlocking(col->rows, FSETLOCKING_BYCALLER);
+}
+
+void close_column_buffers(column *col) {
+    fclose(col->values);
+    fclose(col->rows);
+    free(col->values_buffer);
+    free(col->rows_buffer);
+    col->values = col->rows = NULL;
+    col->values_buffer = col->rows_buffer = NULL;
+}
+
+void append_column_file(flatj_context *ctx, int id, char *extension, char *buffer, size_t length, int *written) {
+    char *filename = column_filename(ctx, id, extension);
+    FILE *fp = openfile(filename, *written ? "ab" : "wb");
+
+    if(fwrite(buffer, 1, length, fp) != length || fclose(fp) != 0) {
+        fprintf(stderr, "cannot write %s\n", filename);
+        xfree(filename);
+        throw(ctx);
+    }
+    *written = 1;
+    xfree(filename);
+}
+
+/* appends the buffered values and rows of a column to its files, which are closed again */
+void flush_column(flatj_context *ctx, column *col) {
+    if(col->values == NULL) {
+        return;
+    }
+    fflush(col->values);
+    fflush(col->rows);
+    append_column_file(ctx, col->id, "values", col->values_buffer, col->values_length, &col->values_written);
+    append_column_file(ctx, col->id, "rows", col->rows_buffer, col->rows_length, &col->rows_written);
+    close_column_buffers(col);
+}
+
+void flush_columns(flatj_context *ctx) {
+    int i;
+
+    for(i = 0; i < ctx->columns_size; i++) {
+        if(ctx->columns[i] != NULL) {
+            flush_column(ctx, ctx->columns[i]);
+        }
+    }
+    ctx->columns_buffered = 0;
+}
+
+column *get_column(flatj_context *ctx, enum column_type type) {
+    column *result;
+    int key, size;
+
+    build_template(ctx);
+    if((key = intern_buffer(&ctx->keys, &ctx->buffer)) >= ctx->columns_size) {
+        size = ctx->columns_size;
+        ctx->columns_size = key * 2 + 16;
+        ctx->columns = (column **)xrealloc(ctx->columns, ctx->columns_size * sizeof(column *));
+        memset(ctx->columns + size, 0, (ctx->columns_size - size) * sizeof(column *));
+    }
+    if((result = ctx->columns[key]) == NULL) {
+        result = ctx->columns[key] = (column *)xalloc(sizeof(column));
+        memset(result, 0, sizeof(column));
+        result->id = ctx->columns_count++;
+        result->path = interned_string(&ctx->keys, key);
+        result->type = type;
+    }
+    if(result->values == NULL) {
+        open_column_buffers(ctx, result);
+    }
     return result;
 }
 
-typedef struct list {
+/* converts the int64 values of a column to doubles in its file */
+void promote_double_column(flatj_context *ctx, column *col) {
+    long long int64_values[PROMOTE_BLOCK];
+    double double_values[PROMOTE_BLOCK];
+    char *filename;
+    FILE *fp;
+    long i, n, j;
+
+    flush_column(ctx, col);
+    filename = column_filename(ctx, col->id, "values");
+    fp = openfile(filename, "r+b");
+    xfree(filename);
+    for(i = 0; i < col->count; i += n) {
+        n = col->count - i < PROMOTE_BLOCK ? col->count - i : PROMOTE_BLOCK;
+        fseek(fp, i * sizeof(long long), SEEK_SET);
+        if(fread(int64_values, sizeof(long long), n, fp) != (size_t)n) {
+            fclose(fp);
+            fprintf(stderr, "cannot read column %s\n", col->path);
+            throw(ctx);
+        }
+        for(j = 0; j < n; j++) {
+            double_values[j] = (double)int64_values[j];
+        }
+        fseek(fp, i * sizeof(double), SEEK_SET);
+        fwrite(double_values, sizeof(double), n, fp);
+    }
+    fclose(fp);
+    open_column_buffers(ctx, col);
+    col->type = COLUMN_DOUBLE;
+}
+
+/* prints the shortest of %.15g to %.17g which reads back as the same double */
+void format_double(char *buffer, double value) {
+    int precision;
+
+    for(precision = 15; precision < 17; precision++) {
+        sprintf(buffer, "%.*g", precision, value);
+        if(strtod(buffer, NULL) == value) {
+            return;
+        }
+    }
+    sprintf(buffer, "%.17g", value);
+}
+
+/*
+ * rewrites the int64 or double values of a column as leaves of binary flat format when a value of another type comes.
+ * NaN of a double column is null. The rows are not changed.
+ */
+void demote_mixed_column(flatj_context *ctx, column *col) {
+    long long int64_values[PROMOTE_BLOCK];
+    double double_values[PROMOTE_BLOCK];
+    char number[32], *filename;
+    FILE *fp;
+    long i, n, j;
+
+    flush_column(ctx, col);
+    filename = column_filename(ctx, col->id, "values");
+    fp = openfile(filename, "rb");
+    xfree(filename);
+    open_column_buffers(ctx, col);
+    for(i = 0; i < col->count; i += n) {
+        n = col->count - i < PROMOTE_BLOCK ? col->count - i : PROMOTE_BLOCK;
+        if(fread(col->type == COLUMN_INT64 ? (void *)int64_values : (void *)double_values, sizeof(long long), n, fp) != (size_t)n) {
+            fclose(fp);
+            fprintf(stderr, "cannot read column %s\n", col->path);
+            throw(ctx);
+        }
+        for(j = 0; j < n; j++) {
+            if(col->type == COLUMN_INT64) {
+                sprintf(number, "%lld", int64_values[j]);
+            } else if(isnan(double_values[j])) {
+                putc(BINARY_NULL, col->values);
+                continue;
+            } else {
+                format_double(number, double_values[j]);
+            }
+            print_binary_string(col->values, BINARY_NUMBER, number);
+        }
+    }
+    fclose(fp);
+    ctx->columns_buffered += col->count * sizeof(long long);
+    col->values_written = 0;
+    col->type = COLUMN_MIXED;
+}
+
+int is_int64(char *value, long long *result) {
+    char *end;
+
+    if(strpbrk(value, ".eE") != NULL) {
+        return 0;
+    }
+    errno = 0;
+    *result = strtoll(value, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+void print_columnar(flatj_context *ctx, FILE *fpout) {
+    stack_list *leaf = ctx->stack_ptr;
+    column *col;
+    long long row = ctx->stack != leaf && ctx->stack->type == STACK_INDEX ? ctx->stack->id : 0, int64_value;
+    double double_value;
+    int is_integer = leaf->type == STACK_NUMBER && is_int64(leaf->value, &int64_value);
+
+    (void)fpout;
+    col = get_column(ctx, is_integer ? COLUMN_INT64 : leaf->type == STACK_NUMBER ? COLUMN_DOUBLE : COLUMN_MIXED);
+    if(col->type != COLUMN_MIXED && leaf->type != STACK_NUMBER && (leaf->type != STACK_LITERAL || leaf->value[0] != 'n')) {
+        demote_mixed_column(ctx, col);
+    } else if(col->type == COLUMN_INT64 && !is_integer) {
+        promote_double_column(ctx, col);
+    }
+
+    if(col->type == COLUMN_INT64 && is_integer) {
+        fwrite(&int64_value, sizeof(long long), 1, col->values);
+    } else if(col->type == COLUMN_DOUBLE && leaf->type == STACK_NUMBER) {
+        double_value = strtod(leaf->value, NULL);
+        fwrite(&double_value, sizeof(double), 1, col->values);
+    } else if(col->type == COLUMN_DOUBLE && leaf->type == STACK_LITERAL && leaf->value[0] == 'n') {
+        double_value = NAN;
+        fwrite(&double_value, sizeof(double), 1, col->values);
+    } else {
+        print_binary_leaf(ctx, col->values, leaf);
+    }
+    fwrite(&row, sizeof(long long), 1, col->rows);
+    col->count++;
+    /* strings and numbers of mixed columns are counted roughly by their length in JSON */
+    ctx->columns_buffered += 2 * sizeof(long long) + (col->type == COLUMN_MIXED && leaf->value != NULL ? strlen(leaf->value) : 0);
+    if(ctx->columns_buffered >= COLUMNAR_BUFFER_SIZE) {
+        flush_columns(ctx);
+    }
+}
+
+void finish_columnar(flatj_context *ctx) {
+    static const char *type_names[] = { "int64", "double", "mixed" };
+    char *filename = (char *)xalloc(strlen(ctx->columnar_dir) + 20);
+    column **sorted = (column **)xalloc((ctx->columns_count + 1) * sizeof(column *));
+    FILE *fp;
+    int i;
+
+    flush_columns(ctx);
+    for(i = 0; i < ctx->columns_size; i++) {
+        if(ctx->columns[i] != NULL) {
+            sorted[ctx->columns[i]->id] = ctx->columns[i];
+        }
+    }
+    sprintf(filename, "%s/columns", ctx->columnar_dir);
+    fp = openfile(filename, "w");
+    for(i = 0; i < ctx->columns_count; i++) {
+        fprintf(fp, "%d%c%s%c%ld%c%s\n", i, ctx->separator, type_names[sorted[i]->type], ctx->separator, sorted[i]->count, ctx->separator, sorted[i]->path);
+    }
+    fclose(fp);
+    xfree(sorted);
+    xfree(filename);
+}
+
+/* frees the columns of the last file. Their values may be still buffered if the file had an error. */
+void reset_columnar(flatj_context *ctx) {
+    int i;
+
+    for(i = 0; i < ctx->columns_size; i++) {
+        if(ctx->columns[i] != NULL) {
+            if(ctx->columns[i]->values != NULL) {
+                close_column_buffers(ctx->columns[i]);
+            }
+            xfree(ctx->columns[i]);
+            ctx->columns[i] = NULL;
+        }
+    }
+    ctx->columns_count = 0;
+    ctx->columns_buffered = 0;
+}
+
+void print_csv_field(flatj_context *ctx, FILE *fpout, char *value) {
+    char *p;
+
+    if(strchr(value, ctx->csv_delimiter) == NULL && strpbrk(value, "\"\r\n") == NULL) {
+        fputs(value, fpout);
+        return;
+    }
+    putc('\"', fpout);
+    for(p = value; *p != '\0'; p++) {
+        if(*p == '\"') {
+            putc('\"', fpout);
+        }
+        putc(*p, fpout);
+    }
+    putc('\"', fpout);
+}
+
+void flush_csv_row(flatj_context *ctx, FILE *fpout) {
+    int i;
+
+    if(ctx->csv_record < 0) {
+        return;
+    }
+    for(i = 0; i < ctx->csv_columns_count; i++) {
+        if(i > 0) {
+            putc(ctx->csv_delimiter, fpout);
+        }
+        if(ctx->csv_row[i] != NULL) {
+            print_csv_field(ctx, fpout, ctx->csv_row[i]);
+            xfree(ctx->csv_row[i]);
+            ctx->csv_row[i] = NULL;
+        }
+    }
+    putc('\n', fpout);
+}
+
+void add_csv_column(flatj_context *ctx, int name) {
+    int size = ctx->csv_columns_size;
+
+    if(name >= ctx->csv_columns_size) {
+        ctx->csv_columns_size = name * 2 + 16;
+        ctx->csv_columns = (int *)xrealloc(ctx->csv_columns, ctx->csv_columns_size * sizeof(int));
+        for(; size < ctx->csv_columns_size; size++) {
+            ctx->csv_columns[size] = -1;
+        }
+    }
+    if(ctx->csv_columns[name] < 0) {
+        ctx->csv_columns[name] = ctx->csv_columns_count++;
+    }
+}
+
+void store_csv_value(flatj_context *ctx, FILE *fpout, long record, int name, char *value) {
+    int index = name < ctx->csv_columns_size ? ctx->csv_columns[name] : -1;
+
+    if(record != ctx->csv_record) {
+        flush_csv_row(ctx, fpout);
+        ctx->csv_record = record;
+    }
+    if(index < 0) {
+        xfree(value);
+    } else {
+        xfree(ctx->csv_row[index]);
+        ctx->csv_row[index] = value;
+    }
+}
+
+void print_csv_header(flatj_context *ctx, FILE *fpout) {
+    sample_list *p, *tmp;
+    int i, name, *names;
+
+    if(ctx->csv_row != NULL) {
+        return;
+    }
+    for(p = ctx->csv_samples; p != NULL; p = p->next) {
+        add_csv_column(ctx, p->name);
+    }
+    ctx->csv_row = (char **)xalloc((ctx->csv_columns_count + 1) * sizeof(char *));
+    for(i = 0; i < ctx->csv_columns_count; i++) {
+        ctx->csv_row[i] = NULL;
+    }
+    names = (int *)xalloc((ctx->csv_columns_count + 1) * sizeof(int));
+    for(name = 0; name < ctx->csv_columns_size; name++) {
+        if(ctx->csv_columns[name] >= 0) {
+            names[ctx->csv_columns[name]] = name;
+        }
+    }
+    for(i = 0; i < ctx->csv_columns_count; i++) {
+        if(i > 0) {
+            putc(ctx->csv_delimiter, fpout);
+        }
+        print_csv_field(ctx, fpout, interned_string(&ctx->keys, names[i]));
+    }
+    if(ctx->csv_columns_count > 0) {
+        putc('\n', fpout);
+    }
+    xfree(names);
+
+    for(p = ctx->csv_samples; p != NULL;) {
+        store_csv_value(ctx, fpout, p->record, p->name, p->value);
+        tmp = p;
+        p = p->next;
+        xfree(tmp);
+    }
+    ctx->csv_samples = NULL;
+}
+
+void print_csv(flatj_context *ctx, FILE *fpout) {
+    stack_list *p, *leaf = ctx->stack_ptr;
+    sample_list *element;
     char *value;
-    struct list *next;
-    struct list *prev;
-} stack_list;
+    int name;
+
+    if(ctx->stack == leaf ? leaf->type != STACK_EMPTY_ARRAY : ctx->stack->type != STACK_INDEX) {
+        fprintf(stderr, "top-level array needed\n");
+        throw(ctx);
+    } else if(leaf->type == STACK_EMPTY_ARRAY || leaf->type == STACK_EMPTY_OBJECT) {
+        /* an empty top-level array has no rows, and empty objects and arrays are no fields */
+        return;
+    }
+    init_buffer(&ctx->buffer);
+    for(p = ctx->stack->next; p != leaf; p = p->next) {
+        if(p != ctx->stack->next) {
+            append_buffer(&ctx->buffer, '.');
+        }
+        append_path_key(ctx, p->value);
+    }
+    name = intern_buffer(&ctx->keys, &ctx->buffer);
+
+    if(ctx->csv_row == NULL && ctx->stack->id >= ctx->csv_sample_size) {
+        print_csv_header(ctx, fpout);
+    }
+    /* null is an empty field. other values are owned by the row from now on. */
+    if(leaf->type == STACK_LITERAL && leaf->value[0] == 'n') {
+        value = literal_to_string("");
+    } else {
+        value = leaf->value;
+        leaf->value = NULL;
+    }
+    if(ctx->csv_row == NULL) {
+        element = (sample_list *)xalloc(sizeof(sample_list));
+        element->record = ctx->stack->id;
+        element->name = name;
+        element->value = value;
+        element->next = NULL;
+        if(ctx->csv_samples == NULL) {
+            ctx->csv_samples = ctx->csv_samples_ptr = element;
+        } else {
+            ctx->csv_samples_ptr = ctx->csv_samples_ptr->next = element;
+        }
+    } else {
+        store_csv_value(ctx, fpout, ctx->stack->id, name, value);
+    }
+}
 
-static stack_list *stack = NULL;
-static stack_list *stack_ptr;
-static char separator = '\t';
+void init_csv(flatj_context *ctx, char *column_arg) {
+    char *start, *end;
 
-void print_stack(FILE *fpout) {
-    stack_list *p;
+    if(column_arg == NULL) {
+        return;
+    }
+    for(start = column_arg; ; start = end + 1) {
+        if((end = strchr(start, ',')) == NULL) {
+            end = start + strlen(start);
+        }
+        add_csv_column(ctx, intern(&ctx->keys, start, end - start));
+        if(*end == '\0') {
+            break;
+        }
+    }
+    print_csv_header(ctx, ctx->fpout);
+}
+
+void finish_csv(flatj_context *ctx) {
+    print_csv_header(ctx, ctx->fpout);
+    flush_csv_row(ctx, ctx->fpout);
+}
+
+/* forgets the columns, samples and the row of the last file, so the next file starts with its own header */
+void reset_csv(flatj_context *ctx) {
+    sample_list *p;
+    int i;
+
+    for(; ctx->csv_samples != NULL; ctx->csv_samples = p) {
+        p = ctx->csv_samples->next;
+        xfree(ctx->csv_samples->value);
+        xfree(ctx->csv_samples);
+    }
+    ctx->csv_samples_ptr = NULL;
+    if(ctx->csv_row != NULL) {
+        for(i = 0; i < ctx->csv_columns_count; i++) {
+            xfree(ctx->csv_row[i]);
+        }
+        xfree(ctx->csv_row);
+        ctx->csv_row = NULL;
+    }
+    for(i = 0; i < ctx->csv_columns_size; i++) {
+        ctx->csv_columns[i] = -1;
+    }
+    ctx->csv_columns_count = 0;
+    ctx->csv_record = -1;
+}
+
+void add_aggregate_spec(flatj_context *ctx, char *arg, void (*usage)()) {
+    aggregate_spec *spec;
+    char *colon = strchr(arg, ':'), *start, *end;
+    int i;
+
+    if(colon == NULL) {
+        usage();
+    } else if(strncmp(arg, "group-by:", colon - arg + 1) == 0) {
+        ctx->group_path = intern(&ctx->keys, colon + 1, strlen(colon + 1));
+        return;
+    }
+    ctx->aggregate_specs = (aggregate_spec *)xrealloc(ctx->aggregate_specs, (ctx->aggregate_spec_count + 1) * sizeof(aggregate_spec));
+    spec = &ctx->aggregate_specs[ctx->aggregate_spec_count++];
+    spec->function_count = 0;
+    spec->path = intern(&ctx->keys, colon + 1, strlen(colon + 1));
+    spec->arg = colon + 1;
+    for(start = arg; start < colon; start = end + 1) {
+        if((end = strchr(start, ',')) == NULL || end > colon) {
+            end = colon;
+        }
+        for(i = 0; i < AGGREGATE_FUNCTIONS; i++) {
+            if(strlen(aggregate_names[i]) == (size_t)(end - start) && strncmp(aggregate_names[i], start, end - start) == 0) {
+                break;
+            }
+        }
+        if(i == AGGREGATE_FUNCTIONS || spec->function_count >= AGGREGATE_FUNCTIONS) {
+            usage();
+        }
+        spec->functions[spec->function_count++] = (enum aggregate_function)i;
+    }
+}
+
+int get_group(flatj_context *ctx, int name) {
+    int size = ctx->group_ids_size, i;
 
-    for(p = stack; p != NULL; p = p->next) {
-        if(p != stack) {
-            fprintf(fpout, "%c", separator);
+    if(name >= ctx->group_ids_size) {
+        ctx->group_ids_size = name * 2 + 16;
+        ctx->group_ids = (int *)xrealloc(ctx->group_ids, ctx->group_ids_size * sizeof(int));
+        for(; size < ctx->group_ids_size; size++) {
+            ctx->group_ids[size] = -1;
+        }
+    }
+    if(ctx->group_ids[name] < 0) {
+        if(ctx->group_count >= ctx->groups_size) {
+            ctx->groups_size = ctx->groups_size * 2 + 16;
+            ctx->groups = (aggregate **)xrealloc(ctx->groups, ctx->groups_size * sizeof(aggregate *));
+            ctx->group_names = (int *)xrealloc(ctx->group_names, ctx->groups_size * sizeof(int));
+        }
+        ctx->groups[ctx->group_count] = (aggregate *)xalloc(ctx->aggregate_spec_count * sizeof(aggregate));
+        for(i = 0; i < ctx->aggregate_spec_count; i++) {
+            memset(&ctx->groups[ctx->group_count][i], 0, sizeof(aggregate));
+        }
+        ctx->group_names[ctx->group_count] = name;
+        ctx->group_ids[name] = ctx->group_count++;
+    }
+    return ctx->group_ids[name];
+}
+
+void accumulate(flatj_context *ctx, int group, int spec, int is_number, double value) {
+    aggregate *agg = &ctx->groups[group][spec];
+    double sum;
+
+    agg->count++;
+    if(!is_number) {
+        return;
+    }
+    if(agg->number_count++ == 0) {
+        agg->min = agg->max = value;
+    } else if(value < agg->min) {
+        agg->min = value;
+    } else if(value > agg->max) {
+        agg->max = value;
+    }
+
+    /* Neumaier summation */
+    sum = agg->sum + value;
+    if(fabs(agg->sum) >= fabs(value)) {
+        agg->compensation += (agg->sum - sum) + value;
+    } else {
+        agg->compensation += (value - sum) + agg->sum;
+    }
+    agg->sum = sum;
+}
+
+void flush_aggregate_record(flatj_context *ctx) {
+    pending_list *p, *tmp;
+    int group;
+
+    if(ctx->pending == NULL) {
+        ctx->record_group = -1;
+        return;
+    }
+    group = ctx->record_group >= 0 ? ctx->record_group : get_group(ctx, intern(&ctx->keys, "", 0));
+    for(p = ctx->pending; p != NULL;) {
+        accumulate(ctx, group, p->spec, p->is_number, p->value);
+        tmp = p;
+        p = p->next;
+        tmp->next = ctx->free_pending;
+        ctx->free_pending = tmp;
+    }
+    ctx->pending = NULL;
+    ctx->record_group = -1;
+}
+
+void print_aggregate(flatj_context *ctx, FILE *fpout) {
+    stack_list *leaf = ctx->stack_ptr;
+    pending_list *element;
+    long record = ctx->stack != leaf && ctx->stack->type == STACK_INDEX ? ctx->stack->id : 0;
+    int path, i, is_number = leaf->type == STACK_NUMBER;
+    double value = is_number ? strtod(leaf->value, NULL) : 0;
+
+    (void)fpout;
+    build_template(ctx);
+    path = intern_buffer(&ctx->keys, &ctx->buffer);
+    if(ctx->group_path < 0) {
+        for(i = 0; i < ctx->aggregate_spec_count; i++) {
+            if(ctx->aggregate_specs[i].path == path) {
+                accumulate(ctx, get_group(ctx, intern(&ctx->keys, "", 0)), i, is_number, value);
+            }
+        }
+        return;
+    }
+
+    if(record != ctx->aggregate_record) {
+        flush_aggregate_record(ctx);
+        ctx->aggregate_record = record;
+    }
+    if(path == ctx->group_path && ctx->record_group < 0) {
+        ctx->record_group = get_group(ctx, intern(&ctx->keys, leaf->value, strlen(leaf->value)));
+    }
+    for(i = 0; i < ctx->aggregate_spec_count; i++) {
+        if(ctx->aggregate_specs[i].path == path) {
+            if(ctx->free_pending != NULL) {
+                element = ctx->free_pending;
+                ctx->free_pending = ctx->free_pending->next;
+            } else {
+                element = (pending_list *)xalloc(sizeof(pending_list));
+            }
+            element->spec = i;
+            element->is_number = is_number;
+            element->value = value;
+            element->next = ctx->pending;
+            ctx->pending = element;
+        }
+    }
+}
+
+void finish_aggregate(flatj_context *ctx) {
+    aggregate *agg;
+    int group, i, j;
+
+    flush_aggregate_record(ctx);
+    for(group = 0; group < ctx->group_count; group++) {
+        for(i = 0; i < ctx->aggregate_spec_count; i++) {
+            agg = &ctx->groups[group][i];
+            for(j = 0; j < ctx->aggregate_specs[i].function_count; j++) {
+                if(ctx->group_path >= 0) {
+                    fprintf(ctx->fpout, "%s%c", interned_string(&ctx->keys, ctx->group_names[group]), ctx->separator);
+                }
+                fprintf(ctx->fpout, "%s:%s%c", aggregate_names[ctx->aggregate_specs[i].functions[j]], ctx->aggregate_specs[i].arg, ctx->separator);
+                switch(ctx->aggregate_specs[i].functions[j]) {
+                case AGGREGATE_SUM:
+                    fprintf(ctx->fpout, "%.15g\n", agg->sum + agg->compensation);
+                    break;
+                case AGGREGATE_COUNT:
+                    fprintf(ctx->fpout, "%ld\n", agg->count);
+                    break;
+                case AGGREGATE_MIN:
+                case AGGREGATE_MAX:
+                    if(agg->number_count == 0) {
+                        fprintf(ctx->fpout, "null\n");
+                    } else {
+                        fprintf(ctx->fpout, "%.15g\n", ctx->aggregate_specs[i].functions[j] == AGGREGATE_MIN ? agg->min : agg->max);
+                    }
+                    break;
+                case AGGREGATE_AVG:
+                    if(agg->number_count == 0) {
+                        fprintf(ctx->fpout, "null\n");
+                    } else {
+                        fprintf(ctx->fpout, "%.15g\n", (agg->sum + agg->compensation) / agg->number_count);
+                    }
+                    break;
+                }
+            }
         }
-        fprintf(fpout, "%s", p->value);
     }
-    if(separator == '\n') {
-        fprintf(fpout, "\n");
+}
+
+/* drops the groups and the pending values of the last file, so totals are not carried over to the next file */
+void reset_aggregate(flatj_context *ctx) {
+    pending_list *p;
+    int i;
+
+    while((p = ctx->pending) != NULL) {
+        ctx->pending = p->next;
+        p->next = ctx->free_pending;
+        ctx->free_pending = p;
+    }
+    for(i = 0; i < ctx->group_count; i++) {
+        xfree(ctx->groups[i]);
     }
-    fprintf(fpout, "\n");
+    ctx->group_count = 0;
+    for(i = 0; i < ctx->group_ids_size; i++) {
+        ctx->group_ids[i] = -1;
+    }
+    ctx->record_group = -1;
+    ctx->aggregate_record = -1;
 }
 
-void push_stack(char *str) {
-    stack_list *element = xalloc(sizeof(stack_list));
+void push_stack(flatj_context *ctx, char *str, enum stack_type type) {
+    stack_list *element;
 
+    if(ctx->free_stack != NULL) {
+        element = ctx->free_stack;
+        ctx->free_stack = ctx->free_stack->next;
+    } else {
+        element = xalloc(sizeof(stack_list));
+    }
     element->value = str;
+    element->type = type;
     element->next = NULL;
-    if(stack == NULL) {
+    ctx->stack_depth++;
+    if(ctx->stack == NULL) {
         element->prev = NULL;
-        stack = stack_ptr = element;
+        ctx->stack = ctx->stack_ptr = element;
+    } else {
+        ctx->stack_ptr->next = element;
+        element->prev = ctx->stack_ptr;
+        ctx->stack_ptr = element;
+    }
+}
+
+/* formats index-prefix and index into buf without sprintf. */
+void format_index(char *buf, char prefix, int index) {
+    char digits[12], *ptr = digits;
+
+    *buf++ = prefix;
+    do {
+        *ptr++ = (char)('0' + index % 10);
+        index /= 10;
+    } while(index > 0);
+    while(ptr > digits) {
+        *buf++ = *--ptr;
+    }
+    *buf = '\0';
+}
+
+void push_index(flatj_context *ctx, int index) {
+    push_stack(ctx, NULL, STACK_INDEX);
+    format_index(ctx->stack_ptr->index_value, ctx->index_prefix, index);
+    ctx->stack_ptr->value = ctx->stack_ptr->index_value;
+    ctx->stack_ptr->id = index;
+}
+
+/*
+ * pushes the key in the buffer. Keys are interned until the table has BINARY_MAX_KEYS keys
+ * and a new key after that is copied with id -1, which --binary writes inline.
+ */
+void push_key(flatj_context *ctx) {
+    int length = ctx->buffer.ptr - ctx->buffer.value, id;
+
+    if(interned_count(&ctx->keys) < BINARY_MAX_KEYS) {
+        id = intern(&ctx->keys, ctx->buffer.value, length);
     } else {
-        stack_ptr->next = element;
-        element->prev = stack_ptr;
-        stack_ptr = element;
+        id = find_interned(&ctx->keys, ctx->buffer.value, length);
     }
+    push_stack(ctx, id >= 0 ? interned_string(&ctx->keys, id) : to_string_buffer(&ctx->buffer), STACK_KEY);
+    ctx->stack_ptr->id = id;
 }
 
-void pop_stack() {
-    stack_list *ptr = stack_ptr;
+void pop_stack(flatj_context *ctx) {
+    stack_list *ptr = ctx->stack_ptr;
 
     if(ptr == NULL) {
         fprintf(stderr, "stack empty\n");
-        throw();
+        throw(ctx);
     }
-    stack_ptr = stack_ptr->prev;
-    if(stack_ptr == NULL) {
-        stack = NULL;
+    ctx->stack_ptr = ctx->stack_ptr->prev;
+    if(--ctx->stack_depth < ctx->synced_depth) {
+        ctx->synced_depth = ctx->stack_depth;
+    }
+    if(ctx->stack_ptr == NULL) {
+        ctx->stack = NULL;
     } else {
-        stack_ptr->next = NULL;
-        free(ptr->value);
-        ptr->value = NULL;
+        ctx->stack_ptr->next = NULL;
+    }
+    if((ptr->type != STACK_KEY || ptr->id < 0) && ptr->type != STACK_INDEX) {
+        xfree(ptr->value);
     }
-    free(ptr);
+    ptr->value = NULL;
+    ptr->next = ctx->free_stack;
+    ctx->free_stack = ptr;
+}
+
+void print_value(flatj_context *ctx, char *value, enum stack_type type) {
+    push_stack(ctx, value, type);
+    stats_enter(&ctx->stats, STATS_OUTPUT);
+    ctx->print_leaf(ctx, ctx->fpout);
+    stats_leave(&ctx->stats, STATS_OUTPUT);
+    ctx->stats.lines++;
+    pop_stack(ctx);
 }
 
 int nextchar(FILE *fp) {
@@ -122,26 +1093,88 @@ int nextcharline(FILE *fp) {
     return ch;
 }
 
-static int suffix_char = -1;
-static int expand_escape = 0;
+int string_char(flatj_context *ctx, FILE *fp) {
+    int ch;
+
+    if((ch = getc(fp)) == EOF) {
+        fprintf(stderr, "unexpected EOF\n");
+        throw(ctx);
+    }
+    return ch;
+}
+
+/* reads the 4 hex digits of \uXXXX by one fread(). The escape is kept in the buffer as it is unless -E. */
+void read_unicode_escape(flatj_context *ctx, FILE *fp, char *hex) {
+    int i;
+
+    if(fread(hex, 1, 4, fp) != 4) {
+        fprintf(stderr, "unexpected EOF\n");
+        throw(ctx);
+    }
+    if(!ctx->expand_escape) {
+        append_buffer(&ctx->buffer, '\\');
+        append_buffer(&ctx->buffer, 'u');
+        for(i = 0; i < 4; i++) {
+            append_buffer(&ctx->buffer, hex[i]);
+        }
+    }
+}
+
+/*
+ * scans \uXXXX after '\\' and 'u', or the whole surrogate pair \uXXXX\uXXXX, and expands it to UTF-8 if -E.
+ * The escape is decoded by decode_unicode_escape() of common.c, which libflatjson uses too.
+ */
+void scan_unicode_escape(flatj_context *ctx, FILE *fp) {
+    char hex[4];
+    int codepoint;
+
+    read_unicode_escape(ctx, fp, hex);
+    if(is_high_surrogate(codepoint = decode_unicode_escape(hex))) {
+        if(string_char(ctx, fp) != '\\' || string_char(ctx, fp) != 'u') {
+            codepoint = ESCAPE_SURROGATE;
+        } else {
+            read_unicode_escape(ctx, fp, hex);
+            codepoint = decode_surrogate_pair(codepoint, hex);
+        }
+    }
+    if(codepoint < 0) {
+        fprintf(stderr, "%s\n", escape_error(codepoint));
+        throw(ctx);
+    }
+    if(ctx->expand_escape && !append_codepoint_buffer(&ctx->buffer, codepoint)) {
+        fprintf(stderr, "invalid codepoint\n");
+        throw(ctx);
+    }
+}
+
+/* validates the rest of the bytes appended from run, before '"' or an escape sequence, which break a UTF-8 sequence. */
+void check_utf8_run(flatj_context *ctx, int run) {
+    if(ctx->validate_utf8) {
+        feed_utf8(&ctx->utf8, ctx->buffer.value + run, ctx->buffer.ptr - ctx->buffer.value - run);
+        if(!end_utf8(&ctx->utf8)) {
+            fprintf(stderr, "invalid UTF-8\n");
+            throw(ctx);
+        }
+    }
+}
+
 enum state_parse_string {
     PARSE_STRING_INIT,
     PARSE_STRING_STRING,
-    PARSE_STRING_BACKSLASH,
-    PARSE_STRING_CODEPOINT
+    PARSE_STRING_BACKSLASH
 };
 
-char *parse_string(FILE *fp, int suffix) {
+int scan_string(flatj_context *ctx, FILE *fp, int suffix) {
     enum state_parse_string state = PARSE_STRING_INIT;
-    int ch, codepoint, codepoint_count, surrogate = 0;
+    int ch, run = 0;
 
     ch = nextchar(fp);
     ungetc(ch, fp);
-    init_buffer();
+    init_buffer(&ctx->buffer);
     while(1) {
         if((ch = getc(fp)) == EOF) {
             fprintf(stderr, "unexpected EOF\n");
-            throw();
+            throw(ctx);
         }
 
         switch(state) {
@@ -150,109 +1183,56 @@ char *parse_string(FILE *fp, int suffix) {
                 state = PARSE_STRING_STRING;
             } else {
                 ungetc(ch, fp);
-                return NULL;
+                return 0;
             }
             break;
 
         case PARSE_STRING_STRING:
-            if(ch != '\\' && surrogate) {
-                fprintf(stderr, "invalid surrogate pair\n");
-                throw();
-            }
             if(ch == '\"') {
-                if(surrogate) {
-                    fprintf(stderr, "invalid surrogate pair\n");
-                    throw();
-                } else if(suffix >= 0) {
-                    append_buffer((char)suffix);
+                check_utf8_run(ctx, run);
+                if(suffix >= 0) {
+                    append_buffer(&ctx->buffer, (char)suffix);
                 }
-                return to_string_buffer();
+                return 1;
             } else if(ch == '\\') {
-                state = PARSE_STRING_BACKSLASH;
-            } else if(ch >= 0x20) {
-                append_buffer(ch);
-            }
-            break;
-
-        case PARSE_STRING_BACKSLASH:
-            if(ch != 'u' && surrogate) {
-                fprintf(stderr, "invalid surrogate pair\n");
-                throw();
-            }
-            switch(ch) {
-            case '\"':  case '/':
-                append_buffer(ch);
-                state = PARSE_STRING_STRING;
-                break;
-            case '\\': case 'b': case 'f': case 'n': case 'r': case 't':
-                append_buffer('\\');
-                append_buffer(ch);
-                state = PARSE_STRING_STRING;
-                break;
-            case 'u':
-                codepoint = 0;
-                codepoint_count = 0;
-                if(!expand_escape) {
-                    append_buffer('\\');
-                    append_buffer(ch);
-                }
-                state = PARSE_STRING_CODEPOINT;
-                break;
-            default:
-                fprintf(stderr, "invalid escape sequence\n");
-                throw();
-                break;
-            }
-            break;
-
-        case PARSE_STRING_CODEPOINT:
-            if(codepoint_count < 4) {
-                if(isdigit(ch)) {
-                    codepoint = (codepoint << 4) + (ch - '0');
-                } else if(ch >= 'A' && ch <= 'F') {
-                    codepoint = (codepoint << 4) + ((ch - 'A') + 10);
-                } else if(ch >= 'a' && ch <= 'f') {
-                    codepoint = (codepoint << 4) + ((ch - 'a') + 10);
-                } else {
-                    fprintf(stderr, "invalid escape sequence\n");
-                    throw();
-                }
-                if(!expand_escape) {
-                    append_buffer(ch);
-                }
-                codepoint_count++;
-            } else {
-                if(surrogate) {
-                    if(codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
-                        if(expand_escape) {
-                            if(!append_codepoint_buffer(surrogate_to_codepoint(surrogate, codepoint))) {
-                                fprintf(stderr, "invalid codepoint\n");
-                                throw();
-                            }
-                        }
-                        surrogate = 0;
-                    } else {
-                        fprintf(stderr, "invalid surrogate pair\n");
-                        throw();
-                    }
-                } else {
-                    if(codepoint >= 0xD800 && codepoint <= 0xDCFF) {
-                        surrogate = codepoint;
-                    } else if(expand_escape) {
-                        if(!append_codepoint_buffer(codepoint)) {
-                            fprintf(stderr, "invalid codepoint\n");
-                            throw();
-                        }
-                    }
+                check_utf8_run(ctx, run);
+                stats_enter(&ctx->stats, STATS_ESCAPE);
+                state = PARSE_STRING_BACKSLASH;
+            } else if(ch >= 0x20) {
+                append_buffer(&ctx->buffer, ch);
+                /* the validator takes each block of 16 bytes as soon as it is collected. */
+                if(ctx->validate_utf8 && ctx->buffer.ptr - ctx->buffer.value - run == 16) {
+                    feed_utf8(&ctx->utf8, ctx->buffer.value + run, 16);
+                    run += 16;
                 }
-                ungetc(ch, fp);
-                state = PARSE_STRING_STRING;
             }
+            break;
+
+        case PARSE_STRING_BACKSLASH:
+            if(ch == 'u') {
+                scan_unicode_escape(ctx, fp);
+            } else if(decode_escape(ch) < 0) {
+                fprintf(stderr, "%s\n", escape_error(ESCAPE_INVALID));
+                throw(ctx);
+            } else if(ch == '\"' || ch == '/') {
+                append_buffer(&ctx->buffer, ch);
+            } else {
+                append_buffer(&ctx->buffer, '\\');
+                append_buffer(&ctx->buffer, ch);
+            }
+            stats_leave(&ctx->stats, STATS_ESCAPE);
+            run = ctx->buffer.ptr - ctx->buffer.value;
+            state = PARSE_STRING_STRING;
+            break;
         }
     }
     fprintf(stderr, "internal error\n");
-    throw();
-    return NULL;
+    throw(ctx);
+    return 0;
+}
+
+char *parse_string(flatj_context *ctx, FILE *fp, int suffix) {
+    return scan_string(ctx, fp, suffix) ? to_string_buffer(&ctx->buffer) : NULL;
 }
 
 enum state_parse_number {
@@ -267,7 +1247,7 @@ enum state_parse_number {
     PARSE_NUMBER_EXPONENT_NUMBER
 };
 
-char *parse_number(FILE *fp) {
+char *parse_number(flatj_context *ctx, FILE *fp) {
     enum state_parse_number state = PARSE_NUMBER_INIT;
     int ch;
     char *result, *restring, buf[256];
@@ -275,19 +1255,19 @@ char *parse_number(FILE *fp) {
 
     ch = nextchar(fp);
     ungetc(ch, fp);
-    init_buffer();
+    init_buffer(&ctx->buffer);
     while(1) {
         ch = getc(fp);
         switch(state) {
         case PARSE_NUMBER_INIT:
             if(ch == '0') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_AFTER_ZERO;
             } else if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_NUMBER;
             } else if(ch == '-') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_NUMBER_START;
             } else {
                 ungetc(ch, fp);
@@ -297,25 +1277,25 @@ char *parse_number(FILE *fp) {
 
         case PARSE_NUMBER_NUMBER_START:
             if(ch == '0') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_AFTER_ZERO;
             } else if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_NUMBER:
             if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
             } else if(ch == '.') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_POINT_START;
             } else if(ch == 'e' || ch == 'E') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -324,10 +1304,10 @@ char *parse_number(FILE *fp) {
 
         case PARSE_NUMBER_AFTER_ZERO:
             if(ch == '.') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_POINT_START;
             } else if(ch == 'e' || ch == 'E') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -336,19 +1316,19 @@ char *parse_number(FILE *fp) {
 
         case PARSE_NUMBER_POINT_START:
             if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_POINT;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_POINT:
             if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
             } else if(ch == 'e' || ch == 'E') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -359,30 +1339,30 @@ char *parse_number(FILE *fp) {
             if(ch == '+') {
                 state = PARSE_NUMBER_EXPONENT_NUMBER_START;
             } else if(ch == '-') {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT_NUMBER_START;
             } else if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_EXPONENT_NUMBER_START:
             if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
                 state = PARSE_NUMBER_EXPONENT_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_EXPONENT_NUMBER:
             if(isdigit(ch)) {
-                append_buffer(ch);
+                append_buffer(&ctx->buffer, ch);
             } else {
                 goto matched;
             }
@@ -390,247 +1370,821 @@ char *parse_number(FILE *fp) {
 
         default:
             fprintf(stderr, "internal error\n");
-            throw();
+            throw(ctx);
             break;
         }
     }
     fprintf(stderr, "internal error\n");
-    throw();
+    throw(ctx);
     return NULL;
 
     matched:
     ungetc(ch, fp);
-    return to_string_buffer();
+    return to_string_buffer(&ctx->buffer);
 }
 
-char *parse_literal(FILE *fp) {
+char *parse_literal(flatj_context *ctx, FILE *fp) {
     int ch;
 
     ch = nextchar(fp);
     ungetc(ch, fp);
-    init_buffer();
+    init_buffer(&ctx->buffer);
     while(1) {
         if(isalpha(ch = getc(fp))) {
-            append_buffer(ch);
+            append_buffer(&ctx->buffer, ch);
         } else {
             ungetc(ch, fp);
             break;
         }
     }
 
-    if(equals_buffer("null") || equals_buffer("true") || equals_buffer("false")) {
-        return to_string_buffer();
+    if(equals_buffer(&ctx->buffer, "null") || equals_buffer(&ctx->buffer, "true") || equals_buffer(&ctx->buffer, "false")) {
+        return to_string_buffer(&ctx->buffer);
     } else {
         fprintf(stderr, "invalid literal\n");
-        throw();
+        throw(ctx);
         return NULL;
     }
 }
 
-enum state_parse_object {
-    PARSE_OBJECT_INIT,
-    PARSE_OBJECT_KEY_INIT,
-    PARSE_OBJECT_KEY,
-    PARSE_OBJECT_NEXT,
-    PARSE_OBJECT_RESULT
-};
+/*
+ * frames of objects and arrays which are not closed yet.
+ * The parser keeps them on the heap instead of recursion, so deep nesting does not overflow the C stack.
+ */
+void push_frame(flatj_context *ctx, int depth, enum frame_type type) {
+    if(ctx->max_nesting > 0 && depth >= ctx->max_nesting) {
+        fprintf(stderr, "nesting too deep\n");
+        throw(ctx);
+    }
+    if(depth >= ctx->frames_size) {
+        ctx->frames_size = ctx->frames_size * 2 + 64;
+        ctx->frames = (parse_frame *)xrealloc(ctx->frames, ctx->frames_size * sizeof(parse_frame));
+    }
+    ctx->frames[depth].type = type;
+    ctx->frames[depth].index = 0;
+    count_depth(&ctx->stats, depth + 1);
+}
 
-int parse_object(FILE *fp) {
-    enum state_parse_object state = PARSE_OBJECT_INIT;
+void parse_member_key(flatj_context *ctx, FILE *fp) {
     int ch;
-    char *str;
 
-    while(1) {
-        if((ch = nextchar(fp)) == EOF) {
-            fprintf(stderr, "unexpected EOF\n");
-            throw();
-        }
+    if(!scan_string(ctx, fp, -1)) {
+        fprintf(stderr, "string needed\n");
+        throw(ctx);
+    }
+    push_key(ctx);
+    count_token(&ctx->stats, STATS_KEY);
+    if((ch = nextchar(fp)) == EOF) {
+        fprintf(stderr, "unexpected EOF\n");
+        throw(ctx);
+    } else if(ch != ':') {
+        fprintf(stderr, "comma needed\n");
+        throw(ctx);
+    }
+}
+
+enum state_parse_json {
+    PARSE_JSON_VALUE,
+    PARSE_JSON_END
+};
 
+void parse_json_root(flatj_context *ctx, FILE *fp) {
+    enum state_parse_json state = PARSE_JSON_VALUE;
+    parse_frame *frame;
+    int ch, depth = 0;
+    char *result;
+
+    while(1) {
         switch(state) {
-        case PARSE_OBJECT_INIT:
-            if(ch == '{') {
-                state = PARSE_OBJECT_KEY_INIT;
+        case PARSE_JSON_VALUE:
+            if((ch = nextchar(fp)) == EOF) {
+                fprintf(stderr, "unexpected EOF\n");
+                throw(ctx);
+            } else if(ch == '{') {
+                count_token(&ctx->stats, STATS_OBJECT);
+                if((ch = nextchar(fp)) == '}') {
+                    print_value(ctx, literal_to_string("{}"), STACK_EMPTY_OBJECT);
+                    state = PARSE_JSON_END;
+                } else {
+                    ungetc(ch, fp);
+                    push_frame(ctx, depth++, FRAME_OBJECT);
+                    parse_member_key(ctx, fp);
+                }
+            } else if(ch == '[') {
+                count_token(&ctx->stats, STATS_ARRAY);
+                if((ch = nextchar(fp)) == ']') {
+                    print_value(ctx, literal_to_string("[]"), STACK_EMPTY_ARRAY);
+                    state = PARSE_JSON_END;
+                } else {
+                    ungetc(ch, fp);
+                    push_frame(ctx, depth++, FRAME_ARRAY);
+                    push_index(ctx, 0);
+                }
             } else {
                 ungetc(ch, fp);
-                return 0;
+                if((result = parse_string(ctx, fp, ctx->suffix_char)) != NULL) {
+                    count_token(&ctx->stats, STATS_STRING);
+                    print_value(ctx, result, STACK_STRING);
+                } else if((result = parse_number(ctx, fp)) != NULL) {
+                    count_token(&ctx->stats, STATS_NUMBER);
+                    print_value(ctx, result, STACK_NUMBER);
+                } else if((result = parse_literal(ctx, fp)) != NULL) {
+                    count_token(&ctx->stats, STATS_LITERAL);
+                    print_value(ctx, result, STACK_LITERAL);
+                } else {
+                    fprintf(stderr, "invalid JSON\n");
+                    throw(ctx);
+                }
+                state = PARSE_JSON_END;
             }
             break;
 
-        case PARSE_OBJECT_KEY_INIT:
-            if(ch == '}') {
-                push_stack(literal_to_string("{}"));
-                print_stack(fpout);
-                pop_stack();
-                return 1;
+        case PARSE_JSON_END:
+            if(depth == 0) {
+                if(nextchar(fp) != EOF) {
+                    fprintf(stderr, "unexpected EOF\n");
+                    throw(ctx);
+                }
+                return;
+            }
+            frame = &ctx->frames[depth - 1];
+            if((ch = nextchar(fp)) == EOF) {
+                fprintf(stderr, "unexpected EOF\n");
+                throw(ctx);
+            } else if(frame->type == FRAME_OBJECT) {
+                if(ch == ',') {
+                    pop_stack(ctx);
+                    parse_member_key(ctx, fp);
+                    state = PARSE_JSON_VALUE;
+                } else if(ch == '}') {
+                    pop_stack(ctx);
+                    depth--;
+                }
             } else {
-                ungetc(ch, fp);
-                if((str = parse_string(fp, -1)) != NULL) {
-                    push_stack(str);
-                    state = PARSE_OBJECT_NEXT;
+                if(ch == ',') {
+                    pop_stack(ctx);
+                    push_index(ctx, ++frame->index);
+                    state = PARSE_JSON_VALUE;
+                } else if(ch == ']') {
+                    pop_stack(ctx);
+                    depth--;
                 } else {
-                    fprintf(stderr, "string needed\n");
-                    throw();
+                    fprintf(stderr, "invalid array\n");
+                    throw(ctx);
                 }
             }
             break;
 
-        case PARSE_OBJECT_KEY:
-            ungetc(ch, fp);
-            if((str = parse_string(fp, -1)) != NULL) {
-                push_stack(str);
-                state = PARSE_OBJECT_NEXT;
-            } else {
-                fprintf(stderr, "string needed\n");
-                throw();
-            }
+        default:
+            fprintf(stderr, "internal error\n");
+            throw(ctx);
             break;
+        }
+    }
+}
 
-        case PARSE_OBJECT_NEXT:
-            if(ch == ':') {
-                parse_json(fp);
-                state = PARSE_OBJECT_RESULT;
-            } else {
-                fprintf(stderr, "comma needed\n");
-                throw();
-            }
-            break;
+void init_flatj_context(flatj_context *ctx) {
+    memset(ctx, 0, sizeof(flatj_context));
+    ctx->fpout = stdout;
+    ctx->separator = '\t';
+    ctx->index_prefix = '#';
+    ctx->suffix_char = -1;
+    init_utf8_validator(&ctx->utf8);
+    ctx->print_leaf = print_stack;
+    ctx->csv_delimiter = ',';
+    ctx->csv_sample_size = 100;
+    ctx->csv_record = -1;
+    ctx->group_path = -1;
+    ctx->record_group = -1;
+    ctx->aggregate_record = -1;
+}
 
-        case PARSE_OBJECT_RESULT:
-            if(ch == ',') {
-                pop_stack();
-                state = PARSE_OBJECT_KEY;
-            } else if(ch == '}') {
-                pop_stack();
-                return 1;
+/*
+ * clears the state of the last file, which may be left by an error.
+ * Buffers and interned keys are kept for the next file, except keys of binary output, which restarts from id 0.
+ * Columns, CSV columns and groups of aggregation are per file.
+ */
+void reset_flatj_context(flatj_context *ctx) {
+    while(ctx->stack_ptr != NULL) {
+        pop_stack(ctx);
+    }
+    ctx->synced_depth = ctx->emitted_depth = 0;
+    if(ctx->print_leaf == print_binary) {
+        free_intern_table(&ctx->keys);
+        ctx->defined_keys = 0;
+    }
+    reset_columnar(ctx);
+    reset_csv(ctx);
+    reset_aggregate(ctx);
+}
+
+void free_flatj_context(flatj_context *ctx) {
+    stack_list *p;
+    pending_list *q;
+
+    reset_flatj_context(ctx);
+    for(; ctx->free_stack != NULL; ctx->free_stack = p) {
+        p = ctx->free_stack->next;
+        xfree(ctx->free_stack);
+    }
+    xfree(ctx->columns);
+    xfree(ctx->csv_columns);
+    xfree(ctx->aggregate_specs);
+    xfree(ctx->group_ids);
+    xfree(ctx->group_names);
+    xfree(ctx->groups);
+    for(; ctx->free_pending != NULL; ctx->free_pending = q) {
+        q = ctx->free_pending->next;
+        xfree(ctx->free_pending);
+    }
+    xfree(ctx->frames);
+    free_buffer(&ctx->buffer);
+    free_intern_table(&ctx->keys);
+}
+
+/*
+ * initializes the context of another worker by the options of ctx.
+ * Nothing on the heap is shared, so keys of --agg are interned again into the worker's own table.
+ */
+void init_flatj_worker(flatj_context *worker, flatj_context *ctx) {
+    int i;
+
+    memcpy(worker, ctx, sizeof(flatj_context));
+    memset(&worker->buffer, 0, sizeof(string_buffer));
+    memset(&worker->keys, 0, sizeof(intern_table));
+    memset(&worker->stats, 0, sizeof(stats));
+    worker->frames = NULL;
+    worker->frames_size = 0;
+    worker->stack = worker->stack_ptr = worker->free_stack = NULL;
+    worker->stack_depth = 0;
+    worker->columns = NULL;
+    worker->columns_size = worker->columns_count = 0;
+    worker->csv_samples = worker->csv_samples_ptr = NULL;
+    worker->csv_columns = NULL;
+    worker->csv_columns_size = worker->csv_columns_count = 0;
+    worker->csv_row = NULL;
+    worker->group_ids = worker->group_names = NULL;
+    worker->group_ids_size = 0;
+    worker->groups = NULL;
+    worker->group_count = worker->groups_size = 0;
+    worker->pending = worker->free_pending = NULL;
+
+    if(ctx->group_path >= 0) {
+        worker->group_path = intern(&worker->keys, interned_string(&ctx->keys, ctx->group_path), interned_length(&ctx->keys, ctx->group_path));
+    }
+    if(ctx->aggregate_spec_count > 0) {
+        worker->aggregate_specs = (aggregate_spec *)xalloc(ctx->aggregate_spec_count * sizeof(aggregate_spec));
+        memcpy(worker->aggregate_specs, ctx->aggregate_specs, ctx->aggregate_spec_count * sizeof(aggregate_spec));
+        for(i = 0; i < ctx->aggregate_spec_count; i++) {
+            worker->aggregate_specs[i].path = intern(&worker->keys, interned_string(&ctx->keys, ctx->aggregate_specs[i].path), interned_length(&ctx->keys, ctx->aggregate_specs[i].path));
+        }
+    }
+}
+
+/* settles the output by the options. the string suffix and the filename column are only for flat text. */
+void init_flatj_output(flatj_context *ctx) {
+    if(ctx->print_leaf != print_stack) {
+        ctx->suffix_char = -1;
+        ctx->show_filename = 0;
+    } else if(ctx->separator != '\t') {
+        ctx->print_leaf = print_stack_separator;
+    }
+}
+
+/* writes the header of the output of a file. */
+void start_flatj_output(flatj_context *ctx) {
+    if(ctx->print_leaf == print_binary) {
+        fwrite(BINARY_MAGIC, 1, BINARY_MAGIC_LENGTH, ctx->fpout);
+    } else if(ctx->print_leaf == print_columnar) {
+        if(mkdir(ctx->columnar_dir, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "cannot create directory %s\n", ctx->columnar_dir);
+            exit(EXIT_EXCEPTION);
+        }
+    } else if(ctx->print_leaf == print_csv) {
+        init_csv(ctx, ctx->csv_column_arg);
+    }
+}
+
+void finish_flatj_output(flatj_context *ctx) {
+    if(ctx->print_leaf == print_columnar) {
+        finish_columnar(ctx);
+    } else if(ctx->print_leaf == print_csv) {
+        finish_csv(ctx);
+    } else if(ctx->print_leaf == print_aggregate) {
+        finish_aggregate(ctx);
+    }
+}
+
+int flatj_file(flatj_context *ctx, FILE *fp) {
+    int errcode;
+
+    stats_enter(&ctx->stats, STATS_TOTAL);
+    if((errcode = setjmp(ctx->top)) == 0) {
+        parse_json_root(ctx, fp);
+    }
+    stats_leave(&ctx->stats, STATS_TOTAL);
+    return errcode;
+}
+
+/* process() of the file pool */
+int flatj_process(void *context, char *filename, FILE *input, FILE *output) {
+    flatj_context *ctx = (flatj_context *)context;
+    FILE *fp = ctx->show_stats ? stats_file(input, 0, &ctx->stats) : input;
+    int errcode;
+
+    ctx->fpout = ctx->show_stats ? stats_file(output, 1, &ctx->stats) : output;
+    ctx->filename = ctx->show_filename ? filename : NULL;
+    start_flatj_output(ctx);
+    if((errcode = flatj_file(ctx, fp)) == 0) {
+        finish_flatj_output(ctx);
+    }
+    if(ctx->show_stats) {
+        fclose(fp);
+        fclose(ctx->fpout);
+    }
+    reset_flatj_context(ctx);
+    return errcode;
+}
+
+/*
+ * --follow flattens records of JSON Lines as they are appended to a file.
+ * follow_file() ends each line by EOF, so parse_json_root() takes a record as a document
+ * and keeps its state while the rest of a line is not written yet.
+ * An invalid record is reported and skipped. The output is flushed after each record.
+ */
+int flatj_follow(flatj_context *ctx, char *filename) {
+    FILE *fp = follow_file(filename);
+
+    ctx->filename = ctx->show_filename ? filename : NULL;
+    while(next_follow_record(fp)) {
+        flatj_file(ctx, fp);
+        reset_flatj_context(ctx);
+        fflush(ctx->fpout);
+    }
+    fprintf(stderr, "cannot read file %s\n", filename);
+    fclose(fp);
+    return EXIT_EXCEPTION;
+}
+
+/*
+ * structural diff of --diff.
+ * Both documents are parsed by libflatjson in lockstep and buffered a record at a time,
+ * which is an element of the top-level array or the whole document if it is not an array.
+ * Leaves of a record are sorted by path, so that members of objects are matched by key in any order,
+ * and the leaves of both sides are merged in order of paths.
+ * A leaf only in A is printed with '-', only in B with '+' and a changed leaf by both lines.
+ * With --diff-key, records are joined by the value of the key, which must be in ascending order.
+ */
+typedef struct diff_record {
+    flatjson_value *values;
+    size_t *value_offsets;
+    int *path_offsets;
+    int count;
+    int size;
+    flatjson_segment *segments;
+    size_t *key_offsets;
+    int segments_count;
+    int segments_size;
+    char *text;
+    size_t text_length;
+    size_t text_size;
+    /* index of the record in the top-level array or -1 for the whole document */
+    long index;
+    /* value of the key or NULL if the record has no key */
+    const flatjson_value *key;
+} diff_record;
+
+typedef struct diff_side {
+    char *filename;
+    FILE *fp;
+    flatjson_parser *parser;
+    /* the next leaf, valid if has_value is not 0 */
+    flatjson_value value;
+    int has_value;
+    /* the current and the previous record of --diff-key */
+    diff_record records[2];
+    diff_record *record;
+    /* the next leaf of the record without --diff-key */
+    int next;
+} diff_side;
+
+void next_diff_leaf(flatj_context *ctx, diff_side *side) {
+    if((side->has_value = flatjson_next(side->parser, &side->value)) < 0) {
+        fprintf(stderr, "%s: %s\n", side->filename, flatjson_error(side->parser));
+        throw(ctx);
+    }
+}
+
+int compare_bytes(const char *a, size_t a_length, const char *b, size_t b_length) {
+    int c = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+    return c != 0 ? c : a_length < b_length ? -1 : a_length > b_length;
+}
+
+/* indices are ordered by number and before keys, keys by bytes and a path before the paths below it. */
+int compare_diff_paths(const flatjson_value *a, const flatjson_value *b) {
+    const flatjson_segment *x, *y;
+    int i, c;
+
+    for(i = 0; i < a->depth && i < b->depth; i++) {
+        x = &a->path[i];
+        y = &b->path[i];
+        if(x->key == NULL && y->key == NULL) {
+            c = x->index < y->index ? -1 : x->index > y->index;
+        } else if(x->key == NULL || y->key == NULL) {
+            c = x->key == NULL ? -1 : 1;
+        } else {
+            c = compare_bytes(x->key, x->key_length, y->key, y->key_length);
+        }
+        if(c != 0) {
+            return c;
+        }
+    }
+    return a->depth < b->depth ? -1 : a->depth > b->depth;
+}
+
+/* keys of records are ordered by type, numbers by value and the others by bytes. A missing key is the least. */
+int compare_diff_keys(const flatjson_value *a, const flatjson_value *b) {
+    double x, y;
+
+    if(a == NULL || b == NULL) {
+        return (a != NULL) - (b != NULL);
+    } else if(a->type != b->type) {
+        return a->type < b->type ? -1 : 1;
+    } else if(a->type == FLATJSON_NUMBER) {
+        x = strtod(a->value, NULL);
+        y = strtod(b->value, NULL);
+        return x < y ? -1 : x > y;
+    }
+    return compare_bytes(a->value, a->length, b->value, b->length);
+}
+
+/*
+ * prints a key or a string of --diff as scan_string() does for flat text.
+ * Without -E libflatjson keeps escapes, of which \" and \/ are unescaped.
+ * With -E it decodes all of them, so the characters of encode_escape() are escaped again.
+ */
+void print_diff_string(flatj_context *ctx, FILE *fpout, const char *value, long length) {
+    const char *p, *end = value + length;
+    int escape;
+
+    for(p = value; p < end; p++) {
+        if(!ctx->expand_escape) {
+            if(*p == '\\' && (p[1] == '\"' || p[1] == '/')) {
+                p++;
+            } else if(*p == '\\') {
+                putc(*p++, fpout);
             }
-            break;
+            putc(*p, fpout);
+        } else if((escape = encode_escape((unsigned char)*p)) != 0) {
+            putc('\\', fpout);
+            putc(escape, fpout);
+        } else {
+            putc(*p, fpout);
+        }
+    }
+}
 
-        default:
-            fprintf(stderr, "internal error\n");
-            throw();
-            break;
+/* prints a line of --diff. index is the index of the record of --diff-key or -1. */
+void print_diff(flatj_context *ctx, int marker, long index, const flatjson_value *v) {
+    FILE *fpout = ctx->fpout;
+    int i;
+
+    putc(marker, fpout);
+    if(index >= 0) {
+        fprintf(fpout, "%c%c%ld", ctx->separator, ctx->index_prefix, index);
+    }
+    for(i = 0; i < v->depth; i++) {
+        putc(ctx->separator, fpout);
+        if(v->path[i].key == NULL) {
+            fprintf(fpout, "%c%ld", ctx->index_prefix, v->path[i].index);
+        } else {
+            print_diff_string(ctx, fpout, v->path[i].key, v->path[i].key_length);
         }
     }
-    fprintf(stderr, "internal error\n");
-    throw();
-    return 0;
+    putc(ctx->separator, fpout);
+    if(v->type == FLATJSON_STRING) {
+        print_diff_string(ctx, fpout, v->value, v->length);
+    } else {
+        fwrite(v->value, 1, v->length, fpout);
+    }
+    if(v->type == FLATJSON_STRING && ctx->suffix_char >= 0) {
+        putc(ctx->suffix_char, fpout);
+    }
+    if(ctx->separator == '\n') {
+        putc('\n', fpout);
+    }
+    putc('\n', fpout);
+    ctx->diff_count++;
 }
 
-enum state_parse_array {
-    PARSE_ARRAY_INIT,
-    PARSE_ARRAY_LIST_INIT,
-    PARSE_ARRAY_LIST,
-    PARSE_ARRAY_RESULT
-};
+/* prints the difference of leaves of A and B and returns their order. */
+int diff_leaves(flatj_context *ctx, const flatjson_value *a, long a_index, const flatjson_value *b, long b_index) {
+    int c = compare_diff_paths(a, b);
+
+    if(c < 0) {
+        print_diff(ctx, '-', a_index, a);
+    } else if(c > 0) {
+        print_diff(ctx, '+', b_index, b);
+    } else if(a->type != b->type || a->length != b->length || memcmp(a->value, b->value, a->length) != 0) {
+        print_diff(ctx, '-', a_index, a);
+        print_diff(ctx, '+', b_index, b);
+    }
+    return c;
+}
 
-int parse_array(FILE *fp) {
-    enum state_parse_array state = PARSE_ARRAY_INIT;
-    int ch, index = 0;
+size_t append_diff_text(diff_record *r, const char *text, size_t length) {
+    size_t offset = r->text_length;
 
-    while(1) {
-        if((ch = nextchar(fp)) == EOF) {
-            fprintf(stderr, "unexpected EOF\n");
-            throw();
+    if(r->text_length + length + 1 > r->text_size) {
+        r->text_size = (r->text_length + length + 1) * 2;
+        r->text = (char *)xrealloc(r->text, r->text_size);
+    }
+    memcpy(r->text + r->text_length, text, length);
+    r->text[r->text_length + length] = '\0';
+    r->text_length += length + 1;
+    return offset;
+}
+
+/* copies a leaf to the record without the first segments of path, which is the index of the top-level array of --diff-key. */
+void append_diff_value(diff_record *r, const flatjson_value *v, int first) {
+    int i;
+
+    if(r->count >= r->size) {
+        r->size = r->size == 0 ? 16 : r->size * 2;
+        r->values = (flatjson_value *)xrealloc(r->values, r->size * sizeof(flatjson_value));
+        r->value_offsets = (size_t *)xrealloc(r->value_offsets, r->size * sizeof(size_t));
+        r->path_offsets = (int *)xrealloc(r->path_offsets, r->size * sizeof(int));
+    }
+    if(r->segments_count + v->depth > r->segments_size) {
+        r->segments_size = (r->segments_count + v->depth) * 2;
+        r->segments = (flatjson_segment *)xrealloc(r->segments, r->segments_size * sizeof(flatjson_segment));
+        r->key_offsets = (size_t *)xrealloc(r->key_offsets, r->segments_size * sizeof(size_t));
+    }
+    r->values[r->count] = *v;
+    r->values[r->count].depth = v->depth - first;
+    r->path_offsets[r->count] = r->segments_count;
+    r->value_offsets[r->count] = append_diff_text(r, v->value, v->length);
+    r->count++;
+    for(i = first; i < v->depth; i++) {
+        r->segments[r->segments_count] = v->path[i];
+        if(v->path[i].key != NULL) {
+            r->key_offsets[r->segments_count] = append_diff_text(r, v->path[i].key, v->path[i].key_length);
         }
+        r->segments_count++;
+    }
+}
 
-        switch(state) {
-        case PARSE_ARRAY_INIT:
-            if(ch == '[') {
-                state = PARSE_ARRAY_LIST_INIT;
-            } else {
-                ungetc(ch, fp);
+/* tests if the path of a leaf in a record matches the path template of --diff-key without the leading index. */
+int match_diff_key(flatj_context *ctx, const flatjson_value *v, const char *key) {
+    int i;
+
+    for(i = 0; i < v->depth; i++) {
+        if(i > 0 && *key++ != '.') {
+            return 0;
+        } else if(v->path[i].key == NULL) {
+            if(*key++ != ctx->index_prefix) {
                 return 0;
             }
-            break;
+        } else if(strncmp(key, v->path[i].key, v->path[i].key_length) != 0) {
+            return 0;
+        } else {
+            key += v->path[i].key_length;
+        }
+    }
+    return *key == '\0';
+}
 
-        case PARSE_ARRAY_LIST_INIT:
-            if(ch == ']') {
-                push_stack(literal_to_string("[]"));
-                print_stack(fpout);
-                pop_stack();
-                return 1;
-            } else {
-                ungetc(ch, fp);
-                push_stack(int_to_string(index++));
-                parse_json(fp);
-                pop_stack();
-                state = PARSE_ARRAY_RESULT;
-            }
-            break;
+/* orders leaves of a record by path and equal paths of duplicate keys as they appear, which is the order of their segments. */
+int compare_diff_leaves(const void *a, const void *b) {
+    const flatjson_value *x = (const flatjson_value *)a, *y = (const flatjson_value *)b;
+    int c = compare_diff_paths(x, y);
 
-        case PARSE_ARRAY_LIST:
-            ungetc(ch, fp);
-            push_stack(int_to_string(index++));
-            parse_json(fp);
-            pop_stack();
-            state = PARSE_ARRAY_RESULT;
-            break;
+    return c != 0 ? c : x->path < y->path ? -1 : x->path > y->path;
+}
 
-        case PARSE_ARRAY_RESULT:
-            if(ch == ',') {
-                state = PARSE_ARRAY_LIST;
-            } else if(ch == ']') {
-                return 1;
-            } else {
-                fprintf(stderr, "invalid array\n");
-                throw();
+/*
+ * reads the next record and sorts its leaves by path. returns 0 at the end of the document.
+ * With --diff-key the record is an element of the top-level array and its index is removed from paths.
+ */
+int read_diff_record(flatj_context *ctx, diff_side *side) {
+    diff_record *r;
+    int first = ctx->diff_key != NULL, sorted = 1, array, i, j;
+
+    if(!side->has_value || (first && side->value.depth == 0 && side->value.type == FLATJSON_EMPTY_ARRAY)) {
+        return 0;
+    }
+    array = side->value.depth > 0 && side->value.path[0].key == NULL;
+    if(first && !array) {
+        fprintf(stderr, "%s: --diff-key takes an array of records\n", side->filename);
+        throw(ctx);
+    }
+    side->record = r = side->record == &side->records[0] ? &side->records[1] : &side->records[0];
+    r->count = r->segments_count = 0;
+    r->text_length = 0;
+    r->index = array ? side->value.path[0].index : -1;
+    r->key = NULL;
+    do {
+        append_diff_value(r, &side->value, first);
+        next_diff_leaf(ctx, side);
+    } while(side->has_value && (!array || side->value.path[0].index == r->index));
+
+    /* the buffers are settled and the pointers are resolved by the offsets */
+    for(i = 0; i < r->count; i++) {
+        r->values[i].value = r->text + r->value_offsets[i];
+        r->values[i].path = r->segments + r->path_offsets[i];
+        for(j = 0; j < r->values[i].depth; j++) {
+            if(r->values[i].path[j].key != NULL) {
+                r->segments[r->path_offsets[i] + j].key = r->text + r->key_offsets[r->path_offsets[i] + j];
             }
-            break;
-
-        default:
-            fprintf(stderr, "internal error\n");
-            throw();
-            break;
+        }
+        if(i > 0 && sorted && compare_diff_paths(&r->values[i - 1], &r->values[i]) > 0) {
+            sorted = 0;
         }
     }
-    fprintf(stderr, "internal error\n");
-    throw();
-    return 0;
+    if(!sorted) {
+        qsort(r->values, r->count, sizeof(flatjson_value), compare_diff_leaves);
+    }
+    for(i = 0; first && r->key == NULL && i < r->count; i++) {
+        if(match_diff_key(ctx, &r->values[i], ctx->diff_key + 2)) {
+            r->key = &r->values[i];
+        }
+    }
+    return 1;
 }
 
-int parse_json(FILE *fp) {
-    char *result;
+int read_diff_record_in_order(flatj_context *ctx, diff_side *side) {
+    diff_record *prev = side->record;
 
-    if(parse_object(fp)) {
-        /* ok */
-    } else if(parse_array(fp)) {
-        /* ok */
-    } else if((result = parse_string(fp, suffix_char)) != NULL || (result = parse_number(fp)) != NULL || (result = parse_literal(fp)) != NULL) {
-        push_stack(result);
-        print_stack(fpout);
-        pop_stack();
-    } else {
-        fprintf(stderr, "invalid JSON\n");
-        throw();
+    if(!read_diff_record(ctx, side)) {
+        return 0;
+    } else if(prev != NULL && compare_diff_keys(prev->key, side->record->key) > 0) {
+        fprintf(stderr, "%s: records are not in ascending order of %s\n", side->filename, ctx->diff_key);
+        throw(ctx);
     }
     return 1;
 }
 
-void parse_json_root(FILE *fp) {
-    int ch;
+/* returns the next leaf of the records in order of paths or NULL at the end of the document. */
+const flatjson_value *next_diff_value(flatj_context *ctx, diff_side *side) {
+    if(side->record == NULL || side->next >= side->record->count) {
+        if(!read_diff_record(ctx, side)) {
+            return NULL;
+        }
+        side->next = 0;
+    }
+    return &side->record->values[side->next++];
+}
 
-    parse_json(fp);
-    if((ch = nextchar(fp)) != EOF) {
-        fprintf(stderr, "unexpected EOF\n");
-        throw();
+void diff_stream(flatj_context *ctx, diff_side *a, diff_side *b) {
+    const flatjson_value *x, *y;
+    int c;
+
+    next_diff_leaf(ctx, a);
+    next_diff_leaf(ctx, b);
+    x = next_diff_value(ctx, a);
+    y = next_diff_value(ctx, b);
+    while(x != NULL || y != NULL) {
+        if(y == NULL) {
+            print_diff(ctx, '-', -1, x);
+            c = -1;
+        } else if(x == NULL) {
+            print_diff(ctx, '+', -1, y);
+            c = 1;
+        } else {
+            c = diff_leaves(ctx, x, -1, y, -1);
+        }
+        if(c <= 0) {
+            x = next_diff_value(ctx, a);
+        }
+        if(c >= 0) {
+            y = next_diff_value(ctx, b);
+        }
+    }
+}
+
+void diff_records(flatj_context *ctx, diff_side *a, diff_side *b) {
+    diff_record *x, *y;
+    int has_a, has_b, c, i, j;
+
+    next_diff_leaf(ctx, a);
+    next_diff_leaf(ctx, b);
+    has_a = read_diff_record_in_order(ctx, a);
+    has_b = read_diff_record_in_order(ctx, b);
+    while(has_a || has_b) {
+        x = a->record;
+        y = b->record;
+        c = !has_b ? -1 : !has_a ? 1 : compare_diff_keys(x->key, y->key);
+        if(c < 0) {
+            for(i = 0; i < x->count; i++) {
+                print_diff(ctx, '-', x->index, &x->values[i]);
+            }
+        } else if(c > 0) {
+            for(j = 0; j < y->count; j++) {
+                print_diff(ctx, '+', y->index, &y->values[j]);
+            }
+        } else {
+            for(i = j = 0; i < x->count || j < y->count;) {
+                if(j >= y->count) {
+                    print_diff(ctx, '-', x->index, &x->values[i++]);
+                } else if(i >= x->count) {
+                    print_diff(ctx, '+', y->index, &y->values[j++]);
+                } else {
+                    c = diff_leaves(ctx, &x->values[i], x->index, &y->values[j], y->index);
+                    i += c <= 0;
+                    j += c >= 0;
+                }
+            }
+            c = 0;
+        }
+        if(c <= 0) {
+            has_a = read_diff_record_in_order(ctx, a);
+        }
+        if(c >= 0) {
+            has_b = read_diff_record_in_order(ctx, b);
+        }
+    }
+}
+
+void free_diff_side(diff_side *side) {
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        xfree(side->records[i].values);
+        xfree(side->records[i].value_offsets);
+        xfree(side->records[i].path_offsets);
+        xfree(side->records[i].segments);
+        xfree(side->records[i].key_offsets);
+        xfree(side->records[i].text);
+    }
+    if(side->parser != NULL) {
+        flatjson_free(side->parser);
+    }
+    if(side->fp != NULL && side->fp != stdin) {
+        fclose(side->fp);
+    }
+}
+
+/* compares two files by --diff. returns 1 if they differ like diff(1). */
+int flatj_diff(flatj_context *ctx, char *file_a, char *file_b) {
+    diff_side sides[2];
+    char *files[2];
+    int errcode, i;
+
+    files[0] = file_a;
+    files[1] = file_b;
+    memset(sides, 0, sizeof(sides));
+    for(i = 0; i < 2; i++) {
+        sides[i].filename = files[i];
+        sides[i].fp = strcmp(files[i], "-") == 0 ? open_stdin() : openfile(files[i], "r");
+        if((sides[i].parser = flatjson_new(ctx->expand_escape ? FLATJSON_EXPAND_ESCAPE : 0)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_ERROR);
+        }
+        flatjson_set_file(sides[i].parser, sides[i].fp);
+    }
+    if((errcode = setjmp(ctx->top)) == 0) {
+        if(ctx->diff_key != NULL) {
+            diff_records(ctx, &sides[0], &sides[1]);
+        } else {
+            diff_stream(ctx, &sides[0], &sides[1]);
+        }
+        errcode = ctx->diff_count > 0;
     }
+    free_diff_side(&sides[0]);
+    free_diff_side(&sides[1]);
+    return errcode;
 }
 
 void usage() {
-    fprintf(stderr, "usage: flatj [option] [-E] [-o output] [input]\n");
+    fprintf(stderr, "usage: flatj [option] [-E] [-j jobs] [-o output|directory] [input...]\n");
     fprintf(stderr, "option:\n");
     fprintf(stderr, "-F delimiter\n");
     fprintf(stderr, "-i index-prefix\n");
     fprintf(stderr, "-s string-suffix\n");
+    fprintf(stderr, "--max-nesting depth\n");
+    fprintf(stderr, "--validate-utf8\n");
+    fprintf(stderr, "--filename\n");
+    fprintf(stderr, "--stats\n");
+    fprintf(stderr, "--io-depth depth\n");
+    fprintf(stderr, "--binary\n");
+    fprintf(stderr, "--columnar directory\n");
+    fprintf(stderr, "--csv | --tsv [-c column,...] [--csv-sample records]\n");
+    fprintf(stderr, "--agg function,...:path [--agg group-by:path]\n");
+    fprintf(stderr, "--diff [--diff-key path] A B\n");
+    fprintf(stderr, "--follow file\n");
     exit(EXIT_USAGE);
 }
 
 int main(int argc, char *argv[]) {
-    FILE *input = NULL;
-    int argindex = 1, errcode = 0, argch;
-    char *outfile = NULL;
+    flatj_context *contexts, *ctx;
+    file_pool pool;
+    int argindex = 1, errcode = 0, argch, show_stats = 0, show_filename = 0, jobs = 1, depth, diff = 0, follow = 0, i;
+    char *outfile = NULL, *arg;
+
+    ctx = (flatj_context *)xalloc(sizeof(flatj_context));
 
-    fpout = stdout;
+    init_flatj_context(ctx);
     while(argindex < argc) {
         if(strcmp(argv[argindex], "-o") == 0) {
             if(argindex + 1 >= argc) {
@@ -639,14 +2193,75 @@ int main(int argc, char *argv[]) {
             outfile = argv[argindex + 1];
             argindex += 2;
         } else if((argch = get_ascii_arg(argc, argv, "-F", '\\', usage, &argindex)) >= 0) {
-            separator = (char)argch;
+            ctx->separator = (char)argch;
         } else if((argch = get_ascii_arg(argc, argv, "-i", -1, usage, &argindex)) >= 0) {
-            index_prefix = (char)argch;
+            ctx->index_prefix = (char)argch;
         } else if((argch = get_ascii_optional_arg(argc, argv, "-s", usage, &argindex)) >= -1) {
-            suffix_char = argch;
+            ctx->suffix_char = argch;
         } else if(strcmp(argv[argindex], "-E") == 0) {
-            expand_escape = 1;
+            ctx->expand_escape = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--validate-utf8") == 0) {
+            ctx->validate_utf8 = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--max-nesting") == 0) {
+            if(argindex + 1 >= argc || (ctx->max_nesting = atoi(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--stats") == 0) {
+            show_stats = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--filename") == 0) {
+            show_filename = 1;
+            argindex++;
+        } else if((depth = get_io_depth_arg(argc, argv, usage, &argindex)) >= 0) {
+            set_io_depth(depth);
+        } else if(strcmp(argv[argindex], "-j") == 0) {
+            if(argindex + 1 >= argc || (jobs = atoi(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--binary") == 0) {
+            ctx->print_leaf = print_binary;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--columnar") == 0) {
+            if(argindex + 1 >= argc) {
+                usage();
+            }
+            ctx->columnar_dir = argv[argindex + 1];
+            ctx->print_leaf = print_columnar;
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--csv") == 0 || strcmp(argv[argindex], "--tsv") == 0) {
+            ctx->csv_delimiter = argv[argindex][2] == 'c' ? ',' : '\t';
+            ctx->print_leaf = print_csv;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--csv-sample") == 0) {
+            if(argindex + 1 >= argc || (ctx->csv_sample_size = atol(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--agg") == 0) {
+            if(argindex + 1 >= argc) {
+                usage();
+            }
+            add_aggregate_spec(ctx, argv[argindex + 1], usage);
+            ctx->print_leaf = print_aggregate;
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--diff") == 0) {
+            diff = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--follow") == 0) {
+            follow = 1;
             argindex++;
+        } else if(strcmp(argv[argindex], "--diff-key") == 0) {
+            if(argindex + 1 >= argc) {
+                usage();
+            }
+            ctx->diff_key = argv[argindex + 1];
+            argindex += 2;
+        } else if((arg = get_delimiter_arg(argc, argv, "-c", usage, &argindex)) != NULL) {
+            ctx->csv_column_arg = arg;
         } else if(argv[argindex][0] == '-') {
             usage();
         } else {
@@ -654,24 +2269,84 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if(outfile != NULL) {
-        fpout = openfile(outfile, "w");
+    if(diff) {
+        if(argc - argindex != 2 || ctx->print_leaf != print_stack) {
+            fprintf(stderr, "--diff takes two inputs and prints flat text\n");
+            exit(EXIT_USAGE);
+        } else if(ctx->diff_key != NULL && (ctx->diff_key[0] != ctx->index_prefix || ctx->diff_key[1] != '.')) {
+            fprintf(stderr, "--diff-key takes a path in a record like %c.id\n", ctx->index_prefix);
+            exit(EXIT_USAGE);
+        }
+        ctx->fpout = outfile != NULL ? openfile(outfile, "w") : stdout;
+        errcode = flatj_diff(ctx, argv[argindex], argv[argindex + 1]);
+        if(ctx->fpout != stdout) {
+            fclose(ctx->fpout);
+        }
+        free_flatj_context(ctx);
+        xfree(ctx);
+        return errcode;
     }
-
-    if(argindex == argc) {
-        if((errcode = setjmp(top)) == 0) {
-            parse_json_root(stdin);
+    if(follow) {
+        if(argc - argindex != 1 || ctx->print_leaf != print_stack) {
+            fprintf(stderr, "--follow takes one input and prints flat text\n");
+            exit(EXIT_USAGE);
         }
-    } else {
-        input = openfile(argv[argindex], "r");
-        if((errcode = setjmp(top)) == 0) {
-            parse_json_root(input);
+        ctx->show_filename = show_filename;
+        init_flatj_output(ctx);
+        ctx->fpout = outfile != NULL ? openfile(outfile, "w") : stdout;
+        errcode = flatj_follow(ctx, argv[argindex]);
+        if(ctx->fpout != stdout) {
+            fclose(ctx->fpout);
         }
-        fclose(input);
+        free_flatj_context(ctx);
+        xfree(ctx);
+        return errcode;
     }
-    if(outfile != NULL) {
-        fclose(fpout);
+    init_file_pool(&pool, argv + argindex, argc - argindex);
+    if(pool.count > 1 && ctx->print_leaf == print_columnar) {
+        fprintf(stderr, "--columnar takes one input\n");
+        exit(EXIT_USAGE);
+    } else if(outfile != NULL && is_directory(outfile)) {
+        pool.output_dir = outfile;
+        pool.extension = ".flatj";
+    } else if(pool.count > 1 && ctx->print_leaf != print_stack && ctx->print_leaf != print_binary) {
+        fprintf(stderr, "--csv, --tsv and --agg of many inputs need -o directory\n");
+        exit(EXIT_USAGE);
+    } else if(pool.count > 1 && ctx->print_leaf == print_binary) {
+        fprintf(stderr, "--binary of many inputs needs -o directory\n");
+        exit(EXIT_USAGE);
     }
+    ctx->show_stats = show_stats;
+    ctx->show_filename = show_filename;
+    init_flatj_output(ctx);
+
+    pool.jobs = jobs;
+    pool.process = flatj_process;
+    pool.output = outfile != NULL && pool.output_dir == NULL ? openfile(outfile, "w") : stdout;
+    pool.contexts = (void **)xalloc(jobs * sizeof(void *));
+    contexts = (flatj_context *)xrealloc(ctx, jobs * sizeof(flatj_context));
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            init_flatj_worker(&contexts[i], &contexts[0]);
+        }
+        pool.contexts[i] = &contexts[i];
+    }
+    errcode = run_file_pool(&pool);
+
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            add_stats(&contexts[0].stats, &contexts[i].stats);
+        }
+        free_flatj_context(&contexts[i]);
+    }
+    if(show_stats) {
+        print_stats("flatj", &contexts[0].stats);
+    }
+    if(pool.output != stdout) {
+        fclose(pool.output);
+    }
+    xfree(pool.contexts);
+    xfree(contexts);
+    free_file_pool(&pool);
     return errcode;
 }
-
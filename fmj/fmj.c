@@ -13,61 +13,110 @@
 #include <setjmp.h>
 #include "../common.h"
 
-static FILE *fpout;
-
-int parse_json(FILE *fp);
-
-static jmp_buf top;
-
-void throw() {
-    longjmp(top, EXIT_EXCEPTION);
+typedef struct fmj_context {
+    reader in;
+    writer out;
+    jmp_buf top;
+    int indent;
+    int indent_size;
+    int pretty;
+    /* newline followed by spaces. print_indent() writes the first indent + 1 bytes. */
+    char *indent_buffer;
+    int indent_buffer_size;
+    char *nesting_stack;
+    int nesting_stack_size;
+    int max_nesting;
+    int validate_utf8;
+    utf8_validator utf8;
+    int show_stats;
+    stats stats;
+    /* -m: offset of the verbatim span of the input not written yet, or -1. Then out is span_out. */
+    long long span;
+    int span_colon;
+    writer span_out;
+} fmj_context;
+
+void throw(fmj_context *ctx) {
+    longjmp(ctx->top, EXIT_EXCEPTION);
 }
 
-void writech(int ch) {
-    fprintf(fpout, "%c", ch);
-}
-
-static int indent = 0;
-static int indent_size = 2;
-static int pretty = 1;
-
-void print_indent() {
-    int i;
-
-    if(pretty) {
-        writech('\n');
-        for(i = 0; i < indent; i++) {
-            writech(' ');
+void print_indent(fmj_context *ctx) {
+    if(ctx->pretty) {
+        if(ctx->indent + 1 > ctx->indent_buffer_size) {
+            xfree(ctx->indent_buffer);
+            ctx->indent_buffer_size = (ctx->indent + 1) * 2 + 64;
+            ctx->indent_buffer = (char *)xalloc(ctx->indent_buffer_size);
+            ctx->indent_buffer[0] = '\n';
+            memset(ctx->indent_buffer + 1, ' ', ctx->indent_buffer_size - 1);
         }
+        stats_enter(&ctx->stats, STATS_OUTPUT);
+        write_bytes(&ctx->out, ctx->indent_buffer, ctx->indent + 1);
+        stats_leave(&ctx->stats, STATS_OUTPUT);
+        ctx->stats.lines++;
     }
 }
 
-void indent_right() {
-    indent += indent_size;
+void indent_right(fmj_context *ctx) {
+    ctx->indent += ctx->indent_size;
 }
 
-void indent_left() {
-    if(indent <= 0) {
+void indent_left(fmj_context *ctx) {
+    if(ctx->indent <= 0) {
         fprintf(stderr, "internal error\n");
-        throw();
+        throw(ctx);
     }
-    indent -= indent_size;
+    ctx->indent -= ctx->indent_size;
 }
 
-int nextchar(FILE *fp) {
+int nextchar(reader *in) {
     int ch;
 
-    while((ch = getc(fp)) == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
+    while((ch = read_char(in)) == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
     return ch;
 }
 
-int nextcharline(FILE *fp) {
+int nextcharline(reader *in) {
     int ch;
 
-    while((ch = getc(fp)) == ' ' || ch == '\t' || ch == '\r');
+    while((ch = read_char(in)) == ' ' || ch == '\t' || ch == '\r');
     return ch;
 }
 
+/* copies characters which need no check in a string until '"', '\\' or control character. */
+void copy_string_run(fmj_context *ctx, reader *in) {
+    size_t length = ctx->validate_utf8 ? string_run_utf8(&ctx->utf8, in->ptr, in->end) : string_run(in->ptr, in->end);
+
+    write_bytes(&ctx->out, in->ptr, length);
+    in->ptr += length;
+}
+
+/* validates the bytes of a string before '"' or an escape sequence, which break a UTF-8 sequence. */
+void check_utf8(fmj_context *ctx) {
+    if(ctx->validate_utf8 && !end_utf8(&ctx->utf8)) {
+        fprintf(stderr, "invalid UTF-8\n");
+        throw(ctx);
+    }
+}
+
+void copy_string_char(fmj_context *ctx, int ch) {
+    char byte = (char)ch;
+
+    write_char(&ctx->out, ch);
+    if(ctx->validate_utf8) {
+        feed_utf8(&ctx->utf8, &byte, 1);
+    }
+}
+
+void copy_digit_run(fmj_context *ctx, reader *in) {
+    char *start = in->ptr, *ptr = in->ptr;
+
+    while(ptr < in->end && isdigit((unsigned char)*ptr)) {
+        ptr++;
+    }
+    write_bytes(&ctx->out, start, ptr - start);
+    in->ptr = ptr;
+}
+
 enum state_parse_string {
     PARSE_STRING_INIT,
     PARSE_STRING_STRING,
@@ -75,25 +124,26 @@ enum state_parse_string {
     PARSE_STRING_CODEPOINT
 };
 
-int parse_string(FILE *fp) {
+int parse_string(fmj_context *ctx, reader *in) {
     enum state_parse_string state = PARSE_STRING_INIT;
     int ch, codepoint, codepoint_count, surrogate = 0;
 
-    ch = nextchar(fp);
-    ungetc(ch, fp);
+    ch = nextchar(in);
+    unread_char(in, ch);
     while(1) {
-        if((ch = getc(fp)) == EOF) {
+        if((ch = read_char(in)) == EOF) {
             fprintf(stderr, "unexpected EOF\n");
-            throw();
+            throw(ctx);
         }
 
         switch(state) {
         case PARSE_STRING_INIT:
             if(ch == '\"') {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_string_run(ctx, in);
                 state = PARSE_STRING_STRING;
             } else {
-                ungetc(ch, fp);
+                unread_char(in, ch);
                 return 0;
             }
             break;
@@ -101,47 +151,50 @@ int parse_string(FILE *fp) {
         case PARSE_STRING_STRING:
             if(ch != '\\' && surrogate) {
                 fprintf(stderr, "invalid surrogate pair\n");
-                throw();
+                throw(ctx);
             }
             if(ch == '\"') {
                 if(surrogate) {
                     fprintf(stderr, "invalid surrogate pair\n");
-                    throw();
+                    throw(ctx);
                 }
-                writech(ch);
+                check_utf8(ctx);
+                write_char(&ctx->out, ch);
                 return 1;
             } else if(ch == '\\') {
+                check_utf8(ctx);
+                stats_enter(&ctx->stats, STATS_ESCAPE);
                 state = PARSE_STRING_BACKSLASH;
             } else if(ch >= 0x20) {
-                writech(ch);
+                copy_string_char(ctx, ch);
+                copy_string_run(ctx, in);
             }
             break;
 
         case PARSE_STRING_BACKSLASH:
             if(ch != 'u' && surrogate) {
                 fprintf(stderr, "invalid surrogate pair\n");
-                throw();
+                throw(ctx);
             }
             switch(ch) {
-            case '\"':  case '/':
-                writech(ch);
-                state = PARSE_STRING_STRING;
-                break;
+            case '\"': case '/':
             case '\\': case 'b': case 'f': case 'n': case 'r': case 't':
-                writech('\\');
-                writech(ch);
+                write_char(&ctx->out, '\\');
+                write_char(&ctx->out, ch);
+                stats_leave(&ctx->stats, STATS_ESCAPE);
                 state = PARSE_STRING_STRING;
+                copy_string_run(ctx, in);
                 break;
             case 'u':
                 codepoint = 0;
                 codepoint_count = 0;
-                writech('\\');
-                writech(ch);
+                write_char(&ctx->out, '\\');
+                write_char(&ctx->out, ch);
                 state = PARSE_STRING_CODEPOINT;
                 break;
             default:
                 fprintf(stderr, "invalid escape sequence\n");
-                throw();
+                throw(ctx);
                 break;
             }
             break;
@@ -156,9 +209,9 @@ int parse_string(FILE *fp) {
                     codepoint = (codepoint << 4) + ((ch - 'a') + 10);
                 } else {
                     fprintf(stderr, "invalid escape sequence\n");
-                    throw();
+                    throw(ctx);
                 }
-                writech(ch);
+                write_char(&ctx->out, ch);
                 codepoint_count++;
             } else {
                 if(surrogate) {
@@ -166,20 +219,21 @@ int parse_string(FILE *fp) {
                         surrogate = 0;
                     } else {
                         fprintf(stderr, "invalid surrogate pair\n");
-                        throw();
+                        throw(ctx);
                     }
                 } else {
                     if(codepoint >= 0xD800 && codepoint <= 0xDCFF) {
                         surrogate = codepoint;
                     }
                 }
-                ungetc(ch, fp);
+                unread_char(in, ch);
+                stats_leave(&ctx->stats, STATS_ESCAPE);
                 state = PARSE_STRING_STRING;
             }
         }
     }
     fprintf(stderr, "internal error\n");
-    throw();
+    throw(ctx);
     return 0;
 }
 
@@ -195,52 +249,55 @@ enum state_parse_number {
     PARSE_NUMBER_EXPONENT_NUMBER
 };
 
-int parse_number(FILE *fp) {
+int parse_number(fmj_context *ctx, reader *in) {
     enum state_parse_number state = PARSE_NUMBER_INIT;
     int ch;
 
-    ch = nextchar(fp);
-    ungetc(ch, fp);
+    ch = nextchar(in);
+    unread_char(in, ch);
     while(1) {
-        ch = getc(fp);
+        ch = read_char(in);
         switch(state) {
         case PARSE_NUMBER_INIT:
             if(ch == '0') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_AFTER_ZERO;
             } else if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
                 state = PARSE_NUMBER_NUMBER;
             } else if(ch == '-') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_NUMBER_START;
             } else {
-                ungetc(ch, fp);
+                unread_char(in, ch);
                 return 0;
             }
             break;
 
         case PARSE_NUMBER_NUMBER_START:
             if(ch == '0') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_AFTER_ZERO;
             } else if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
                 state = PARSE_NUMBER_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_NUMBER:
             if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
             } else if(ch == '.') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_POINT_START;
             } else if(ch == 'e' || ch == 'E') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -249,10 +306,10 @@ int parse_number(FILE *fp) {
 
         case PARSE_NUMBER_AFTER_ZERO:
             if(ch == '.') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_POINT_START;
             } else if(ch == 'e' || ch == 'E') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -261,19 +318,21 @@ int parse_number(FILE *fp) {
 
         case PARSE_NUMBER_POINT_START:
             if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
                 state = PARSE_NUMBER_POINT;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_POINT:
             if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
             } else if(ch == 'e' || ch == 'E') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_EXPONENT;
             } else {
                 goto matched;
@@ -284,30 +343,33 @@ int parse_number(FILE *fp) {
             if(ch == '+') {
                 state = PARSE_NUMBER_EXPONENT_NUMBER_START;
             } else if(ch == '-') {
-                writech(ch);
+                write_char(&ctx->out, ch);
                 state = PARSE_NUMBER_EXPONENT_NUMBER_START;
             } else if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
                 state = PARSE_NUMBER_EXPONENT_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_EXPONENT_NUMBER_START:
             if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
                 state = PARSE_NUMBER_EXPONENT_NUMBER;
             } else {
                 fprintf(stderr, "invalid number\n");
-                throw();
+                throw(ctx);
             }
             break;
 
         case PARSE_NUMBER_EXPONENT_NUMBER:
             if(isdigit(ch)) {
-                writech(ch);
+                write_char(&ctx->out, ch);
+                copy_digit_run(ctx, in);
             } else {
                 goto matched;
             }
@@ -315,36 +377,36 @@ int parse_number(FILE *fp) {
 
         default:
             fprintf(stderr, "internal error\n");
-            throw();
+            throw(ctx);
             break;
         }
     }
     fprintf(stderr, "internal error\n");
-    throw();
+    throw(ctx);
     return 0;
 
     matched:
-    ungetc(ch, fp);
+    unread_char(in, ch);
     return 1;
 }
 
-int parse_literal(FILE *fp) {
+int parse_literal(fmj_context *ctx, reader *in) {
     int ch;
     char buf[10], *ptr = buf;
 
-    ch = nextchar(fp);
-    ungetc(ch, fp);
+    ch = nextchar(in);
+    unread_char(in, ch);
     while(1) {
-        if(isalpha(ch = getc(fp))) {
-            writech(ch);
+        if(isalpha(ch = read_char(in))) {
+            write_char(&ctx->out, ch);
             *ptr++ = ch;
             if(ptr - buf > 5) {
                 fprintf(stderr, "invalid literal\n");
-                throw();
+                throw(ctx);
                 return 0;
             }
         } else {
-            ungetc(ch, fp);
+            unread_char(in, ch);
             break;
         }
     }
@@ -354,215 +416,622 @@ int parse_literal(FILE *fp) {
         return 1;
     } else {
         fprintf(stderr, "invalid literal\n");
-        throw();
+        throw(ctx);
         return 0;
     }
 }
 
-enum state_parse_object {
-    PARSE_OBJECT_INIT,
-    PARSE_OBJECT_KEY_INIT,
-    PARSE_OBJECT_KEY,
-    PARSE_OBJECT_NEXT,
-    PARSE_OBJECT_RESULT
-};
+/*
+ * The closing bracket of each object or array which is not closed yet is kept in nesting_stack
+ * instead of recursion, so deep nesting does not overflow the C stack.
+ */
+void push_nesting(fmj_context *ctx, int depth, int ch) {
+    if(ctx->max_nesting > 0 && depth >= ctx->max_nesting) {
+        fprintf(stderr, "nesting too deep\n");
+        throw(ctx);
+    }
+    if(depth >= ctx->nesting_stack_size) {
+        ctx->nesting_stack_size = ctx->nesting_stack_size * 2 + 64;
+        ctx->nesting_stack = (char *)xrealloc(ctx->nesting_stack, ctx->nesting_stack_size);
+    }
+    ctx->nesting_stack[depth] = ch;
+    count_depth(&ctx->stats, depth + 1);
+}
 
-int parse_object(FILE *fp) {
-    enum state_parse_object state = PARSE_OBJECT_INIT;
+void parse_member_key(fmj_context *ctx, reader *in) {
     int ch;
-    char *str;
 
-    while(1) {
-        if((ch = nextchar(fp)) == EOF) {
-            fprintf(stderr, "unexpected EOF\n");
-            throw();
-        }
+    if(!parse_string(ctx, in)) {
+        fprintf(stderr, "string needed\n");
+        throw(ctx);
+    }
+    count_token(&ctx->stats, STATS_KEY);
+    if((ch = nextchar(in)) == EOF) {
+        fprintf(stderr, "unexpected EOF\n");
+        throw(ctx);
+    } else if(ch != ':') {
+        fprintf(stderr, "comma needed\n");
+        throw(ctx);
+    }
+    write_char(&ctx->out, ch);
+    write_char(&ctx->out, ' ');
+}
+
+enum state_parse_json {
+    PARSE_JSON_VALUE,
+    PARSE_JSON_END
+};
 
+void parse_json_root(fmj_context *ctx, reader *in) {
+    enum state_parse_json state = PARSE_JSON_VALUE;
+    int ch, close, depth = 0;
+
+    while(1) {
         switch(state) {
-        case PARSE_OBJECT_INIT:
-            if(ch == '{') {
-                writech(ch);
-                state = PARSE_OBJECT_KEY_INIT;
+        case PARSE_JSON_VALUE:
+            if((ch = nextchar(in)) == EOF) {
+                fprintf(stderr, "unexpected EOF\n");
+                throw(ctx);
+            } else if(ch == '{' || ch == '[') {
+                count_token(&ctx->stats, ch == '{' ? STATS_OBJECT : STATS_ARRAY);
+                write_char(&ctx->out, ch);
+                close = ch == '{' ? '}' : ']';
+                if((ch = nextchar(in)) == close) {
+                    write_char(&ctx->out, ch);
+                    state = PARSE_JSON_END;
+                } else {
+                    unread_char(in, ch);
+                    push_nesting(ctx, depth++, close);
+                    indent_right(ctx);
+                    print_indent(ctx);
+                    if(close == '}') {
+                        parse_member_key(ctx, in);
+                    }
+                }
             } else {
-                ungetc(ch, fp);
-                return 0;
+                unread_char(in, ch);
+                if(parse_string(ctx, in)) {
+                    count_token(&ctx->stats, STATS_STRING);
+                } else if(parse_number(ctx, in)) {
+                    count_token(&ctx->stats, STATS_NUMBER);
+                } else if(parse_literal(ctx, in)) {
+                    count_token(&ctx->stats, STATS_LITERAL);
+                } else {
+                    fprintf(stderr, "invalid JSON\n");
+                    throw(ctx);
+                }
+                state = PARSE_JSON_END;
             }
             break;
 
-        case PARSE_OBJECT_KEY_INIT:
-            if(ch == '}') {
-                writech(ch);
-                return 1;
-            } else {
-                indent_right();
-                print_indent();
-                ungetc(ch, fp);
-                if(parse_string(fp)) {
-                    state = PARSE_OBJECT_NEXT;
-                } else {
-                    fprintf(stderr, "string needed\n");
-                    throw();
+        case PARSE_JSON_END:
+            if(depth == 0) {
+                if(nextchar(in) != EOF) {
+                    fprintf(stderr, "unexpected EOF\n");
+                    throw(ctx);
+                }
+                return;
+            }
+            if((ch = nextchar(in)) == EOF) {
+                fprintf(stderr, "unexpected EOF\n");
+                throw(ctx);
+            } else if(ch == ',') {
+                write_char(&ctx->out, ch);
+                print_indent(ctx);
+                if(ctx->nesting_stack[depth - 1] == '}') {
+                    parse_member_key(ctx, in);
                 }
+                state = PARSE_JSON_VALUE;
+            } else if(ch == ctx->nesting_stack[depth - 1]) {
+                indent_left(ctx);
+                print_indent(ctx);
+                write_char(&ctx->out, ch);
+                depth--;
+            } else if(ctx->nesting_stack[depth - 1] == ']') {
+                fprintf(stderr, "invalid array\n");
+                throw(ctx);
             }
             break;
 
-        case PARSE_OBJECT_KEY:
-            ungetc(ch, fp);
-            if(parse_string(fp)) {
-                state = PARSE_OBJECT_NEXT;
-            } else {
-                fprintf(stderr, "string needed\n");
-                throw();
-            }
+        default:
+            fprintf(stderr, "internal error\n");
+            throw(ctx);
             break;
+        }
+    }
+}
 
-        case PARSE_OBJECT_NEXT:
-            if(ch == ':') {
-                writech(ch);
-                writech(' ');
-                parse_json(fp);
-                state = PARSE_OBJECT_RESULT;
-            } else {
-                fprintf(stderr, "comma needed\n");
-                throw();
+/*
+ * minifier for -m
+ *
+ * Whitespace appears only between tokens, so minifying is skipping whitespace runs
+ * and copying token runs. Both runs are found 16 bytes at a time by whitespace_run()
+ * and string_run(). Nesting is kept in nesting_stack as parse_json_root() does.
+ */
+enum state_minify {
+    MINIFY_VALUE,
+    MINIFY_ARRAY_FIRST,
+    MINIFY_OBJECT_FIRST,
+    MINIFY_KEY,
+    MINIFY_COLON,
+    MINIFY_NEXT
+};
+
+int minify_nextchar(reader *in) {
+    while(1) {
+        in->ptr += whitespace_run(in->ptr, in->end);
+        if(in->ptr < in->end) {
+            return (unsigned char)*in->ptr++;
+        } else if(fill_reader(in) == 0) {
+            return EOF;
+        }
+    }
+}
+
+/*
+ * The output of -m is the input without whitespace and plus signs of exponents, with a space after
+ * each colon. If the input is seekable and the output has a file descriptor, the minifier writes to
+ * a writer without file, and the output is made of the spans of the input between the changes,
+ * which write_span() copies in the kernel if they are long. A span ends at the bytes discarded
+ * since it started, so the output stops at an error where the minifier stops.
+ * Spans are given up after a short one, since the input is not minified then.
+ */
+#define MIN_SPAN_LENGTH BLOCK_SIZE
+
+void start_spans(fmj_context *ctx, reader *in) {
+    writer out = ctx->out;
+
+    ctx->span = -1;
+    if(ctx->pretty || !seekable_reader(in) || fileno(ctx->out.fp) < 0) {
+        return;
+    }
+    ctx->out = ctx->span_out;
+    ctx->span_out = out;
+    init_writer(&ctx->out, NULL);
+    ctx->span = reader_offset(in);
+    ctx->span_colon = 0;
+}
+
+/* writes the span up to end. The next span starts at next, or the minifier writes after a short span. */
+void flush_span(fmj_context *ctx, reader *in, long long end, long long next) {
+    writer out = ctx->out;
+
+    if(!write_span(in, ctx->span, end, &ctx->span_out)) {
+        fprintf(stderr, "cannot read input\n");
+        throw(ctx);
+    }
+    if(end > ctx->span && end - ctx->span < MIN_SPAN_LENGTH) {
+        ctx->out = ctx->span_out;
+        ctx->span_out = out;
+        ctx->span = -1;
+        return;
+    }
+    ctx->span = next;
+    ctx->out.ptr = ctx->out.buffer;
+    ctx->out.discarded = 0;
+}
+
+/* writes the last span and restores the writer. returns 0 if the input cannot be read again. */
+int end_spans(fmj_context *ctx, reader *in) {
+    writer out = ctx->out;
+    int done;
+
+    if(ctx->span < 0) {
+        return 1;
+    }
+    done = write_span(in, ctx->span, ctx->span + ctx->out.discarded + (ctx->out.ptr - ctx->out.buffer), &ctx->span_out);
+    ctx->out = ctx->span_out;
+    ctx->span_out = out;
+    ctx->span = -1;
+    return done;
+}
+
+/* minify_nextchar() which ends the span at whitespace unless it is the space after a colon */
+int minify_span_nextchar(fmj_context *ctx, reader *in) {
+    long long start, end;
+    int first, ch, skip = ctx->span_colon;
+
+    /* the next token follows at once, or after the space written after a colon */
+    if(in->end - in->ptr > skip && (!skip || in->ptr[0] == ' ')) {
+        ch = (unsigned char)in->ptr[skip];
+        if(ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') {
+            in->ptr += skip + 1;
+            ctx->span_colon = 0;
+            return ch;
+        }
+    }
+    if(in->ptr == in->end) {
+        fill_reader(in);
+    }
+    start = reader_offset(in);
+    first = in->ptr < in->end ? (unsigned char)*in->ptr : EOF;
+    ch = minify_nextchar(in);
+    end = reader_offset(in) - (ch != EOF);
+    if(ctx->span_colon) {
+        ctx->span_colon = 0;
+        if(end > start && first == ' ') {
+            start++;
+        } else {
+            flush_span(ctx, in, start, start);
+            write_char(ctx->span >= 0 ? &ctx->span_out : &ctx->out, ' ');
+        }
+    }
+    if(end > start && ctx->span >= 0) {
+        flush_span(ctx, in, start, end);
+    }
+    return ch;
+}
+
+int hex_digit(fmj_context *ctx, int ch) {
+    if(isdigit(ch)) {
+        return ch - '0';
+    } else if(ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    } else if(ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else {
+        fprintf(stderr, "invalid escape sequence\n");
+        throw(ctx);
+        return 0;
+    }
+}
+
+void minify_string(fmj_context *ctx, reader *in) {
+    int ch, i, codepoint, surrogate = 0;
+    size_t length;
+
+    write_char(&ctx->out, '\"');
+    while(1) {
+        length = ctx->validate_utf8 ? string_run_utf8(&ctx->utf8, in->ptr, in->end) : string_run(in->ptr, in->end);
+        if(length > 0) {
+            if(surrogate) {
+                fprintf(stderr, "invalid surrogate pair\n");
+                throw(ctx);
             }
-            break;
+            write_bytes(&ctx->out, in->ptr, length);
+            in->ptr += length;
+        }
 
-        case PARSE_OBJECT_RESULT:
-            if(ch == ',') {
-                writech(ch);
-                print_indent();
-                state = PARSE_OBJECT_KEY;
-            } else if(ch == '}') {
-                indent_left();
-                print_indent();
-                writech(ch);
-                return 1;
+        if((ch = read_char(in)) == EOF) {
+            fprintf(stderr, "unexpected EOF\n");
+            throw(ctx);
+        }
+
+        if(ch == '\"') {
+            if(surrogate) {
+                fprintf(stderr, "invalid surrogate pair\n");
+                throw(ctx);
             }
-            break;
+            check_utf8(ctx);
+            write_char(&ctx->out, ch);
+            return;
+        } else if(ch != '\\') {
+            if(ch >= 0x20) {
+                /* the rest of a run split by the end of block */
+                if(surrogate) {
+                    fprintf(stderr, "invalid surrogate pair\n");
+                    throw(ctx);
+                }
+                copy_string_char(ctx, ch);
+            }
+            continue;
+        }
+        check_utf8(ctx);
 
+        stats_enter(&ctx->stats, STATS_ESCAPE);
+        if((ch = read_char(in)) != 'u' && surrogate) {
+            fprintf(stderr, "invalid surrogate pair\n");
+            throw(ctx);
+        }
+        switch(ch) {
+        case '\"': case '/': case '\\': case 'b': case 'f': case 'n': case 'r': case 't':
+            write_char(&ctx->out, '\\');
+            write_char(&ctx->out, ch);
+            break;
+        case 'u':
+            write_char(&ctx->out, '\\');
+            write_char(&ctx->out, ch);
+            for(i = 0, codepoint = 0; i < 4; i++) {
+                ch = read_char(in);
+                codepoint = (codepoint << 4) + hex_digit(ctx, ch);
+                write_char(&ctx->out, ch);
+            }
+            if(surrogate) {
+                if(codepoint < 0xDC00 || codepoint > 0xDFFF) {
+                    fprintf(stderr, "invalid surrogate pair\n");
+                    throw(ctx);
+                }
+                surrogate = 0;
+            } else if(codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                surrogate = codepoint;
+            }
+            break;
+        case EOF:
+            fprintf(stderr, "unexpected EOF\n");
+            throw(ctx);
+            break;
         default:
-            fprintf(stderr, "internal error\n");
-            throw();
+            fprintf(stderr, "invalid escape sequence\n");
+            throw(ctx);
             break;
         }
+        stats_leave(&ctx->stats, STATS_ESCAPE);
     }
-    fprintf(stderr, "internal error\n");
-    throw();
-    return 0;
 }
 
-enum state_parse_array {
-    PARSE_ARRAY_INIT,
-    PARSE_ARRAY_LIST_INIT,
-    PARSE_ARRAY_LIST,
-    PARSE_ARRAY_RESULT
-};
+void minify_digits(fmj_context *ctx, reader *in, int required) {
+    int ch;
 
-int parse_array(FILE *fp) {
-    enum state_parse_array state = PARSE_ARRAY_INIT;
-    int ch, index = 0;
+    if(!isdigit(ch = read_char(in))) {
+        if(required) {
+            fprintf(stderr, "invalid number\n");
+            throw(ctx);
+        }
+        unread_char(in, ch);
+        return;
+    }
+    write_char(&ctx->out, ch);
+    do {
+        copy_digit_run(ctx, in);
+    } while(in->ptr == in->end && fill_reader(in) > 0);
+}
+
+void minify_number(fmj_context *ctx, reader *in, int ch) {
+    if(ch == '-') {
+        write_char(&ctx->out, ch);
+        ch = read_char(in);
+    }
+    if(ch == '0') {
+        write_char(&ctx->out, ch);
+    } else if(isdigit(ch)) {
+        write_char(&ctx->out, ch);
+        minify_digits(ctx, in, 0);
+    } else {
+        fprintf(stderr, "invalid number\n");
+        throw(ctx);
+    }
+
+    if((ch = read_char(in)) == '.') {
+        write_char(&ctx->out, ch);
+        minify_digits(ctx, in, 1);
+        ch = read_char(in);
+    }
+    if(ch == 'e' || ch == 'E') {
+        write_char(&ctx->out, ch);
+        if((ch = read_char(in)) == '-') {
+            write_char(&ctx->out, ch);
+        } else if(ch != '+') {
+            unread_char(in, ch);
+        } else if(ctx->span >= 0) {
+            flush_span(ctx, in, reader_offset(in) - 1, reader_offset(in));
+        }
+        minify_digits(ctx, in, 1);
+    } else {
+        unread_char(in, ch);
+    }
+}
+
+void minify_literal(fmj_context *ctx, reader *in, int ch) {
+    char buf[8];
+    int length = 0;
+
+    do {
+        if(length >= 6) {
+            fprintf(stderr, "invalid literal\n");
+            throw(ctx);
+        }
+        buf[length++] = ch;
+    } while(isalpha(ch = read_char(in)));
+    unread_char(in, ch);
+    buf[length] = '\0';
+
+    if(strcmp(buf, "null") == 0 || strcmp(buf, "true") == 0 || strcmp(buf, "false") == 0) {
+        write_bytes(&ctx->out, buf, length);
+    } else {
+        fprintf(stderr, "invalid literal\n");
+        throw(ctx);
+    }
+}
+
+void minify_json_root(fmj_context *ctx, reader *in) {
+    enum state_minify state = MINIFY_VALUE;
+    int ch, depth = 0;
 
     while(1) {
-        if((ch = nextchar(fp)) == EOF) {
+        ch = ctx->span >= 0 ? minify_span_nextchar(ctx, in) : minify_nextchar(in);
+        if(ch == EOF && !(state == MINIFY_NEXT && depth == 0)) {
             fprintf(stderr, "unexpected EOF\n");
-            throw();
+            throw(ctx);
         }
 
         switch(state) {
-        case PARSE_ARRAY_INIT:
-            if(ch == '[') {
-                writech(ch);
-                state = PARSE_ARRAY_LIST_INIT;
+        case MINIFY_ARRAY_FIRST:
+            if(ch == ']') {
+                write_char(&ctx->out, ch);
+                depth--;
+                state = MINIFY_NEXT;
+                break;
+            }
+            /* FALLTHROUGH */
+        case MINIFY_VALUE:
+            if(ch == '{' || ch == '[') {
+                count_token(&ctx->stats, ch == '{' ? STATS_OBJECT : STATS_ARRAY);
+                push_nesting(ctx, depth++, ch == '{' ? '}' : ']');
+                write_char(&ctx->out, ch);
+                state = ch == '{' ? MINIFY_OBJECT_FIRST : MINIFY_ARRAY_FIRST;
+            } else if(ch == '\"') {
+                count_token(&ctx->stats, STATS_STRING);
+                minify_string(ctx, in);
+                state = MINIFY_NEXT;
+            } else if(ch == '-' || isdigit(ch)) {
+                count_token(&ctx->stats, STATS_NUMBER);
+                minify_number(ctx, in, ch);
+                state = MINIFY_NEXT;
+            } else if(isalpha(ch)) {
+                count_token(&ctx->stats, STATS_LITERAL);
+                minify_literal(ctx, in, ch);
+                state = MINIFY_NEXT;
             } else {
-                ungetc(ch, fp);
-                return 0;
+                fprintf(stderr, "invalid JSON\n");
+                throw(ctx);
             }
             break;
 
-        case PARSE_ARRAY_LIST_INIT:
-            if(ch == ']') {
-                writech(ch);
-                return 1;
+        case MINIFY_OBJECT_FIRST:
+            if(ch == '}') {
+                write_char(&ctx->out, ch);
+                depth--;
+                state = MINIFY_NEXT;
+                break;
+            }
+            /* FALLTHROUGH */
+        case MINIFY_KEY:
+            if(ch == '\"') {
+                count_token(&ctx->stats, STATS_KEY);
+                minify_string(ctx, in);
+                state = MINIFY_COLON;
             } else {
-                indent_right();
-                print_indent();
-                ungetc(ch, fp);
-                parse_json(fp);
-                state = PARSE_ARRAY_RESULT;
+                fprintf(stderr, "string needed\n");
+                throw(ctx);
             }
             break;
 
-        case PARSE_ARRAY_LIST:
-            ungetc(ch, fp);
-            parse_json(fp);
-            state = PARSE_ARRAY_RESULT;
-            break;
-
-        case PARSE_ARRAY_RESULT:
-            if(ch == ',') {
-                writech(ch);
-                print_indent();
-                state = PARSE_ARRAY_LIST;
-            } else if(ch == ']') {
-                indent_left();
-                print_indent();
-                writech(ch);
-                return 1;
+        case MINIFY_COLON:
+            if(ch == ':') {
+                write_char(&ctx->out, ch);
+                write_char(&ctx->out, ' ');
+                ctx->span_colon = 1;
+                state = MINIFY_VALUE;
             } else {
-                fprintf(stderr, "invalid array\n");
-                throw();
+                fprintf(stderr, "comma needed\n");
+                throw(ctx);
             }
             break;
 
-        default:
-            fprintf(stderr, "internal error\n");
-            throw();
+        case MINIFY_NEXT:
+            if(depth == 0) {
+                if(ch != EOF) {
+                    fprintf(stderr, "unexpected EOF\n");
+                    throw(ctx);
+                }
+                return;
+            } else if(ch == ',') {
+                write_char(&ctx->out, ch);
+                state = ctx->nesting_stack[depth - 1] == '}' ? MINIFY_KEY : MINIFY_VALUE;
+            } else if(ch == ctx->nesting_stack[depth - 1]) {
+                write_char(&ctx->out, ch);
+                depth--;
+            } else {
+                fprintf(stderr, ctx->nesting_stack[depth - 1] == '}' ? "invalid object\n" : "invalid array\n");
+                throw(ctx);
+            }
             break;
         }
     }
-    fprintf(stderr, "internal error\n");
-    throw();
-    return 0;
 }
 
-int parse_json(FILE *fp) {
-    char *result;
+void init_fmj_context(fmj_context *ctx) {
+    memset(ctx, 0, sizeof(fmj_context));
+    ctx->indent_size = 2;
+    ctx->pretty = 1;
+    init_utf8_validator(&ctx->utf8);
+}
 
-    if(parse_object(fp)) {
-        /* ok */
-    } else if(parse_array(fp)) {
-        /* ok */
-    } else if(parse_string(fp) || parse_number(fp) || parse_literal(fp)) {
-        /* ok */
-    } else {
-        fprintf(stderr, "invalid JSON\n");
-        throw();
+void free_fmj_context(fmj_context *ctx) {
+    xfree(ctx->in.buffer);
+    xfree(ctx->out.buffer);
+    xfree(ctx->span_out.buffer);
+    xfree(ctx->indent_buffer);
+    xfree(ctx->nesting_stack);
+}
+
+/* initializes the context of another worker by the options of ctx. Nothing on the heap is shared. */
+void init_fmj_worker(fmj_context *worker, fmj_context *ctx) {
+    memcpy(worker, ctx, sizeof(fmj_context));
+    memset(&worker->in, 0, sizeof(reader));
+    memset(&worker->out, 0, sizeof(writer));
+    memset(&worker->span_out, 0, sizeof(writer));
+    memset(&worker->stats, 0, sizeof(stats));
+    worker->indent_buffer = NULL;
+    worker->indent_buffer_size = 0;
+    worker->nesting_stack = NULL;
+    worker->nesting_stack_size = 0;
+}
+
+int fmj_input(fmj_context *ctx, reader *in) {
+    int errcode;
+
+    ctx->indent = 0;
+    stats_enter(&ctx->stats, STATS_TOTAL);
+    start_spans(ctx, in);
+    if((errcode = setjmp(ctx->top)) == 0) {
+        ctx->pretty ? parse_json_root(ctx, in) : minify_json_root(ctx, in);
     }
-    return 1;
+    if(!end_spans(ctx, in) && errcode == 0) {
+        fprintf(stderr, "cannot read input\n");
+        errcode = EXIT_EXCEPTION;
+    }
+    stats_leave(&ctx->stats, STATS_TOTAL);
+    write_char(&ctx->out, '\n');
+    ctx->stats.lines++;
+    return errcode;
 }
 
-void parse_json_root(FILE *fp) {
-    int ch;
+/* process() of the file pool. The buffers of the context are reused for the next file. */
+int fmj_process(void *context, char *filename, FILE *input, FILE *output) {
+    fmj_context *ctx = (fmj_context *)context;
+    FILE *fp = ctx->show_stats ? stats_file(input, 0, &ctx->stats) : input;
+    int errcode;
+
+    (void)filename;
+    init_writer(&ctx->out, ctx->show_stats ? stats_file(output, 1, &ctx->stats) : output);
+    init_reader(&ctx->in, fp);
+    errcode = fmj_input(ctx, &ctx->in);
+    flush_writer(&ctx->out);
+    if(ctx->show_stats) {
+        fclose(fp);
+        fclose(ctx->out.fp);
+    }
+    end_utf8(&ctx->utf8);
+    return errcode;
+}
 
-    parse_json(fp);
-    if((ch = nextchar(fp)) != EOF) {
-        fprintf(stderr, "unexpected EOF\n");
-        throw();
+/*
+ * --follow formats records of JSON Lines as they are appended to a file.
+ * follow_file() ends each line by EOF, so a record is parsed as a document,
+ * which waits in the middle of a line until the rest is written.
+ * An invalid record is reported and skipped. The output is flushed after each record.
+ */
+int fmj_follow(fmj_context *ctx, char *filename, FILE *output) {
+    FILE *fp = follow_file(filename);
+
+    init_writer(&ctx->out, output);
+    while(next_follow_record(fp)) {
+        init_reader(&ctx->in, fp);
+        fmj_input(ctx, &ctx->in);
+        flush_writer(&ctx->out);
+        fflush(output);
+        end_utf8(&ctx->utf8);
     }
+    fprintf(stderr, "cannot read file %s\n", filename);
+    fclose(fp);
+    return EXIT_EXCEPTION;
 }
 
 void usage() {
-    fprintf(stderr, "usage: fmj [-m] [-o output] [input]\n");
+    fprintf(stderr, "usage: fmj [-m] [--max-nesting depth] [--validate-utf8] [--stats] [--io-depth depth] [-j jobs] [-o output|directory] [input...|--follow file]\n");
     exit(EXIT_USAGE);
 }
 
 int main(int argc, char *argv[]) {
-    FILE *input = NULL;
-    int argindex = 1, errcode = 0, argch;
+    fmj_context *contexts, *ctx;
+    file_pool pool;
+    int argindex = 1, errcode = 0, show_stats = 0, jobs = 1, depth, follow = 0, i;
     char *outfile = NULL;
+    FILE *output;
 
-    fpout = stdout;
+    ctx = (fmj_context *)xalloc(sizeof(fmj_context));
+    init_fmj_context(ctx);
     while(argindex < argc) {
         if(strcmp(argv[argindex], "-o") == 0) {
             if(argindex + 1 >= argc) {
@@ -571,8 +1040,29 @@ int main(int argc, char *argv[]) {
             outfile = argv[argindex + 1];
             argindex += 2;
         } else if(strcmp(argv[argindex], "-m") == 0) {
-            pretty = 0;
+            ctx->pretty = 0;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--max-nesting") == 0) {
+            if(argindex + 1 >= argc || (ctx->max_nesting = atoi(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
+        } else if(strcmp(argv[argindex], "--validate-utf8") == 0) {
+            ctx->validate_utf8 = 1;
+            argindex++;
+        } else if(strcmp(argv[argindex], "--stats") == 0) {
+            show_stats = 1;
             argindex++;
+        } else if(strcmp(argv[argindex], "--follow") == 0) {
+            follow = 1;
+            argindex++;
+        } else if((depth = get_io_depth_arg(argc, argv, usage, &argindex)) >= 0) {
+            set_io_depth(depth);
+        } else if(strcmp(argv[argindex], "-j") == 0) {
+            if(argindex + 1 >= argc || (jobs = atoi(argv[argindex + 1])) <= 0) {
+                usage();
+            }
+            argindex += 2;
         } else if(argv[argindex][0] == '-') {
             usage();
         } else {
@@ -580,25 +1070,54 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if(outfile != NULL) {
-        fpout = openfile(outfile, "w");
+    if(follow) {
+        if(argc - argindex != 1) {
+            fprintf(stderr, "--follow takes one input\n");
+            exit(EXIT_USAGE);
+        }
+        output = outfile != NULL ? openfile(outfile, "w") : stdout;
+        errcode = fmj_follow(ctx, argv[argindex], output);
+        if(output != stdout) {
+            fclose(output);
+        }
+        free_fmj_context(ctx);
+        xfree(ctx);
+        return errcode;
     }
-
-    if(argindex == argc) {
-        if((errcode = setjmp(top)) == 0) {
-            parse_json_root(stdin);
+    init_file_pool(&pool, argv + argindex, argc - argindex);
+    if(outfile != NULL && is_directory(outfile)) {
+        pool.output_dir = outfile;
+        pool.extension = ".json";
+    }
+    ctx->show_stats = show_stats;
+
+    pool.jobs = jobs;
+    pool.process = fmj_process;
+    pool.output = outfile != NULL && pool.output_dir == NULL ? openfile(outfile, "w") : stdout;
+    pool.contexts = (void **)xalloc(jobs * sizeof(void *));
+    contexts = (fmj_context *)xrealloc(ctx, jobs * sizeof(fmj_context));
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            init_fmj_worker(&contexts[i], &contexts[0]);
         }
-    } else {
-        input = openfile(argv[argindex], "r");
-        if((errcode = setjmp(top)) == 0) {
-            parse_json_root(input);
+        pool.contexts[i] = &contexts[i];
+    }
+    errcode = run_file_pool(&pool);
+
+    for(i = 0; i < jobs; i++) {
+        if(i > 0) {
+            add_stats(&contexts[0].stats, &contexts[i].stats);
         }
-        fclose(input);
+        free_fmj_context(&contexts[i]);
+    }
+    if(show_stats) {
+        print_stats("fmj", &contexts[0].stats);
     }
-    writech('\n');
-    if(outfile != NULL) {
-        fclose(fpout);
+    if(pool.output != stdout) {
+        fclose(pool.output);
     }
+    xfree(pool.contexts);
+    xfree(contexts);
+    free_file_pool(&pool);
     return errcode;
 }
-
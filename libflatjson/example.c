@@ -0,0 +1,69 @@
+/*
+ * libflatjson example
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include "flatjson.h"
+
+/*
+ * prints the leaves of a JSON file, or the standard input, by the pull API as "path<TAB>value",
+ * where the path is joined by '.' and an index is prefixed by '@'.
+ * The number of the leaves is counted by the callback API.
+ */
+static int count_leaf(void *user, const flatjson_value *value) {
+    (void)value;
+    (*(long *)user)++;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    flatjson_parser *parser;
+    flatjson_value value;
+    FILE *fp = stdin;
+    long count = 0;
+    int i, result;
+
+    if(argc > 1 && (fp = fopen(argv[1], "r")) == NULL) {
+        fprintf(stderr, "cannot open file %s\n", argv[1]);
+        return 4;
+    } else if((parser = flatjson_new(0)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 8;
+    }
+
+    flatjson_set_file(parser, fp);
+    while((result = flatjson_next(parser, &value)) > 0) {
+        for(i = 0; i < value.depth; i++) {
+            if(i > 0) {
+                putchar('.');
+            }
+            if(value.path[i].key == NULL) {
+                printf("@%ld", value.path[i].index);
+            } else {
+                fwrite(value.path[i].key, 1, value.path[i].key_length, stdout);
+            }
+        }
+        putchar('\t');
+        fwrite(value.value, 1, value.length, stdout);
+        putchar('\n');
+    }
+
+    if(result == 0) {
+        flatjson_set_buffer(parser, "[1,{\"a\":[true,null]}]", 21);
+        result = flatjson_parse(parser, count_leaf, &count);
+        fprintf(stderr, "%ld leaves in the buffer\n", count);
+    }
+    if(result < 0) {
+        fprintf(stderr, "%s\n", flatjson_error(parser));
+    }
+    flatjson_free(parser);
+    if(fp != stdin) {
+        fclose(fp);
+    }
+    return result < 0 ? 4 : 0;
+}
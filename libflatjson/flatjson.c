@@ -0,0 +1,463 @@
+/*
+ * libflatjson
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include "flatjson.h"
+#include "../common.h"
+
+#define INIT_STRING_LENGTH 64
+#define INIT_DEPTH 16
+
+enum state_parser {
+    PARSER_VALUE,
+    PARSER_ARRAY_FIRST,
+    PARSER_OBJECT_FIRST,
+    PARSER_KEY,
+    PARSER_COLON,
+    PARSER_NEXT,
+    PARSER_END,
+    PARSER_ERROR
+};
+
+/* a buffer of the parser, which fails by "out of memory" instead of exiting as string_buffer of common.c does. */
+typedef struct text_buffer {
+    char *value;
+    size_t length;
+    size_t size;
+} text_buffer;
+
+/* a frame of object or array. The segment of the frame is path[depth]. */
+typedef struct frame {
+    char type;
+    text_buffer key;
+} frame;
+
+struct flatjson_parser {
+    int flags;
+    FILE *fp;
+    char *block;
+    const char *ptr;
+    const char *end;
+    text_buffer token;
+    frame *frames;
+    flatjson_segment *path;
+    int depth;
+    int size;
+    enum state_parser state;
+    char error[64];
+    jmp_buf top;
+};
+
+static void fail(flatjson_parser *parser, const char *message) {
+    strncpy(parser->error, message, sizeof(parser->error) - 1);
+    parser->error[sizeof(parser->error) - 1] = '\0';
+    parser->state = PARSER_ERROR;
+    longjmp(parser->top, 1);
+}
+
+static void *parser_alloc(flatjson_parser *parser, void *ptr, size_t size) {
+    void *result;
+
+    if((result = realloc(ptr, size)) == NULL) {
+        fail(parser, "out of memory");
+    }
+    return result;
+}
+
+static void append_string(flatjson_parser *parser, text_buffer *buffer, const char *str, size_t length) {
+    if(buffer->length + length + 1 > buffer->size) {
+        buffer->size = buffer->size == 0 ? INIT_STRING_LENGTH : buffer->size;
+        while(buffer->length + length + 1 > buffer->size) {
+            buffer->size *= 2;
+        }
+        buffer->value = (char *)parser_alloc(parser, buffer->value, buffer->size);
+    }
+    memcpy(buffer->value + buffer->length, str, length);
+    buffer->length += length;
+    buffer->value[buffer->length] = '\0';
+}
+
+static void append_char(flatjson_parser *parser, text_buffer *buffer, int ch) {
+    char c = (char)ch;
+
+    append_string(parser, buffer, &c, 1);
+}
+
+static int fill(flatjson_parser *parser) {
+    size_t length;
+
+    if(parser->fp == NULL) {
+        return 0;
+    } else if(parser->block == NULL) {
+        parser->block = (char *)parser_alloc(parser, NULL, BLOCK_SIZE);
+    }
+    if((length = fread(parser->block, 1, BLOCK_SIZE, parser->fp)) == 0) {
+        return 0;
+    }
+    parser->ptr = parser->block;
+    parser->end = parser->block + length;
+    return 1;
+}
+
+static int read_byte(flatjson_parser *parser) {
+    if(parser->ptr == parser->end && !fill(parser)) {
+        return EOF;
+    }
+    return (unsigned char)*parser->ptr++;
+}
+
+static void unread_byte(flatjson_parser *parser, int ch) {
+    if(ch != EOF) {
+        parser->ptr--;
+    }
+}
+
+static int next_byte(flatjson_parser *parser) {
+    int ch;
+
+    while((ch = read_byte(parser)) == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
+    return ch;
+}
+
+/* reads XXXX of \uXXXX. The escape is kept in buffer as it is unless FLATJSON_EXPAND_ESCAPE is specified. */
+static void read_unicode_escape(flatjson_parser *parser, text_buffer *buffer, char *hex) {
+    int i, ch;
+
+    for(i = 0; i < 4; i++) {
+        if((ch = read_byte(parser)) == EOF) {
+            fail(parser, "unexpected EOF");
+        }
+        hex[i] = (char)ch;
+    }
+    if(!(parser->flags & FLATJSON_EXPAND_ESCAPE)) {
+        append_string(parser, buffer, "\\u", 2);
+        append_string(parser, buffer, hex, 4);
+    }
+}
+
+/* parses \uXXXX or a surrogate pair \uXXXX\uXXXX after '\\' and 'u' by the decoder of common.c, as flatj does. */
+static void parse_unicode_escape(flatjson_parser *parser, text_buffer *buffer) {
+    char hex[4], utf8[4];
+    int codepoint;
+
+    read_unicode_escape(parser, buffer, hex);
+    if(is_high_surrogate(codepoint = decode_unicode_escape(hex))) {
+        if(read_byte(parser) != '\\' || read_byte(parser) != 'u') {
+            codepoint = ESCAPE_SURROGATE;
+        } else {
+            read_unicode_escape(parser, buffer, hex);
+            codepoint = decode_surrogate_pair(codepoint, hex);
+        }
+    }
+    if(codepoint < 0) {
+        fail(parser, escape_error(codepoint));
+    } else if(parser->flags & FLATJSON_EXPAND_ESCAPE) {
+        append_string(parser, buffer, utf8, encode_utf8(utf8, codepoint));
+    }
+}
+
+/*
+ * parses a string after '"' into buffer.
+ * Runs are found by string_run() and control characters are skipped, as flatj does.
+ */
+static void parse_string(flatjson_parser *parser, text_buffer *buffer) {
+    const char *start;
+    int ch, decoded;
+
+    buffer->length = 0;
+    append_string(parser, buffer, "", 0);
+    while(1) {
+        start = parser->ptr;
+        parser->ptr += string_run(parser->ptr, parser->end);
+        append_string(parser, buffer, start, parser->ptr - start);
+
+        if((ch = read_byte(parser)) == EOF) {
+            fail(parser, "unexpected EOF");
+        } else if(ch == '\"') {
+            return;
+        } else if(ch != '\\') {
+            if(ch >= 0x20) {
+                /* the rest of a run split by the end of block */
+                append_char(parser, buffer, ch);
+            }
+            continue;
+        }
+
+        if((ch = read_byte(parser)) == EOF) {
+            fail(parser, "unexpected EOF");
+        } else if(ch == 'u') {
+            parse_unicode_escape(parser, buffer);
+        } else if((decoded = decode_escape(ch)) < 0) {
+            fail(parser, escape_error(ESCAPE_INVALID));
+        } else if(parser->flags & FLATJSON_EXPAND_ESCAPE) {
+            append_char(parser, buffer, decoded);
+        } else {
+            append_char(parser, buffer, '\\');
+            append_char(parser, buffer, ch);
+        }
+    }
+}
+
+static void parse_digits(flatjson_parser *parser) {
+    int ch;
+
+    if(!isdigit(ch = read_byte(parser))) {
+        fail(parser, "invalid number");
+    }
+    do {
+        append_char(parser, &parser->token, ch);
+    } while(isdigit(ch = read_byte(parser)));
+    unread_byte(parser, ch);
+}
+
+/* parses a number whose first character is ch into token */
+static void parse_number(flatjson_parser *parser, int ch) {
+    parser->token.length = 0;
+    if(ch == '-') {
+        append_char(parser, &parser->token, ch);
+        ch = read_byte(parser);
+    }
+    if(ch == '0') {
+        append_char(parser, &parser->token, ch);
+    } else if(isdigit(ch)) {
+        unread_byte(parser, ch);
+        parse_digits(parser);
+    } else {
+        fail(parser, "invalid number");
+    }
+    if((ch = read_byte(parser)) == '.') {
+        append_char(parser, &parser->token, ch);
+        parse_digits(parser);
+        ch = read_byte(parser);
+    }
+    if(ch == 'e' || ch == 'E') {
+        append_char(parser, &parser->token, ch);
+        if((ch = read_byte(parser)) == '+' || ch == '-') {
+            append_char(parser, &parser->token, ch);
+        } else {
+            unread_byte(parser, ch);
+        }
+        parse_digits(parser);
+    } else {
+        unread_byte(parser, ch);
+    }
+}
+
+static flatjson_type parse_literal(flatjson_parser *parser, int ch) {
+    parser->token.length = 0;
+    do {
+        if(parser->token.length >= 5) {
+            fail(parser, "invalid literal");
+        }
+        append_char(parser, &parser->token, ch);
+    } while(isalpha(ch = read_byte(parser)));
+    unread_byte(parser, ch);
+
+    if(strcmp(parser->token.value, "null") == 0) {
+        return FLATJSON_NULL;
+    } else if(strcmp(parser->token.value, "true") == 0) {
+        return FLATJSON_TRUE;
+    } else if(strcmp(parser->token.value, "false") == 0) {
+        return FLATJSON_FALSE;
+    }
+    fail(parser, "invalid literal");
+    return FLATJSON_NULL;
+}
+
+static void push_frame(flatjson_parser *parser, char type) {
+    int size = parser->size;
+
+    if(parser->depth >= parser->size) {
+        parser->size = parser->size == 0 ? INIT_DEPTH : parser->size * 2;
+        parser->frames = (frame *)parser_alloc(parser, parser->frames, parser->size * sizeof(frame));
+        parser->path = (flatjson_segment *)parser_alloc(parser, parser->path, parser->size * sizeof(flatjson_segment));
+        memset(parser->frames + size, 0, (parser->size - size) * sizeof(frame));
+    }
+    parser->frames[parser->depth].type = type;
+    parser->path[parser->depth].key = NULL;
+    parser->path[parser->depth].key_length = 0;
+    parser->path[parser->depth].index = type == '[' ? 0 : -1;
+    parser->depth++;
+}
+
+static void set_value(flatjson_parser *parser, flatjson_value *value, flatjson_type type, const char *literal) {
+    if(literal != NULL) {
+        parser->token.length = 0;
+        append_string(parser, &parser->token, literal, strlen(literal));
+    }
+    value->path = parser->path;
+    value->depth = parser->depth;
+    value->type = type;
+    value->value = parser->token.value;
+    value->length = parser->token.length;
+}
+
+static int parse_next(flatjson_parser *parser, flatjson_value *value) {
+    frame *current;
+    int ch;
+
+    while(1) {
+        ch = next_byte(parser);
+        if(ch == EOF && !(parser->state == PARSER_NEXT && parser->depth == 0)) {
+            fail(parser, "unexpected EOF");
+        }
+        current = parser->depth > 0 ? &parser->frames[parser->depth - 1] : NULL;
+
+        switch(parser->state) {
+        case PARSER_ARRAY_FIRST:
+            if(ch == ']') {
+                parser->depth--;
+                parser->state = PARSER_NEXT;
+                set_value(parser, value, FLATJSON_EMPTY_ARRAY, "[]");
+                return 1;
+            }
+            /* FALLTHROUGH */
+        case PARSER_VALUE:
+            if(ch == '{' || ch == '[') {
+                push_frame(parser, (char)ch);
+                parser->state = ch == '{' ? PARSER_OBJECT_FIRST : PARSER_ARRAY_FIRST;
+                break;
+            }
+            parser->state = PARSER_NEXT;
+            if(ch == '\"') {
+                parse_string(parser, &parser->token);
+                set_value(parser, value, FLATJSON_STRING, NULL);
+            } else if(ch == '-' || isdigit(ch)) {
+                parse_number(parser, ch);
+                set_value(parser, value, FLATJSON_NUMBER, NULL);
+            } else if(isalpha(ch)) {
+                set_value(parser, value, parse_literal(parser, ch), NULL);
+            } else {
+                fail(parser, "invalid JSON");
+            }
+            return 1;
+
+        case PARSER_OBJECT_FIRST:
+            if(ch == '}') {
+                parser->depth--;
+                parser->state = PARSER_NEXT;
+                set_value(parser, value, FLATJSON_EMPTY_OBJECT, "{}");
+                return 1;
+            }
+            /* FALLTHROUGH */
+        case PARSER_KEY:
+            if(ch != '\"') {
+                fail(parser, "string needed");
+            }
+            parse_string(parser, &current->key);
+            parser->path[parser->depth - 1].key = current->key.value;
+            parser->path[parser->depth - 1].key_length = current->key.length;
+            parser->state = PARSER_COLON;
+            break;
+
+        case PARSER_COLON:
+            if(ch != ':') {
+                fail(parser, "colon needed");
+            }
+            parser->state = PARSER_VALUE;
+            break;
+
+        case PARSER_NEXT:
+            if(current == NULL) {
+                if(ch != EOF) {
+                    fail(parser, "extra characters after JSON");
+                }
+                parser->state = PARSER_END;
+                return 0;
+            } else if(ch == ',') {
+                if(current->type == '{') {
+                    parser->state = PARSER_KEY;
+                } else {
+                    parser->path[parser->depth - 1].index++;
+                    parser->state = PARSER_VALUE;
+                }
+            } else if(ch == (current->type == '{' ? '}' : ']')) {
+                parser->depth--;
+            } else {
+                fail(parser, current->type == '{' ? "invalid object" : "invalid array");
+            }
+            break;
+
+        default:
+            return parser->state == PARSER_END ? 0 : -1;
+        }
+    }
+}
+
+flatjson_parser *flatjson_new(int flags) {
+    flatjson_parser *parser;
+
+    if((parser = (flatjson_parser *)calloc(1, sizeof(flatjson_parser))) == NULL) {
+        return NULL;
+    }
+    parser->flags = flags;
+    flatjson_set_buffer(parser, "", 0);
+    return parser;
+}
+
+void flatjson_free(flatjson_parser *parser) {
+    int i;
+
+    if(parser == NULL) {
+        return;
+    }
+    for(i = 0; i < parser->size; i++) {
+        free(parser->frames[i].key.value);
+    }
+    free(parser->frames);
+    free(parser->path);
+    free(parser->token.value);
+    free(parser->block);
+    free(parser);
+}
+
+void flatjson_set_file(flatjson_parser *parser, FILE *fp) {
+    flatjson_set_buffer(parser, NULL, 0);
+    parser->fp = fp;
+}
+
+/* data may be NULL if length is 0, which is an empty document. */
+void flatjson_set_buffer(flatjson_parser *parser, const char *data, size_t length) {
+    parser->fp = NULL;
+    parser->ptr = data;
+    parser->end = data == NULL ? NULL : data + length;
+    parser->depth = 0;
+    parser->state = PARSER_VALUE;
+    parser->error[0] = '\0';
+}
+
+int flatjson_next(flatjson_parser *parser, flatjson_value *value) {
+    if(parser->state == PARSER_END) {
+        return 0;
+    } else if(parser->state == PARSER_ERROR) {
+        return -1;
+    } else if(setjmp(parser->top) != 0) {
+        return -1;
+    }
+    return parse_next(parser, value);
+}
+
+int flatjson_parse(flatjson_parser *parser, flatjson_callback callback, void *user) {
+    flatjson_value value;
+    int result;
+
+    while((result = flatjson_next(parser, &value)) > 0) {
+        if((result = callback(user, &value)) != 0) {
+            return result;
+        }
+    }
+    return result;
+}
+
+const char *flatjson_error(const flatjson_parser *parser) {
+    return parser->error;
+}
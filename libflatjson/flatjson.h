@@ -0,0 +1,92 @@
+/*
+ * libflatjson
+ *
+ * Copyright (c) 2022 Yuichiro MORIGUCHI
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/mit-license.php
+ **/
+#ifndef FLATJSON_H
+#define FLATJSON_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libflatjson parses JSON into the same (path, value) tuples which flatj prints.
+ * All state lives in flatjson_parser, so parsers may be used from many threads
+ * as long as each parser is used by one thread at a time.
+ * flatj prints flat text by its own streaming parser, which builds no path array per leaf,
+ * and uses this library for --diff. Both parsers decode escape sequences and surrogate pairs
+ * by the same functions of common.c, which is linked into the library, so they accept the same strings.
+ * Control characters in strings are skipped as flatj does. See example.c and README.md.
+ */
+
+/* expand escape sequences of string values and keys to their characters encoded by UTF-8 */
+#define FLATJSON_EXPAND_ESCAPE 0x01
+
+typedef enum flatjson_type {
+    FLATJSON_STRING,
+    FLATJSON_NUMBER,
+    FLATJSON_NULL,
+    FLATJSON_TRUE,
+    FLATJSON_FALSE,
+    FLATJSON_EMPTY_OBJECT,
+    FLATJSON_EMPTY_ARRAY
+} flatjson_type;
+
+/* a segment of path is an object key (index is -1) or an array index (key is NULL). */
+typedef struct flatjson_segment {
+    const char *key;
+    size_t key_length;
+    long index;
+} flatjson_segment;
+
+/*
+ * a value and its path.
+ * value is the contents of string without quotes or the text of number, null, true, false, {} or [].
+ * Escape sequences of strings are kept as they are unless FLATJSON_EXPAND_ESCAPE is specified.
+ * value and keys are terminated by '\0' and valid until the next call of the parser.
+ */
+typedef struct flatjson_value {
+    const flatjson_segment *path;
+    int depth;
+    flatjson_type type;
+    const char *value;
+    size_t length;
+} flatjson_value;
+
+typedef struct flatjson_parser flatjson_parser;
+
+/* returns 0 to continue parsing, otherwise flatjson_parse() stops and returns the value. */
+typedef int (*flatjson_callback)(void *user, const flatjson_value *value);
+
+/* returns NULL if out of memory. */
+extern flatjson_parser *flatjson_new(int flags);
+extern void flatjson_free(flatjson_parser *parser);
+
+/*
+ * starts parsing a new document. The parser is reset and its buffers are reused.
+ * data of flatjson_set_buffer() may be NULL if length is 0.
+ */
+extern void flatjson_set_file(flatjson_parser *parser, FILE *fp);
+extern void flatjson_set_buffer(flatjson_parser *parser, const char *data, size_t length);
+
+/* pull API: returns 1 if value is set, 0 at the end of document and -1 on error. */
+extern int flatjson_next(flatjson_parser *parser, flatjson_value *value);
+
+/* callback API: returns 0 at the end of document, -1 on error or the value returned by callback. */
+extern int flatjson_parse(flatjson_parser *parser, flatjson_callback callback, void *user);
+
+/* message of the last error */
+extern const char *flatjson_error(const flatjson_parser *parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif